@@ -26,11 +26,12 @@ stack_top:
 .global _start
 _start:
 	movl 	$stack_top, %esp	# Set up the stack
+	xorl	%ebp, %ebp		# End of the frame pointer chain
 	pushl	%ebx			# Push pointer to multiboot info
 	cli				# Disable interrupts
 
 	call 	kernel_main		# Jump to kernel entry point
 
-	# If the function returns, put the computer into an infinite loop.
-loop:
-	jmp	loop
+	# Once it's done, sleep until there's something to do. This never
+	# returns.
+	call	idle
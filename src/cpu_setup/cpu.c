@@ -0,0 +1,106 @@
+// CPU feature detection
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "klog.h"
+#include "string.h"
+
+// The ID bit in EFLAGS can only be flipped if the CPU supports CPUID
+#define EFLAGS_ID (1 << 21)
+
+// Control register bits needed for SSE
+#define CR0_MP         (1 << 1)  // wait/fwait respect the TS flag
+#define CR0_EM         (1 << 2)  // Emulate the FPU
+#define CR4_OSFXSR     (1 << 9)  // We support fxsave/fxrstor, and so SSE
+#define CR4_OSXMMEXCPT (1 << 10) // We handle SIMD exceptions
+
+static uint32_t features = 0;
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+		uint32_t *edx)
+{
+	__asm__ volatile ("cpuid"
+			: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+			: "a" (leaf));
+}
+
+static bool have_cpuid()
+{
+	uint32_t before, after;
+
+	__asm__ volatile (
+			"pushfl\n"
+			"pushfl\n"
+			"popl %0\n"
+			"movl %0, %1\n"
+			"xorl %2, %1\n"
+			"pushl %1\n"
+			"popfl\n"
+			"pushfl\n"
+			"popl %1\n"
+			"popfl\n"
+			: "=&r" (before), "=&r" (after)
+			: "i" (EFLAGS_ID));
+
+	return ((before ^ after) & EFLAGS_ID) != 0;
+}
+
+static void enable_sse()
+{
+	uint32_t cr0, cr4;
+
+	__asm__ volatile ("mov %%cr0, %0" : "=r" (cr0));
+	cr0 &= ~CR0_EM;
+	cr0 |=  CR0_MP;
+	__asm__ volatile ("mov %0, %%cr0" :: "r" (cr0));
+
+	__asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+	cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+	__asm__ volatile ("mov %0, %%cr4" :: "r" (cr4));
+}
+
+void init_cpu()
+{
+	if (!have_cpuid()) {
+		klog(KLOG_INFO, " No CPUID, assuming no optional features");
+		return;
+	}
+
+	uint32_t max_leaf;
+	char     vendor[13];
+	cpuid(0, &max_leaf, (uint32_t*)&vendor[0], (uint32_t*)&vendor[8],
+			(uint32_t*)&vendor[4]);
+	vendor[12] = '\0';
+
+	if (max_leaf >= 1) {
+		uint32_t eax, ebx, ecx;
+		cpuid(1, &eax, &ebx, &ecx, &features);
+	}
+
+	klog(KLOG_INFO, " %s:%s%s%s%s", vendor,
+			cpu_has(CPUID_PSE)  ? " pse"  : "",
+			cpu_has(CPUID_PGE)  ? " pge"  : "",
+			cpu_has(CPUID_TSC)  ? " tsc"  : "",
+			cpu_has(CPUID_SSE2) ? " sse2" : "");
+
+	// Build with -DNO_SSE2 to compare against the plain string functions
+#ifndef NO_SSE2
+	if (cpu_has(CPUID_FXSR | CPUID_SSE | CPUID_SSE2)) {
+		enable_sse();
+		string_enable_sse2();
+	}
+#endif
+}
+
+bool cpu_has(uint32_t feature)
+{
+	return (features & feature) == feature;
+}
+
+uint64_t rdtsc()
+{
+	uint64_t tsc;
+	__asm__ volatile ("rdtsc" : "=A" (tsc));
+	return tsc;
+}
@@ -0,0 +1,365 @@
+// Finding the other CPUs and the I/O APIC, from the firmware's ACPI or MP
+// tables
+//
+// ACPI's MADT lists every CPU's local APIC, and is what anything recent has.
+// Older machines (and some emulators) only have the Intel MultiProcessor
+// Specification's tables instead, which list the same thing. Both are found
+// by searching the BIOS areas of low memory for a signature.
+//
+// They also say where the I/O APIC is, and which of its inputs each ISA IRQ
+// is wired to where that isn't the obvious one, like the PIT usually being
+// on input 2. Only the first I/O APIC is used, as that's the one with the
+// ISA IRQs on.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu_tables.h"
+#include "klog.h"
+#include "page.h"
+#include "string.h"
+
+// Where to look for the RSDP or MP floating pointer: the first KiB of the
+// Extended BIOS Data Area, whose segment is in the BIOS Data Area, then the
+// BIOS ROM
+#define EBDA_SEG_PTR   0x40E
+#define EBDA_SEARCH    0x400
+#define BIOS_ROM_START 0xE0000
+#define BIOS_ROM_END   0x100000
+
+// Both are on 16 byte boundaries
+#define SIG_ALIGN      16
+
+#define DEFAULT_LAPIC  0xFEE00000
+
+// ACPI
+
+typedef struct Rsdp
+{
+	char     signature[8]; // "RSD PTR "
+	uint8_t  checksum;
+	char     oem_id[6];
+	uint8_t  revision;
+	uint32_t rsdt_addr;
+} __attribute__((packed)) Rsdp;
+
+typedef struct Sdt_header
+{
+	char     signature[4];
+	uint32_t length;       // Including the header
+	uint8_t  revision;
+	uint8_t  checksum;
+	char     oem_id[6];
+	char     oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed)) Sdt_header;
+
+typedef struct Madt
+{
+	Sdt_header header;      // "APIC"
+	uint32_t   lapic_addr;
+	uint32_t   flags;
+	uint8_t    entries[];
+} __attribute__((packed)) Madt;
+
+// MADT entry types
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_IRQ_OVERRIDE   2
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED  0x01
+
+// Interrupt flags, in both MADT overrides and MP interrupt entries. Each
+// field is 0 for whatever's normal for the bus.
+#define POLARITY_MASK       0x03
+#define POLARITY_LOW        0x03
+#define TRIGGER_MASK        0x0C
+#define TRIGGER_LEVEL       0x0C
+
+// MP tables
+
+typedef struct Mp_float
+{
+	char     signature[4]; // "_MP_"
+	uint32_t config_addr;
+	uint8_t  length;       // In 16 byte units
+	uint8_t  spec_rev;
+	uint8_t  checksum;
+	uint8_t  features[5];
+} __attribute__((packed)) Mp_float;
+
+typedef struct Mp_config
+{
+	char     signature[4]; // "PCMP"
+	uint16_t length;       // Of the header and the entries
+	uint8_t  spec_rev;
+	uint8_t  checksum;
+	char     oem_id[8];
+	char     product_id[12];
+	uint32_t oem_table;
+	uint16_t oem_table_size;
+	uint16_t entry_count;
+	uint32_t lapic_addr;
+	uint16_t ext_length;
+	uint8_t  ext_checksum;
+	uint8_t  reserved;
+	uint8_t  entries[];
+} __attribute__((packed)) Mp_config;
+
+// Processor entries are 20 bytes, and all the others 8
+#define MP_PROCESSOR       0
+#define MP_BUS             1
+#define MP_IOAPIC          2
+#define MP_IO_INTERRUPT    3
+#define MP_PROCESSOR_SIZE  20
+#define MP_ENTRY_SIZE      8
+
+#define MP_CPU_ENABLED     0x01
+#define MP_IOAPIC_ENABLED  0x01
+#define MP_INT_VECTORED    0 // As opposed to NMI, SMI or ExtINT
+#define MP_NO_BUS          0xFF
+
+// In the floating pointer's second feature byte
+#define MP_IMCR_PRESENT    0x80
+
+static Cpu_tables tables;
+static bool       tables_found = false;
+
+static bool checksum_ok(const void *table, size_t len)
+{
+	const uint8_t *bytes = table;
+	uint8_t        sum   = 0;
+
+	for (size_t i = 0; i < len; i++)
+		sum += bytes[i];
+
+	return sum == 0;
+}
+
+// Look for a structure starting with sig in [start, end), with a valid
+// checksum over its first len bytes
+static void *search(uintptr_t start, uintptr_t end, const char *sig,
+		size_t sig_len, size_t len)
+{
+	for (uintptr_t addr = start; addr + len <= end; addr += SIG_ALIGN)
+		if (memcmp((void*)addr, sig, sig_len) == 0 &&
+				checksum_ok((void*)addr, len))
+			return (void*)addr;
+
+	return NULL;
+}
+
+// Low memory is identity mapped, so this can just look
+static void *search_bios(const char *sig, size_t sig_len, size_t len)
+{
+	uintptr_t ebda  = (uintptr_t)*(uint16_t*)EBDA_SEG_PTR << 4;
+	void     *found = NULL;
+
+	if (ebda != 0)
+		found = search(ebda, ebda + EBDA_SEARCH, sig, sig_len, len);
+	if (found == NULL)
+		found = search(BIOS_ROM_START, BIOS_ROM_END, sig, sig_len, len);
+
+	return found;
+}
+
+static void add_cpu(uint8_t apic_id)
+{
+	if (tables.num_cpus < MAX_TABLE_CPUS)
+		tables.apic_ids[tables.num_cpus++] = apic_id;
+}
+
+static void add_ioapic(uintptr_t addr, uint32_t gsi_base)
+{
+	if (tables.ioapic_addr == 0) {
+		tables.ioapic_addr     = addr;
+		tables.ioapic_gsi_base = gsi_base;
+	}
+}
+
+static void add_irq(uint8_t irq, uint32_t gsi, uint16_t flags)
+{
+	if (irq >= NUM_ISA_IRQS)
+		return;
+
+	tables.irq_gsi[irq]   = gsi;
+	tables.irq_flags[irq] = 0;
+	if ((flags & POLARITY_MASK) == POLARITY_LOW)
+		tables.irq_flags[irq] |= IRQ_ACTIVE_LOW;
+	if ((flags & TRIGGER_MASK) == TRIGGER_LEVEL)
+		tables.irq_flags[irq] |= IRQ_LEVEL;
+}
+
+// ACPI tables can be anywhere, usually near the top of RAM, so they need
+// mapping in. Returns NULL if the table's checksum is wrong.
+static Sdt_header *map_table(uintptr_t addr)
+{
+	Sdt_header *header = map_phys(addr, sizeof(Sdt_header), false);
+	map_phys(addr, header->length, false);
+
+	return checksum_ok(header, header->length) ? header : NULL;
+}
+
+static bool read_madt(Madt *madt)
+{
+	tables.lapic_addr = madt->lapic_addr;
+
+	uint8_t *entry = madt->entries;
+	uint8_t *end   = (uint8_t*)madt + madt->header.length;
+
+	// Each entry starts with its type and length
+	for (; entry + 2 <= end && entry[1] != 0; entry += entry[1]) {
+		switch (entry[0]) {
+		case MADT_LAPIC:
+			// ACPI processor ID, APIC ID, then flags
+			if (*(uint32_t*)&entry[4] & MADT_LAPIC_ENABLED)
+				add_cpu(entry[3]);
+			break;
+		case MADT_IOAPIC:
+			// ID, reserved, address, then its first input's GSI
+			add_ioapic(*(uint32_t*)&entry[4], *(uint32_t*)&entry[8]);
+			break;
+		case MADT_IRQ_OVERRIDE:
+			// Bus (always ISA), IRQ, GSI, then flags
+			add_irq(entry[3], *(uint32_t*)&entry[4],
+					*(uint16_t*)&entry[8]);
+			break;
+		case MADT_LAPIC_OVERRIDE:
+			// 64-bit address, but we can't get above 4 GiB anyway
+			tables.lapic_addr = *(uint32_t*)&entry[4];
+			break;
+		}
+	}
+
+	return tables.num_cpus > 0;
+}
+
+static bool read_acpi()
+{
+	Rsdp *rsdp = search_bios("RSD PTR ", 8, sizeof(Rsdp));
+	if (rsdp == NULL)
+		return false;
+
+	Sdt_header *rsdt = map_table(rsdp->rsdt_addr);
+	if (rsdt == NULL || memcmp(rsdt->signature, "RSDT", 4) != 0)
+		return false;
+
+	// The RSDT is just the addresses of all the other tables
+	uint32_t *addrs = (uint32_t*)(rsdt + 1);
+	size_t    count = (rsdt->length - sizeof(Sdt_header)) / sizeof(uint32_t);
+
+	for (size_t i = 0; i < count; i++) {
+		Sdt_header *table = map_table(addrs[i]);
+		if (table != NULL && memcmp(table->signature, "APIC", 4) == 0)
+			return read_madt((Madt*)table);
+	}
+
+	return false;
+}
+
+static bool read_mp()
+{
+	Mp_float *mp = search_bios("_MP_", 4, sizeof(Mp_float));
+
+	// No config table means one of the spec's default configurations,
+	// which are all for two CPUs with ancient APICs. Not worth bothering.
+	if (mp == NULL || mp->config_addr == 0)
+		return false;
+
+	Mp_config *config = map_phys(mp->config_addr, sizeof(Mp_config), false);
+	map_phys(mp->config_addr, config->length, false);
+	if (memcmp(config->signature, "PCMP", 4) != 0 ||
+			!checksum_ok(config, config->length))
+		return false;
+
+	tables.lapic_addr = config->lapic_addr;
+	tables.imcr       = mp->features[1] & MP_IMCR_PRESENT;
+
+	// Buses come before the interrupts on them, and I/O APICs before the
+	// interrupts going to them
+	uint8_t  isa_bus   = MP_NO_BUS;
+	uint8_t  ioapic_id = 0;
+	uint8_t *entry     = config->entries;
+
+	for (uint16_t i = 0; i < config->entry_count; i++) {
+		switch (entry[0]) {
+		case MP_PROCESSOR:
+			// Type, APIC ID, APIC version, then flags
+			if (entry[3] & MP_CPU_ENABLED)
+				add_cpu(entry[1]);
+			entry += MP_PROCESSOR_SIZE;
+			continue;
+		case MP_BUS:
+			// Type, bus ID, then its type as 6 padded characters
+			if (memcmp(&entry[2], "ISA", 3) == 0)
+				isa_bus = entry[1];
+			break;
+		case MP_IOAPIC:
+			// Type, ID, version, flags, then address
+			if ((entry[3] & MP_IOAPIC_ENABLED) && tables.ioapic_addr == 0) {
+				ioapic_id = entry[1];
+				add_ioapic(*(uint32_t*)&entry[4], 0);
+			}
+			break;
+		case MP_IO_INTERRUPT:
+			// Type, interrupt type, flags, source bus, its IRQ, then
+			// destination I/O APIC and its input
+			if (entry[1] == MP_INT_VECTORED && entry[4] == isa_bus &&
+					entry[6] == ioapic_id)
+				add_irq(entry[5], entry[7], *(uint16_t*)&entry[2]);
+			break;
+		}
+
+		entry += MP_ENTRY_SIZE;
+	}
+
+	return tables.num_cpus > 0;
+}
+
+// Start from what an ISA machine without any tables would look like
+static void reset_tables()
+{
+	tables.lapic_addr  = DEFAULT_LAPIC;
+	tables.num_cpus    = 0;
+	tables.ioapic_addr = 0;
+	tables.imcr        = false;
+
+	for (uint8_t irq = 0; irq < NUM_ISA_IRQS; irq++) {
+		tables.irq_gsi[irq]   = irq;
+		tables.irq_flags[irq] = 0;
+	}
+}
+
+// Read whichever of the tables there are. Returns false if there aren't
+// any.
+bool find_cpu_tables()
+{
+	reset_tables();
+	if (read_acpi()) {
+		klog(KLOG_INFO, " Found %u CPU(s) in the ACPI tables%s",
+				tables.num_cpus,
+				tables.ioapic_addr != 0 ? ", and an I/O APIC" : "");
+		tables_found = true;
+		return true;
+	}
+
+	reset_tables();
+	if (read_mp()) {
+		klog(KLOG_INFO, " Found %u CPU(s) in the MP tables%s",
+				tables.num_cpus,
+				tables.ioapic_addr != 0 ? ", and an I/O APIC" : "");
+		tables_found = true;
+		return true;
+	}
+
+	return false;
+}
+
+// NULL if find_cpu_tables() didn't find any
+const Cpu_tables *cpu_tables()
+{
+	return tables_found ? &tables : NULL;
+}
@@ -4,9 +4,11 @@
  * "base" refers to the base address, the lowest address accessible
  */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include "gdt.h"
+#include "smp.h"
 
 
 typedef struct GDT_entry
@@ -27,36 +29,57 @@ typedef struct GDT_ptr
 
 extern void flush_gdt(uint32_t gdt);
 
-#define NUM_GDT_ENTRIES 5
+#define NUM_GDT_ENTRIES 6
 
-static GDT_entry gdt_entries[NUM_GDT_ENTRIES];
-static GDT_ptr   gdt;
+// Each CPU has its own GDT, which only differs in where the per-CPU segment
+// points
+#define PER_CPU_SEGMENT 5
+#define PER_CPU_SEL     (PER_CPU_SEGMENT * sizeof(GDT_entry))
 
-static void set_gdt_entry(size_t i, uint32_t base, uint32_t limit,
-		uint8_t access, uint8_t gran)
+static GDT_entry gdt_entries[MAX_CPUS][NUM_GDT_ENTRIES];
+static GDT_ptr   gdts[MAX_CPUS];
+
+static void set_gdt_entry(GDT_entry *entries, size_t i, uint32_t base,
+		uint32_t limit, uint8_t access, uint8_t gran)
 {
-	gdt_entries[i].base_low  =  base & 0xFFFF;
-	gdt_entries[i].base_mid  = (base >> 16) & 0xFF;
-	gdt_entries[i].base_high =  base >> 24;
+	entries[i].base_low  =  base & 0xFFFF;
+	entries[i].base_mid  = (base >> 16) & 0xFF;
+	entries[i].base_high =  base >> 24;
 
-	gdt_entries[i].limit_low = limit & 0xFFFF;
+	entries[i].limit_low = limit & 0xFFFF;
 
-	gdt_entries[i].gran      = (limit >> 16) & 0xF;
-	gdt_entries[i].gran     |= gran & 0xF0;
+	entries[i].gran      = (limit >> 16) & 0xF;
+	entries[i].gran     |= gran & 0xF0;
 
-	gdt_entries[i].access    = access;
+	entries[i].access    = access;
 }
 
-void init_gdt()
+// Load a GDT for the CPU we're running on, with %gs pointing at its Cpu.
+// Nothing can use this_cpu() until this is done.
+void init_cpu_gdt(Cpu *cpu)
 {
-	gdt.limit = (sizeof(GDT_entry) * NUM_GDT_ENTRIES) - 1;
-	gdt.base  = (uintptr_t)&gdt_entries;
+	GDT_entry *entries = gdt_entries[cpu->id];
+	GDT_ptr   *gdt     = &gdts[cpu->id];
+
+	gdt->limit = (sizeof(GDT_entry) * NUM_GDT_ENTRIES) - 1;
+	gdt->base  = (uintptr_t)entries;
+
+	set_gdt_entry(entries, 0, 0, 0,          0,    0);    // Null segment
+	set_gdt_entry(entries, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code segment
+	set_gdt_entry(entries, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment
+	set_gdt_entry(entries, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User code
+	set_gdt_entry(entries, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User data
 
-	set_gdt_entry(0, 0, 0,          0,    0);    // Null segment
-	set_gdt_entry(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code segment
-	set_gdt_entry(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment
-	set_gdt_entry(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
-	set_gdt_entry(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
+	// Byte granularity, as it's only as big as a Cpu
+	cpu->self = cpu;
+	set_gdt_entry(entries, PER_CPU_SEGMENT, (uintptr_t)cpu, sizeof(Cpu) - 1,
+			0x92, 0x40);
 
-	flush_gdt((uintptr_t)&gdt);
+	flush_gdt((uintptr_t)gdt);
+	__asm__ volatile ("mov %0, %%gs" :: "r" ((uint16_t)PER_CPU_SEL));
+}
+
+void init_gdt()
+{
+	init_cpu_gdt(&cpus[0]);
 }
@@ -30,7 +30,13 @@ EXISR(14); EXISR(15); EXISR(16); EXISR(17); EXISR(18); EXISR(19); EXISR(20);
 EXISR(21); EXISR(22); EXISR(23); EXISR(24); EXISR(25); EXISR(26); EXISR(27);
 EXISR(28); EXISR(29); EXISR(30); EXISR(31); EXISR(32); EXISR(33); EXISR(34);
 EXISR(35); EXISR(36); EXISR(37); EXISR(38); EXISR(39); EXISR(40); EXISR(41);
-EXISR(42); EXISR(43); EXISR(44); EXISR(45); EXISR(46); EXISR(47);
+EXISR(42); EXISR(43); EXISR(44); EXISR(45); EXISR(46); EXISR(47); EXISR(48);
+EXISR(49); EXISR(50); EXISR(51); EXISR(52); EXISR(53); EXISR(54); EXISR(55);
+EXISR(56); EXISR(57); EXISR(58); EXISR(59); EXISR(60); EXISR(61); EXISR(62);
+EXISR(63); EXISR(64); EXISR(65); EXISR(66); EXISR(67); EXISR(68); EXISR(69);
+EXISR(70); EXISR(71); EXISR(72); EXISR(73); EXISR(74); EXISR(75); EXISR(76);
+EXISR(77); EXISR(78); EXISR(79); EXISR(224); EXISR(240); EXISR(241);
+EXISR(255);
 
 extern void flush_idt(uintptr_t idt);
 
@@ -76,7 +82,7 @@ void init_idt()
 
 	memset(&idt_entries, 0, sizeof(IDT_entry) * NUM_IDT_ENTRIES);
 
-	// Set IDT entries 0-47
+	// Exceptions, then IRQs at each priority, then the local APIC's own
 	SET_IDT(0);  SET_IDT(1);  SET_IDT(2);  SET_IDT(3);  SET_IDT(4);
 	SET_IDT(5);  SET_IDT(6);  SET_IDT(7);  SET_IDT(8);  SET_IDT(9);
 	SET_IDT(10); SET_IDT(11); SET_IDT(12); SET_IDT(13); SET_IDT(14);
@@ -86,7 +92,21 @@ void init_idt()
 	SET_IDT(30); SET_IDT(31); SET_IDT(32); SET_IDT(33); SET_IDT(34);
 	SET_IDT(35); SET_IDT(36); SET_IDT(37); SET_IDT(38); SET_IDT(39);
 	SET_IDT(40); SET_IDT(41); SET_IDT(42); SET_IDT(43); SET_IDT(44);
-	SET_IDT(45); SET_IDT(46); SET_IDT(47);
+	SET_IDT(45); SET_IDT(46); SET_IDT(47); SET_IDT(48); SET_IDT(49);
+	SET_IDT(50); SET_IDT(51); SET_IDT(52); SET_IDT(53); SET_IDT(54);
+	SET_IDT(55); SET_IDT(56); SET_IDT(57); SET_IDT(58); SET_IDT(59);
+	SET_IDT(60); SET_IDT(61); SET_IDT(62); SET_IDT(63); SET_IDT(64);
+	SET_IDT(65); SET_IDT(66); SET_IDT(67); SET_IDT(68); SET_IDT(69);
+	SET_IDT(70); SET_IDT(71); SET_IDT(72); SET_IDT(73); SET_IDT(74);
+	SET_IDT(75); SET_IDT(76); SET_IDT(77); SET_IDT(78); SET_IDT(79);
+	SET_IDT(224); SET_IDT(240); SET_IDT(241);
+	SET_IDT(255);
+
+	load_idt();
+}
 
+// Every CPU shares the one IDT
+void load_idt()
+{
 	flush_idt((uintptr_t)&idt);
 }
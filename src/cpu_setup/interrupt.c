@@ -1,22 +1,63 @@
 // Interrupt stuff
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "apic.h"
+#include "cpu_tables.h"
 #include "dev.h"
 #include "idt.h"
+#include "ioapic.h"
 #include "interrupt.h"
+#include "irq_stats.h"
 #include "term.h"
 #include "panic.h"
+#include "smp.h"
+#include "tasklet.h"
+#include "thread.h"
 
 void disable_interrupts()
 {
 	__asm__ volatile ("cli");
+	irqs_off_begin();
 }
 
 void enable_interrupts()
 {
+	irqs_off_end();
 	__asm__ volatile ("sti");
 }
 
+#define EFLAGS_IF (1 << 9)
+
+// For code that might be called with interrupts already disabled, which
+// mustn't turn them back on when it's done
+uint32_t save_interrupts()
+{
+	uint32_t eflags;
+	__asm__ volatile ("pushf; pop %0; cli" : "=r" (eflags) :: "memory");
+
+	if (eflags & EFLAGS_IF)
+		irqs_off_begin();
+	return eflags;
+}
+
+void restore_interrupts(uint32_t eflags)
+{
+	if (eflags & EFLAGS_IF)
+		enable_interrupts();
+}
+
+// With interrupts disabled, wait for one to come in, and disable them again
+// once it's been handled. An sti doesn't take effect until after the next
+// instruction, so the hlt always goes first, and nothing can get in between
+// whatever the caller checked and halting.
+void wait_for_interrupt()
+{
+	irqs_off_end();
+	__asm__ volatile ("sti; hlt; cli");
+	irqs_off_begin();
+}
+
 static const char *interrupt_names[] =
 {
 	"Division by zero",
@@ -40,33 +81,216 @@ static const char *interrupt_names[] =
 	"Machine check exception"
 };
 
+// Handlers are only registered, never changed, and a pointer gets written in
+// one go, so every CPU can read this without a lock
 static Handler handlers[NUM_IDT_ENTRIES];
 
-void irq_handler(Registers regs)
+#define PIC1_CMD     0x20
+#define PIC1_DATA    0x21
+#define PIC2_CMD     0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
+#define PIC_LAST_IRQ 0x80 // IRQ7 or IRQ15's bit in the ISR
+
+// Some chipsets have to be told to send IRQs to the APICs instead of the
+// 8259s, through the IMCR
+#define IMCR_SELECT  0x22
+#define IMCR_DATA    0x23
+#define IMCR_REG     0x70
+#define IMCR_APIC    0x01
+
+// Set once device IRQs come from the I/O APIC rather than the 8259s
+static bool    ioapic_mode = false;
+
+// Which CPU each IRQ goes to, and at what priority, once they come from the
+// I/O APIC. The timer and the serial port lose out if they're kept waiting,
+// the disk just takes a little longer.
+static uint8_t irq_cpus[NUM_IRQS];
+static uint8_t irq_priorities[NUM_IRQS] =
 {
-	if (regs.int_no >= IRQ8) {
+	IRQ_PRIO_HIGH,   IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL, IRQ_PRIO_HIGH,
+	IRQ_PRIO_HIGH,   IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL,
+	IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL,
+	IRQ_PRIO_NORMAL, IRQ_PRIO_NORMAL, IRQ_PRIO_LOW,    IRQ_PRIO_LOW,
+};
+
+// The PIC raises the lowest priority IRQ on its chip when a request goes
+// away before it can say which one it was. If that IRQ isn't actually in
+// service, it was spurious, and mustn't be acknowledged (although the
+// master still needs an EOI if it came from the slave).
+static bool spurious(uint32_t int_no)
+{
+	if (int_no == IRQ7) {
+		outb(PIC1_CMD, PIC_READ_ISR);
+		return !(inb(PIC1_CMD) & PIC_LAST_IRQ);
+	}
+
+	if (int_no == IRQ15) {
+		outb(PIC2_CMD, PIC_READ_ISR);
+		if (!(inb(PIC2_CMD) & PIC_LAST_IRQ)) {
+			outb(PIC1_CMD, PIC_EOI);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void pic_eoi(uint32_t int_no)
+{
+	if (int_no >= IRQ8) {
 		// This interrupt involved the slave, send reset to it
-		outb(0xA0, 0x20);
+		outb(PIC2_CMD, PIC_EOI);
 	}
 
 	// Reset master
-	outb(0x20, 0x20);
+	outb(PIC1_CMD, PIC_EOI);
+}
+
+// Vectors past the 8259s' are all the local APIC's. It sends the 8259s' on
+// too, before we've switched to the I/O APIC, but they're acknowledged as
+// before.
+static bool from_apic(uint32_t int_no)
+{
+	return ioapic_mode || int_no >= IRQ0 + NUM_IRQS;
+}
 
-	Handler handler = handlers[regs.int_no];
+void irq_handler(Registers regs)
+{
+	irqs_off_begin();
+
+	// The local APIC's spurious interrupts mustn't be acknowledged either
+	if (regs.int_no == APIC_SPURIOUS ||
+			(!from_apic(regs.int_no) && spurious(regs.int_no))) {
+		irq_stats_spurious(regs.int_no);
+		irqs_off_end();
+		return;
+	}
+
+	if (from_apic(regs.int_no))
+		lapic_eoi();
+	else
+		pic_eoi(regs.int_no);
+
+	// Whatever priority it came in at, it's the same IRQ
+	if (regs.int_no >= IRQ0 &&
+			regs.int_no < IRQ0 + NUM_IRQS * IRQ_PRIORITIES)
+		regs.int_no = IRQ0 + (regs.int_no - IRQ0) % NUM_IRQS;
+
+	uint64_t start   = irq_stats_enter();
+	Handler  handler = handlers[regs.int_no];
 	if (handler)
 		handler(regs);
+	irq_stats_exit(regs.int_no, start);
+
+	// If we've interrupted some tasklets, they'll pick up anything new this
+	// handler has scheduled, and we mustn't switch threads out from under
+	// them
+	if (!tasklets_running()) {
+		// Whatever the handler put off, now that other interrupts can
+		// come in
+		run_tasklets();
+
+		// This might switch to another thread, which returns from some
+		// other interrupt. We come back out of this one when this thread
+		// next runs.
+		resched_if_needed();
+	}
+
+	// The iret turns them back on
+	irqs_off_end();
+}
+
+// Point the I/O APIC's input for an IRQ at its CPU, with its priority's
+// vector. CPUs that haven't started yet get the boot CPU's IRQs. Inputs stay
+// masked until there's a handler, as one with nothing attached could be
+// floating, and interrupt for nothing.
+static void program_irq(const Cpu_tables *tables, uint8_t irq)
+{
+	Cpu    *cpu    = &cpus[irq_cpus[irq]];
+	uint8_t vector = IRQ0 + irq + NUM_IRQS * irq_priorities[irq];
+
+	// IRQ2 is just the 8259s' cascade, and its input can be another IRQ's
+	if (irq == 2)
+		return;
+
+	if (!handlers[IRQ0 + irq]) {
+		ioapic_mask(tables->irq_gsi[irq]);
+		return;
+	}
+
+	if (!cpu->online)
+		cpu = &cpus[0];
+
+	ioapic_route(tables->irq_gsi[irq], vector, cpu->apic_id,
+			tables->irq_flags[irq]);
+}
+
+// Send an IRQ to the given CPU, at the given priority. This only makes a
+// difference once there's an I/O APIC; the 8259s only ever interrupt the
+// boot CPU, and have fixed priorities.
+void irq_route(uint8_t irq, uint8_t cpu, uint8_t priority)
+{
+	if (irq >= NUM_IRQS)
+		return;
+
+	irq_cpus[irq]       = cpu < MAX_CPUS ? cpu : 0;
+	irq_priorities[irq] = priority < IRQ_PRIORITIES ? priority :
+		IRQ_PRIORITIES - 1;
+
+	if (ioapic_mode)
+		program_irq(cpu_tables(), irq);
+}
+
+// Switch device IRQs over from the 8259s to the I/O APIC. Anything the 8259s
+// have pending is lost, so whatever's waiting for one has to check again
+// (the timer does, by switching to the local APIC's own).
+void use_ioapic()
+{
+	const Cpu_tables *tables = cpu_tables();
+	uint32_t          eflags = save_interrupts();
+
+	outb(PIC1_DATA, 0xFF);
+	outb(PIC2_DATA, 0xFF);
+	lapic_mask_pic();
+
+	if (tables->imcr) {
+		outb(IMCR_SELECT, IMCR_REG);
+		outb(IMCR_DATA,   IMCR_APIC);
+	}
+
+	for (uint8_t irq = 0; irq < NUM_IRQS; irq++)
+		program_irq(tables, irq);
+
+	ioapic_mode = true;
+	restore_interrupts(eflags);
 }
 
 void isr_handler(Registers regs)
 {
-	Handler handler = handlers[regs.int_no];
+	// Exceptions can happen with interrupts already disabled
+	bool interrupts_were_on = regs.eflags & EFLAGS_IF;
+	if (interrupts_were_on)
+		irqs_off_begin();
+
+	uint64_t start   = irq_stats_enter();
+	Handler  handler = handlers[regs.int_no];
 	if (handler)
 		handler(regs);
 	else
 		PANIC(interrupt_names[regs.int_no]);
+	irq_stats_exit(regs.int_no, start);
+
+	if (interrupts_were_on)
+		irqs_off_end();
 }
 
 void register_interrupt_handler(uint8_t i, Handler handler)
 {
 	handlers[i] = handler;
+
+	// Its input's only unmasked now that something's listening
+	if (ioapic_mode && i >= IRQ0 && i < IRQ0 + NUM_IRQS)
+		program_irq(cpu_tables(), i - IRQ0);
 }
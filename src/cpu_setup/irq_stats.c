@@ -0,0 +1,160 @@
+// Interrupt counts and timings
+//
+// Every interrupt is counted, and how long its handler took goes in a
+// histogram for its vector, so we can see which device is taking up the
+// time. There's also a histogram of how long interrupts stay disabled for,
+// whether by cli or by being in an interrupt handler, as that's how late any
+// other interrupt could be.
+//
+// Times are in TSC cycles, and histogram buckets go up in powers of two.
+// Everything is updated with interrupts disabled. Each CPU keeps track of
+// its own time with interrupts disabled, and the per-vector figures are
+// shared, under a lock.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "div64.h"
+#include "idt.h"
+#include "irq_stats.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "term.h"
+#include "timer.h"
+
+#define NUM_BUCKETS 32
+
+typedef struct Histogram
+{
+	uint32_t buckets[NUM_BUCKETS]; // Bucket i counts 2^i up to 2^(i+1) - 1
+	uint64_t total;
+	uint32_t max;
+	uint32_t count;
+} Histogram;
+
+typedef struct Vector_stats
+{
+	uint32_t  spurious;
+	Histogram time;
+} Vector_stats;
+
+static Vector_stats vectors[NUM_IDT_ENTRIES];
+static Spinlock     vectors_lock = SPINLOCK_INIT;
+
+static Histogram    irqs_off[MAX_CPUS];
+
+// When interrupts were disabled on each CPU, or 0 if they're enabled
+static uint64_t     off_since[MAX_CPUS];
+
+static void record(Histogram *hist, uint64_t cycles)
+{
+	uint32_t x = cycles > UINT32_MAX ? UINT32_MAX : cycles;
+
+	hist->buckets[x == 0 ? 0 : 31 - __builtin_clz(x)]++;
+	hist->total += x;
+	hist->count++;
+	if (x > hist->max)
+		hist->max = x;
+}
+
+uint64_t irq_stats_enter()
+{
+	return cycles();
+}
+
+void irq_stats_exit(uint8_t vector, uint64_t start)
+{
+	uint64_t time = cycles() - start;
+
+	spin_lock(&vectors_lock);
+	record(&vectors[vector].time, time);
+	spin_unlock(&vectors_lock);
+}
+
+// Spurious interrupts don't get handled, so aren't timed
+void irq_stats_spurious(uint8_t vector)
+{
+	spin_lock(&vectors_lock);
+	vectors[vector].spurious++;
+	spin_unlock(&vectors_lock);
+}
+
+// Called when interrupts have just been disabled. Nested calls are fine;
+// it's the first that counts.
+void irqs_off_begin()
+{
+	uint64_t *since = &off_since[cpu_id()];
+
+	// Never 0, even before there's a TSC
+	if (*since == 0)
+		*since = cycles() | 1;
+}
+
+// Called just before interrupts are enabled again
+void irqs_off_end()
+{
+	uint32_t  cpu   = cpu_id();
+	uint64_t *since = &off_since[cpu];
+
+	if (*since != 0) {
+		uint64_t now = cycles();
+		record(&irqs_off[cpu], now > *since ? now - *since : 0);
+		*since = 0;
+	}
+}
+
+static void print_histogram(Histogram *hist)
+{
+	uint64_t mean = hist->total;
+	div64(&mean, hist->count);
+
+	term_printf("    mean %llu, max %u cycles\n    ", mean, hist->max);
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		if (hist->buckets[i] != 0)
+			term_printf(" %u+:%u", i == 0 ? 0 : 1u << i, hist->buckets[i]);
+	}
+	term_printf("\n");
+}
+
+// Copies of everything, to print from. Printing can wait on the serial
+// port, and every interrupt handler on every CPU would be left spinning on
+// vectors_lock meanwhile. They're too big for the stack, but only the
+// keyboard's tasklet prints them, so there's only ever one dump going.
+static Vector_stats vectors_copy[NUM_IDT_ENTRIES];
+static Histogram    irqs_off_copy[MAX_CPUS];
+
+// Print everything so far, to the terminal and any sinks, like the serial
+// port
+void irq_stats_dump()
+{
+	uint32_t eflags = spin_lock_irqsave(&vectors_lock);
+	for (int i = 0; i < NUM_IDT_ENTRIES; i++)
+		vectors_copy[i] = vectors[i];
+	spin_unlock_irqrestore(&vectors_lock, eflags);
+
+	// Each CPU's own is only ever updated by it, so this might catch one
+	// halfway through an update, which just makes it a little out
+	for (uint32_t cpu = 0; cpu < num_cpus; cpu++)
+		irqs_off_copy[cpu] = irqs_off[cpu];
+
+	term_hold();
+
+	term_printf("Vector   Count Spurious\n");
+	for (int i = 0; i < NUM_IDT_ENTRIES; i++) {
+		Vector_stats *stats = &vectors_copy[i];
+		if (stats->time.count == 0 && stats->spurious == 0)
+			continue;
+
+		term_printf("%6u %7u %8u\n", i, stats->time.count, stats->spurious);
+		if (stats->time.count != 0)
+			print_histogram(&stats->time);
+	}
+
+	for (uint32_t cpu = 0; cpu < num_cpus; cpu++) {
+		term_printf("Interrupts disabled %u times on CPU %u\n",
+				irqs_off_copy[cpu].count, cpu);
+		if (irqs_off_copy[cpu].count != 0)
+			print_histogram(&irqs_off_copy[cpu]);
+	}
+
+	term_release();
+}
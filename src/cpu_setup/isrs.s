@@ -1,5 +1,8 @@
 # Interrupt Service Routines
 
+# %gs is left alone, as it points at the per-CPU data (see gdt.c), and is
+# the same everywhere in the kernel
+
 # Common function called by all ISRs
 isr_common:
 	# Push all the registers we want to back up
@@ -12,7 +15,6 @@ isr_common:
 	mov	%ax, %ds
 	mov	%ax, %es
 	mov	%ax, %fs
-	mov	%ax, %gs
 
 	call	isr_handler	# Call our C ISR handler
 
@@ -21,7 +23,6 @@ isr_common:
 	mov	%ax, %ds
 	mov	%ax, %es
 	mov	%ax, %fs
-	mov	%ax, %gs
 
 	popa
 	addl	$8, %esp
@@ -40,7 +41,6 @@ irq_common:
 	mov	%ax, %ds
 	mov	%ax, %es
 	mov	%ax, %fs
-	mov	%ax, %gs
 
 	call	irq_handler	# Call our C IRQ handler
 
@@ -49,7 +49,6 @@ irq_common:
 	mov	%ax, %ds
 	mov	%ax, %es
 	mov	%ax, %fs
-	mov	%ax, %gs
 
 	popa
 	addl	$8, %esp
@@ -136,3 +135,41 @@ IRQ 44
 IRQ 45
 IRQ 46
 IRQ 47
+# The same IRQs at higher priorities, from the I/O APIC
+IRQ 48
+IRQ 49
+IRQ 50
+IRQ 51
+IRQ 52
+IRQ 53
+IRQ 54
+IRQ 55
+IRQ 56
+IRQ 57
+IRQ 58
+IRQ 59
+IRQ 60
+IRQ 61
+IRQ 62
+IRQ 63
+IRQ 64
+IRQ 65
+IRQ 66
+IRQ 67
+IRQ 68
+IRQ 69
+IRQ 70
+IRQ 71
+IRQ 72
+IRQ 73
+IRQ 74
+IRQ 75
+IRQ 76
+IRQ 77
+IRQ 78
+IRQ 79
+# From the local APIC
+IRQ 224
+IRQ 240
+IRQ 241
+IRQ 255
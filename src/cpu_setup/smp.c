@@ -0,0 +1,283 @@
+// Multiprocessor support, and per-CPU data
+//
+// The boot CPU finds the others in the ACPI or MP tables, then starts each in
+// turn by sending it an INIT IPI followed by startup IPIs, as the MP spec
+// says to. That sets it running the trampoline (trampoline.s) in real mode,
+// which gets it into protected mode with paging on and calls ap_main() on a
+// stack of its own. From there it's just another CPU for the scheduler to
+// run threads on.
+//
+// Each CPU has a Cpu in cpus[], which its %gs segment points at (see gdt.c).
+// Everything else that's per-CPU is kept by whatever it belongs to, in
+// arrays indexed by cpu_id().
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "apic.h"
+#include "cpu_tables.h"
+#include "gdt.h"
+#include "idt.h"
+#include "interrupt.h"
+#include "klog.h"
+#include "kmalloc.h"
+#include "page.h"
+#include "panic.h"
+#include "smp.h"
+#include "thread.h"
+#include "timer.h"
+
+#define TRAMPOLINE_ADDR  0x8000
+#define TRAMPOLINE_PAGE  (TRAMPOLINE_ADDR / 0x1000)
+
+#define AP_STACK_SIZE    0x2000 // 8 KiB
+
+// How long to wait at each step of starting a CPU
+#define INIT_DELAY_MS    10
+#define STARTUP_DELAY_US 200
+#define ONLINE_WAIT_MS   100
+
+#define NS_PER_US        1000
+
+#define NMI_VECTOR       2
+
+// How long a panic waits for the other CPUs to stop. Timing it would need
+// the clock to be working, and interrupts on, so it's just a count.
+#define STOP_SPINS       10000000
+
+Cpu      cpus[MAX_CPUS];
+uint32_t num_cpus = 1;
+
+// Each TLB shootdown bumps tlb_gen, and each CPU notes which one it last
+// flushed its TLB for
+static volatile uint32_t tlb_gen = 0;
+static volatile uint32_t tlb_flushed[MAX_CPUS];
+
+// Set once a CPU has panicked, and is stopping the others
+static volatile uint32_t stopping = 0;
+
+// In trampoline.s
+extern uint8_t  trampoline_start[];
+extern uint8_t  trampoline_end[];
+extern uint32_t tramp_cr0;
+extern uint32_t tramp_cr3;
+extern uint32_t tramp_cr4;
+extern uint32_t tramp_stack;
+extern uint32_t tramp_cpu;
+extern uint32_t tramp_entry;
+
+Cpu *this_cpu()
+{
+	Cpu *cpu;
+	__asm__ volatile ("mov %%gs:0, %0" : "=r" (cpu));
+	return cpu;
+}
+
+uint32_t cpu_id()
+{
+	return this_cpu()->id;
+}
+
+bool on_boot_cpu()
+{
+	return this_cpu() == &cpus[0];
+}
+
+void send_resched(uint32_t cpu)
+{
+	lapic_send_ipi(cpus[cpu].apic_id, IPI_RESCHED);
+}
+
+// There's nothing to do but get out of the interrupt, which runs tasklets
+// and reschedules on the way
+static void resched_handler(Registers regs)
+{
+}
+
+// Flush the TLB if there's been a shootdown since we last did
+void tlb_poll()
+{
+	uint32_t cpu = cpu_id();
+	uint32_t gen = tlb_gen;
+
+	if (tlb_flushed[cpu] != gen) {
+		flush_tlb_all();
+		tlb_flushed[cpu] = gen;
+	}
+}
+
+static void tlb_handler(Registers regs)
+{
+	tlb_poll();
+}
+
+// Make the other CPUs forget whatever they've cached of the page tables, once
+// some pages have been unmapped, and wait until they have. They flush when
+// they get the IPI, or if interrupts are disabled, while they wait for a
+// lock or their own shootdown, so this can be waited for with interrupts
+// disabled and locks held.
+void tlb_shootdown()
+{
+	uint32_t self = cpu_id();
+	uint32_t gen  = __sync_add_and_fetch(&tlb_gen, 1);
+
+	for (uint32_t i = 0; i < MAX_CPUS; i++)
+		if (i != self && cpus[i].online)
+			lapic_send_ipi(cpus[i].apic_id, IPI_TLB);
+
+	for (uint32_t i = 0; i < MAX_CPUS; i++) {
+		while (i != self && cpus[i].online &&
+				(int32_t)(tlb_flushed[i] - gen) < 0) {
+			tlb_poll();
+			__asm__ volatile ("pause");
+		}
+	}
+}
+
+// Other CPUs are stopped with an NMI, which gets through whatever they're
+// doing, and they stay stopped, as another NMI can't come in until an iret.
+// One that isn't from a panic is as bad as an exception.
+static void nmi_handler(Registers regs)
+{
+	if (!stopping)
+		PANIC("Non maskable interrupt");
+
+	this_cpu()->online = false;
+	for (;;)
+		__asm__ volatile ("cli; hlt");
+}
+
+// Stop every other CPU, so that nothing else is running while we panic.
+// They could be holding any lock, so whatever we need has to be seized.
+// If another CPU's already doing this, it's going to stop us too.
+void stop_other_cpus()
+{
+	if (__sync_lock_test_and_set(&stopping, 1))
+		for (;;)
+			__asm__ volatile ("cli; hlt");
+
+	if (num_cpus == 1)
+		return;
+
+	lapic_send_nmi_others();
+
+	for (uint32_t i = 0; i < STOP_SPINS; i++) {
+		bool running = false;
+		for (uint32_t cpu = 0; cpu < num_cpus; cpu++)
+			if (cpu != cpu_id() && cpus[cpu].online)
+				running = true;
+		if (!running)
+			return;
+
+		__asm__ volatile ("pause");
+	}
+}
+
+// APs come here from the trampoline, with interrupts disabled
+static void ap_main(Cpu *cpu)
+{
+	init_cpu_gdt(cpu);
+	load_idt();
+	init_lapic_ap();
+	init_threads();
+
+	cpu->online = true;
+	idle();
+}
+
+// Fill in one of the trampoline's fields, in the copy of it
+static void set_tramp(uint32_t *field, uint32_t value)
+{
+	uintptr_t offset = (uintptr_t)field - (uintptr_t)trampoline_start;
+	*(uint32_t*)(TRAMPOLINE_ADDR + offset) = value;
+}
+
+static void copy_trampoline()
+{
+	uint32_t cr0, cr3, cr4;
+	__asm__ volatile ("mov %%cr0, %0" : "=r" (cr0));
+	__asm__ volatile ("mov %%cr3, %0" : "=r" (cr3));
+	__asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+
+	memcpy((void*)TRAMPOLINE_ADDR, trampoline_start,
+			trampoline_end - trampoline_start);
+
+	set_tramp(&tramp_cr0,   cr0);
+	set_tramp(&tramp_cr3,   cr3);
+	set_tramp(&tramp_cr4,   cr4);
+	set_tramp(&tramp_entry, (uintptr_t)ap_main);
+}
+
+// Too short to sleep for
+static void udelay(uint32_t us)
+{
+	uint64_t end = uptime_ns() + (uint64_t)us * NS_PER_US;
+	while (uptime_ns() < end)
+		__asm__ volatile ("pause");
+}
+
+static bool start_ap(Cpu *cpu)
+{
+	// Fault the stack in now, as a page fault on a stack that isn't there
+	// can't push anything, and there's no TSS to switch to another
+	cpu->stack = kmalloc(AP_STACK_SIZE);
+	memset(cpu->stack, 0, AP_STACK_SIZE);
+
+	set_tramp(&tramp_stack, (uintptr_t)cpu->stack + AP_STACK_SIZE);
+	set_tramp(&tramp_cpu,   (uintptr_t)cpu);
+
+	lapic_send_init(cpu->apic_id);
+	msleep(INIT_DELAY_MS);
+
+	// The second one is in case it missed the first
+	lapic_send_startup(cpu->apic_id, TRAMPOLINE_PAGE);
+	udelay(STARTUP_DELAY_US);
+	if (!cpu->online)
+		lapic_send_startup(cpu->apic_id, TRAMPOLINE_PAGE);
+
+	for (int i = 0; i < ONLINE_WAIT_MS && !cpu->online; i++)
+		msleep(1);
+
+	return cpu->online;
+}
+
+// Start the other CPUs that init_apic() found. Without a local APIC or the
+// tables to say where the others are, we just carry on with the one.
+void init_smp()
+{
+	cpus[0].online = true;
+
+	const Cpu_tables *tables = cpu_tables();
+	if (!lapic_present() || tables == NULL) {
+		klog(KLOG_INFO, " No local APIC, only using one CPU");
+		return;
+	}
+
+	register_interrupt_handler(IPI_RESCHED, resched_handler);
+	register_interrupt_handler(IPI_TLB,     tlb_handler);
+	register_interrupt_handler(NMI_VECTOR,  nmi_handler);
+
+	copy_trampoline();
+
+	for (uint32_t i = 0; i < tables->num_cpus && num_cpus < MAX_CPUS; i++) {
+		if (tables->apic_ids[i] == cpus[0].apic_id)
+			continue;
+
+		Cpu *cpu     = &cpus[num_cpus];
+		cpu->id      = num_cpus;
+		cpu->apic_id = tables->apic_ids[i];
+
+		// If it's not up by now, it might still be on its way, using
+		// the trampoline, so it's not safe to start any more
+		if (!start_ap(cpu)) {
+			klog(KLOG_WARN, " CPU with APIC ID %u didn't start",
+					cpu->apic_id);
+			break;
+		}
+
+		num_cpus++;
+	}
+
+	klog(KLOG_INFO, " %u CPU(s) running", num_cpus);
+}
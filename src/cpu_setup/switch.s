@@ -0,0 +1,26 @@
+# Switch from one thread's stack to another's
+
+# void switch_stacks(uint32_t *old_esp, uint32_t new_esp)
+#
+# Saves the callee-saved registers on the current stack, stores the stack
+# pointer in *old_esp, then loads new_esp and pops the other thread's
+# registers back off. The ret returns to wherever the other thread called
+# this from, or to its entry point if it's new.
+.global switch_stacks
+switch_stacks:
+	movl	4(%esp), %eax	# Where to save our stack pointer
+	movl	8(%esp), %edx	# The stack to switch to
+
+	pushl	%ebp
+	pushl	%ebx
+	pushl	%esi
+	pushl	%edi
+
+	movl	%esp, (%eax)
+	movl	%edx, %esp
+
+	popl	%edi
+	popl	%esi
+	popl	%ebx
+	popl	%ebp
+	ret
@@ -0,0 +1,85 @@
+# Where APs start (see smp.c)
+#
+# A startup IPI sets the CPU running in real mode at the start of a page
+# below 1 MiB, so this gets copied to TRAMPOLINE_ADDR first. It can't use
+# any absolute addresses of its own until then, hence all the arithmetic.
+# From there, it switches to protected mode with a temporary GDT, turns on
+# paging the same way the boot CPU has it, and calls ap_main(cpu) on the
+# stack it's been given. The boot CPU fills in the fields at the end before
+# sending the IPI.
+
+.set TRAMPOLINE_ADDR, 0x8000
+.set CR0_PE,          1
+
+.section .text
+.global trampoline_start
+.global trampoline_end
+.global tramp_cr0
+.global tramp_cr3
+.global tramp_cr4
+.global tramp_stack
+.global tramp_cpu
+.global tramp_entry
+
+.code16
+trampoline_start:
+	cli
+	cld
+	xorw	%ax, %ax
+	movw	%ax, %ds
+
+	lgdtl	tramp_gdt_ptr - trampoline_start + TRAMPOLINE_ADDR
+
+	movl	%cr0, %eax
+	orl	$CR0_PE, %eax
+	movl	%eax, %cr0
+
+	ljmpl	$8, $(tramp_32 - trampoline_start + TRAMPOLINE_ADDR)
+
+.code32
+tramp_32:
+	movw	$0x10, %ax
+	movw	%ax, %ds
+	movw	%ax, %es
+	movw	%ax, %fs
+	movw	%ax, %gs
+	movw	%ax, %ss
+
+	# Paging on, with the kernel's page directory. Low memory is identity
+	# mapped, so this carries on where it is.
+	movl	tramp_cr4 - trampoline_start + TRAMPOLINE_ADDR, %eax
+	movl	%eax, %cr4
+	movl	tramp_cr3 - trampoline_start + TRAMPOLINE_ADDR, %eax
+	movl	%eax, %cr3
+	movl	tramp_cr0 - trampoline_start + TRAMPOLINE_ADDR, %eax
+	movl	%eax, %cr0
+
+	movl	tramp_stack - trampoline_start + TRAMPOLINE_ADDR, %esp
+	xorl	%ebp, %ebp		# End of the frame pointer chain
+	pushl	tramp_cpu - trampoline_start + TRAMPOLINE_ADDR
+	movl	tramp_entry - trampoline_start + TRAMPOLINE_ADDR, %eax
+	call	*%eax
+
+	# ap_main() never returns
+1:	cli
+	hlt
+	jmp	1b
+
+.align 8
+tramp_gdt:
+	.quad	0			# Null segment
+	.quad	0x00CF9A000000FFFF	# Code segment
+	.quad	0x00CF92000000FFFF	# Data segment
+tramp_gdt_ptr:
+	.word	tramp_gdt_ptr - tramp_gdt - 1
+	.long	tramp_gdt - trampoline_start + TRAMPOLINE_ADDR
+
+# Filled in by the boot CPU
+.align 4
+tramp_cr0:	.long 0
+tramp_cr3:	.long 0
+tramp_cr4:	.long 0
+tramp_stack:	.long 0
+tramp_cpu:	.long 0
+tramp_entry:	.long 0
+trampoline_end:
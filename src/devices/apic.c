@@ -0,0 +1,178 @@
+// Local APIC
+//
+// Each CPU has its own local APIC, at the same physical address, which it
+// uses to take interrupts and send them to other CPUs (IPIs). Its registers
+// are memory mapped, 16 bytes apart. It also has a timer of its own, which
+// counts down at the bus clock divided by 16.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "apic.h"
+#include "cpu.h"
+#include "cpu_tables.h"
+#include "interrupt.h"
+#include "ioapic.h"
+#include "klog.h"
+#include "page.h"
+#include "smp.h"
+#include "timer.h"
+
+// Register offsets
+#define LAPIC_ID          0x020
+#define LAPIC_TPR         0x080 // Task priority
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0 // Spurious interrupt vector
+#define LAPIC_ESR         0x280 // Error status
+#define LAPIC_ICR_LOW     0x300 // Interrupt command
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_LVT_LINT0   0x350 // Where the 8259s are wired in
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_COUNT 0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define SVR_ENABLE        0x100
+#define LVT_MASKED        0x10000
+#define TIMER_DIV_16      0x3
+
+// Interrupt command fields
+#define ICR_FIXED      0x000
+#define ICR_NMI        0x400
+#define ICR_INIT       0x500
+#define ICR_STARTUP    0x600
+#define ICR_PENDING    0x1000 // Still being delivered
+#define ICR_ASSERT     0x4000
+#define ICR_DEST_SHIFT 24
+#define ICR_ALL_OTHERS 0xC0000 // Every CPU but this one, whatever the ID
+
+#define LAPIC_SIZE     0x400
+
+static volatile uint32_t *lapic = NULL;
+
+static uint32_t lapic_read(uint32_t reg)
+{
+	return lapic[reg / sizeof(uint32_t)];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value)
+{
+	lapic[reg / sizeof(uint32_t)] = value;
+}
+
+// Turn on this CPU's local APIC, and let it take any priority of interrupt.
+// Its timer is one-shot, and stopped until it's given a count.
+void init_lapic_ap()
+{
+	lapic_write(LAPIC_SVR, SVR_ENABLE | APIC_SPURIOUS);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER);
+
+	// Writing clears any errors from before
+	lapic_write(LAPIC_ESR, 0);
+	lapic_write(LAPIC_ESR, 0);
+}
+
+// Called on the boot CPU, with the address from the ACPI or MP tables
+void init_lapic(uintptr_t base)
+{
+	lapic = map_phys(base, LAPIC_SIZE, true);
+	init_lapic_ap();
+}
+
+bool lapic_present()
+{
+	return lapic != NULL;
+}
+
+uint8_t lapic_id()
+{
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Just the one write, rather than the 8259s' one or two port writes
+void lapic_eoi()
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+// Stop taking interrupts from the 8259s, once they're masked
+void lapic_mask_pic()
+{
+	lapic_write(LAPIC_LVT_LINT0, lapic_read(LAPIC_LVT_LINT0) | LVT_MASKED);
+}
+
+// Interrupt this CPU after count timer ticks. 0 stops it.
+void lapic_timer_start(uint32_t count)
+{
+	lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+// How many ticks are left
+uint32_t lapic_timer_count()
+{
+	return lapic_read(LAPIC_TIMER_COUNT);
+}
+
+static void send_icr(uint8_t apic_id, uint32_t command)
+{
+	// Nothing else can send one in between writing the two halves
+	uint32_t eflags = save_interrupts();
+
+	lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << ICR_DEST_SHIFT);
+	lapic_write(LAPIC_ICR_LOW, command);
+
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING)
+		__asm__ volatile ("pause");
+
+	restore_interrupts(eflags);
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+	send_icr(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+// An NMI gets through even with interrupts disabled
+void lapic_send_nmi_others()
+{
+	send_icr(0, ICR_NMI | ICR_ASSERT | ICR_ALL_OTHERS);
+}
+
+// Reset another CPU, so it waits for a startup IPI
+void lapic_send_init(uint8_t apic_id)
+{
+	send_icr(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+// Start another CPU off in real mode, at page * 4 KiB
+void lapic_send_startup(uint8_t apic_id, uint8_t page)
+{
+	send_icr(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+}
+
+// Use the local APICs, and the I/O APIC if there is one, if the tables say
+// where they are. Otherwise the 8259s carry on as they are.
+void init_apic()
+{
+	if (!cpu_has(CPUID_APIC)) {
+		klog(KLOG_INFO, " No local APIC, keeping the 8259s");
+		return;
+	}
+
+	if (!find_cpu_tables()) {
+		klog(KLOG_INFO, " No ACPI or MP tables, keeping the 8259s");
+		return;
+	}
+
+	const Cpu_tables *tables = cpu_tables();
+	init_lapic(tables->lapic_addr);
+	cpus[0].apic_id = lapic_id();
+
+	if (tables->ioapic_addr != 0) {
+		init_ioapic(tables->ioapic_addr, tables->ioapic_gsi_base);
+		use_ioapic();
+	}
+
+	timer_use_lapic();
+}
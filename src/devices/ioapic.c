@@ -0,0 +1,112 @@
+// I/O APIC
+//
+// Takes device interrupts in place of the 8259s, and sends each one on to
+// whichever CPU's local APIC its redirection entry says, with the vector it
+// says. Its registers are reached indirectly: write the register number to
+// IOREGSEL, then read or write IOWIN.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu_tables.h"
+#include "ioapic.h"
+#include "page.h"
+#include "spinlock.h"
+
+#define IOREGSEL       0x00
+#define IOWIN          0x10
+
+// Registers
+#define IOAPIC_VER     0x01
+#define IOAPIC_REDTBL  0x10 // Two for each input, low half first
+
+// Number of inputs, less one, in the version register
+#define VER_MAX_REDIR_SHIFT 16
+
+// Redirection entry fields
+#define REDIR_FIXED      0x00000
+#define REDIR_PHYSICAL   0x00000 // Destination is an APIC ID
+#define REDIR_ACTIVE_LOW 0x02000
+#define REDIR_LEVEL      0x08000
+#define REDIR_MASKED     0x10000
+#define REDIR_DEST_SHIFT 24      // In the high half
+
+#define IOAPIC_SIZE    0x20
+
+static volatile uint32_t *ioapic    = NULL;
+static uint32_t           gsi_base;
+static uint32_t           num_inputs;
+
+// Selecting a register and using it have to happen together
+static Spinlock           ioapic_lock = SPINLOCK_INIT;
+
+static uint32_t ioapic_read(uint32_t reg)
+{
+	ioapic[IOREGSEL / sizeof(uint32_t)] = reg;
+	return ioapic[IOWIN / sizeof(uint32_t)];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value)
+{
+	ioapic[IOREGSEL / sizeof(uint32_t)] = reg;
+	ioapic[IOWIN / sizeof(uint32_t)]    = value;
+}
+
+// Returns which input gsi is, or -1 if it isn't one of ours
+static int input(uint32_t gsi)
+{
+	if (gsi < gsi_base || gsi - gsi_base >= num_inputs)
+		return -1;
+
+	return gsi - gsi_base;
+}
+
+// Everything starts off masked, until it's routed somewhere
+void init_ioapic(uintptr_t base, uint32_t first_gsi)
+{
+	ioapic     = map_phys(base, IOAPIC_SIZE, true);
+	gsi_base   = first_gsi;
+	num_inputs = ((ioapic_read(IOAPIC_VER) >> VER_MAX_REDIR_SHIFT) & 0xFF)
+		+ 1;
+
+	for (uint32_t i = 0; i < num_inputs; i++)
+		ioapic_mask(gsi_base + i);
+}
+
+bool ioapic_present()
+{
+	return ioapic != NULL;
+}
+
+// Send an interrupt on gsi to the given local APIC, with the given vector
+void ioapic_route(uint32_t gsi, uint8_t vector, uint8_t apic_id,
+		uint8_t flags)
+{
+	int i = input(gsi);
+	if (i < 0)
+		return;
+
+	uint32_t low = REDIR_FIXED | REDIR_PHYSICAL | vector;
+	if (flags & IRQ_ACTIVE_LOW)
+		low |= REDIR_ACTIVE_LOW;
+	if (flags & IRQ_LEVEL)
+		low |= REDIR_LEVEL;
+
+	// Masked while it changes, so it never goes anywhere half set up
+	uint32_t eflags = spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(IOAPIC_REDTBL + i * 2, REDIR_MASKED);
+	ioapic_write(IOAPIC_REDTBL + i * 2 + 1,
+			(uint32_t)apic_id << REDIR_DEST_SHIFT);
+	ioapic_write(IOAPIC_REDTBL + i * 2, low);
+	spin_unlock_irqrestore(&ioapic_lock, eflags);
+}
+
+void ioapic_mask(uint32_t gsi)
+{
+	int i = input(gsi);
+	if (i < 0)
+		return;
+
+	uint32_t eflags = spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(IOAPIC_REDTBL + i * 2, REDIR_MASKED);
+	spin_unlock_irqrestore(&ioapic_lock, eflags);
+}
@@ -4,8 +4,10 @@
 #include <stdint.h>
 #include "assert.h"
 #include "dev.h"
-#include "term.h"
+#include "klog.h"
+#include "panic.h"
 #include "pata.h"
+#include "timer.h"
 
 #define LBA_BITS 28
 
@@ -43,6 +45,13 @@
 // Interesting indices into the data returned by IDENTIFY
 #define MAX_28LBA_SECTORS 60
 
+// How long to wait for a drive before giving up on it, in milliseconds
+#define IDENTIFY_TIMEOUT 1000
+#define READ_TIMEOUT     5000
+
+// How many times to try a read before giving up altogether
+#define READ_TRIES          3
+
 
 // Current drive state information
 
@@ -67,6 +76,36 @@ static uint8_t read_stat(uint16_t base)
 	return inb(base + COM_STAT);
 }
 
+static void time_out(void *data)
+{
+	*(volatile bool*)data = true;
+}
+
+// Poll the status until BSY clears and one of the bits in want is set, for
+// up to timeout milliseconds. Returns false if it timed out. The timeout
+// needs the timer interrupt, so interrupts have to be enabled.
+static bool wait_stat(uint16_t base, uint8_t want, unsigned long timeout,
+		uint8_t *stat)
+{
+	volatile bool timed_out = false;
+	bool          ready     = false;
+	Timer         timer;
+
+	timer.pending = false;
+	timer_add(&timer, timeout, time_out, (void*)&timed_out);
+
+	while (!timed_out) {
+		*stat = read_stat(base);
+		if ((*stat & BSY) == 0 && (*stat & want) != 0) {
+			ready = true;
+			break;
+		}
+	}
+
+	timer_cancel(&timer);
+	return ready;
+}
+
 static void check_drive(uint16_t base, uint8_t master_or_slave)
 {
 	if (sel_base_port != 0) // Check if we've already found a drive
@@ -86,15 +125,14 @@ static void check_drive(uint16_t base, uint8_t master_or_slave)
 	if (stat == 0) // The drive does not exist
 		return;
 
-	// It exists! Retrieve some status info
-
-	while ((stat & BSY) != 0) // Poll status port until BSY clears
-		stat = read_stat(base);
+	// It exists! Wait for it to be ready to send us its info
 
 	// TODO: check for ATAPI at this point
 
-	while ((stat & DRQ) == 0 && (stat & ERR) == 0)
-		stat = read_stat(base);
+	if (!wait_stat(base, DRQ | ERR, IDENTIFY_TIMEOUT, &stat)) {
+		klog(KLOG_WARN, "Drive timed out on IDENTIFY, ignoring it");
+		return;
+	}
 
 	if ((stat & ERR) != 0) // Something's wrong. Maybe it's ATAPI or SATA
 		return;
@@ -126,7 +164,7 @@ void init_ata()
 
 	// Both buses are floating
 	if (primary_floating && secondary_floating) {
-		term_puts("No drives attached! What's going on?");
+		klog(KLOG_WARN, "No drives attached! What's going on?");
 		return;
 	}
 
@@ -137,31 +175,29 @@ void init_ata()
 	check_drive(SECONDARY_BASE, SEL_SLAVE);
 
 	if (sel_base_port == 0) // We didn't find a (PATA) drive
-		term_puts("No drives attached! What's going on?");
+		klog(KLOG_WARN, "No drives attached! What's going on?");
 	else {
-		term_printf("Found a drive!\nSelected drive is the %s on the %s bus\n",
+		klog(KLOG_INFO, "Found a drive!");
+		klog(KLOG_INFO, "Selected drive is the %s on the %s bus",
 				sel_master_or_slave == SEL_MASTER ? "master"  : "slave",
 				sel_base_port == PRIMARY_BASE     ? "primary" : "secondary");
-		term_printf("Max LBA value is %d\n", max_sector);
+		klog(KLOG_INFO, "Max LBA value is %d", max_sector);
 	}
 }
 
-static void poll()
+// Wait for the next sector. Returns false if it timed out or failed.
+static bool poll()
 {
 	uint8_t stat;
 
-	do
-		stat = read_stat(sel_base_port);
-	while ((stat & BSY) != 0); // TODO: Error detection
+	if (!wait_stat(sel_base_port, DRQ | ERR, READ_TIMEOUT, &stat))
+		return false;
+
+	return (stat & ERR) == 0;
 }
 
-// Read sector_count sectors into a buffer, using 28 bit absolute LBA.
-// Buffer must be at least sector_count * SECTOR_SIZE bytes long.
-void read_abs_sectors(uint32_t lba, uint8_t sector_count, uint16_t buf[])
+static bool try_read(uint32_t lba, uint8_t sector_count, uint16_t buf[])
 {
-	// Sanity check; the address shouldn't be more than LBA_BITS bits long
-	ASSERT(lba >> LBA_BITS == 0);
-
 	// First, send a drive select OR'd with the 4 MSB of the address, with bit
 	// 6 set, to indicate this is LBA
 	outb(sel_base_port + DRIVE_SELECT,
@@ -178,11 +214,32 @@ void read_abs_sectors(uint32_t lba, uint8_t sector_count, uint16_t buf[])
 
 	size_t i = 0;
 	for (; sector_count > 0; sector_count--) {
-		poll();
+		if (!poll())
+			return false;
 
 		__asm__ volatile ("rep insw" :: "c"(SECTOR_SIZE / 2),      // Count
 		                                "d"(sel_base_port + DATA), // Port #
 									    "D"(buf + i));             // Buffer
 		i += SECTOR_SIZE / 2;
 	}
+
+	return true;
+}
+
+// Read sector_count sectors into a buffer, using 28 bit absolute LBA.
+// Buffer must be at least sector_count * SECTOR_SIZE bytes long.
+void read_abs_sectors(uint32_t lba, uint8_t sector_count, uint16_t buf[])
+{
+	// Sanity check; the address shouldn't be more than LBA_BITS bits long
+	ASSERT(lba >> LBA_BITS == 0);
+
+	for (int tries = 1; tries <= READ_TRIES; tries++) {
+		if (try_read(lba, sector_count, buf))
+			return;
+
+		klog(KLOG_WARN, "ATA read of LBA %u failed, try %d of %d", lba,
+				tries, READ_TRIES);
+	}
+
+	PANIC("Couldn't read from the drive");
 }
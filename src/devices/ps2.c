@@ -3,6 +3,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "interrupt.h"
+#include "irq_stats.h"
+#include "profile.h"
+#include "tasklet.h"
 #include "term.h"
 #include "dev.h"
 
@@ -16,10 +19,19 @@
 #define RSHIFT_UP      0xB6
 #define ENTER_DOWN     0x1C
 #define BACKSPACE_DOWN 0x0E
+#define F11_DOWN       0x57
+#define F12_DOWN       0x58
 
 // 'a' - 'A' = 32
 #define CASE_DIFF 32
 
+// Scancodes the IRQ handler has read, waiting for the tasklet
+#define SCANCODE_BUF 64
+
+static volatile uint8_t scancodes[SCANCODE_BUF];
+static volatile size_t  scancode_head = 0; // Written by the IRQ handler
+static volatile size_t  scancode_tail = 0; // Written by the tasklet
+
 static bool shift_down = false;
 
 int pressedp(uint8_t scancode)
@@ -54,10 +66,8 @@ char capitalize(char c)
 		return UPPERCASE_SYMBOLS[c - SYMBOL_START];
 }
 
-static void ps2_handler(Registers regs)
+static void handle_scancode(uint8_t s)
 {
-	uint8_t s = inb(PS2_DATA); // Read entered scancode
-
 	switch (s) {
 	case LSHIFT_DOWN:
 	case RSHIFT_DOWN:
@@ -72,7 +82,16 @@ static void ps2_handler(Registers regs)
 		return;
 	case BACKSPACE_DOWN:
 		term_putsn("\b \b");
-		update_cursor();
+		return;
+	case F11_DOWN:
+		// Start profiling, or stop and send what we've got
+		if (profiling())
+			profile_dump();
+		else
+			profile_start(true);
+		return;
+	case F12_DOWN:
+		irq_stats_dump();
 		return;
 	}
 
@@ -82,10 +101,42 @@ static void ps2_handler(Registers regs)
 
 	if (pressedp(s)) {
 		term_putchar(c);
-		update_cursor();
 	}
 }
 
+static void    ps2_tasklet(void *data);
+static Tasklet ps2_work = TASKLET(ps2_tasklet, NULL);
+
+static void ps2_tasklet(void *data)
+{
+	// Whoever's drawing might be what we interrupted, so leave it until
+	// after the next interrupt
+	if (term_busy()) {
+		tasklet_schedule(&ps2_work);
+		return;
+	}
+
+	while (scancode_tail != scancode_head) {
+		handle_scancode(scancodes[scancode_tail % SCANCODE_BUF]);
+		scancode_tail++;
+	}
+}
+
+// Just take the scancode off the controller, and leave drawing it to the
+// tasklet
+static void ps2_handler(Registers regs)
+{
+	uint8_t s = inb(PS2_DATA); // Read entered scancode
+
+	// If the tasklet's that far behind, this key gets lost
+	if (scancode_head - scancode_tail < SCANCODE_BUF) {
+		scancodes[scancode_head % SCANCODE_BUF] = s;
+		scancode_head++;
+	}
+
+	tasklet_schedule(&ps2_work);
+}
+
 void init_ps2()
 {
 	register_interrupt_handler(IRQ1, ps2_handler);
@@ -0,0 +1,160 @@
+// 16550 UART driver, for COM1
+//
+// Output goes into a ring buffer, which the UART's "transmitter holding
+// register empty" interrupt empties into its 16 byte FIFO whenever the FIFO
+// runs dry. So writing only has to wait on the line if it fills the whole
+// ring faster than the line can send it.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "dev.h"
+#include "interrupt.h"
+#include "klog.h"
+#include "serial.h"
+#include "spinlock.h"
+#include "term.h"
+
+#define COM1 0x3F8
+
+// Registers, as offsets from the base port. With the DLAB bit set in the
+// line control register, the first two are the baud rate divisor instead.
+#define UART_DATA 0
+#define UART_IER  1 // Interrupt enable
+#define UART_IIR  2 // Interrupt identification, when read
+#define UART_FCR  2 // FIFO control, when written
+#define UART_LCR  3 // Line control
+#define UART_MCR  4 // Modem control
+#define UART_LSR  5 // Line status
+
+#define IER_THRE     0x02 // Interrupt when the transmitter is empty
+#define FCR_ENABLE   0x01
+#define FCR_CLEAR_RX 0x02
+#define FCR_CLEAR_TX 0x04
+#define LCR_8N1      0x03 // 8 data bits, no parity, 1 stop bit
+#define LCR_DLAB     0x80
+#define MCR_DTR      0x01
+#define MCR_RTS      0x02
+#define MCR_OUT2     0x08 // Has to be set for the UART to raise IRQs
+#define MCR_LOOPBACK 0x10
+#define LSR_THRE     0x20 // Transmitter holding register (and FIFO) empty
+
+#define FIFO_SIZE    16
+
+// The UART's clock is 115200 Hz, so this gives the fastest baud rate
+#define BAUD_DIVISOR 1
+
+// Must be a power of two, so the indices can wrap around
+#define RING_SIZE    8192
+
+static char   ring[RING_SIZE];
+static size_t ring_head = 0; // Where the next byte goes
+static size_t ring_tail = 0; // The next byte to send
+static bool   present   = false;
+
+static Spinlock serial_lock = SPINLOCK_INIT;
+
+// Top the FIFO up from the ring, if it's emptied. Interrupts must be off,
+// and the lock held.
+static void fill_fifo()
+{
+	if (!(inb(COM1 + UART_LSR) & LSR_THRE))
+		return;
+
+	for (int i = 0; i < FIFO_SIZE && ring_tail != ring_head; i++)
+		outb(COM1 + UART_DATA, ring[ring_tail++ % RING_SIZE]);
+}
+
+static void push(char c)
+{
+	// The line can't keep up, so make some room the slow way
+	while (ring_head - ring_tail == RING_SIZE)
+		fill_fifo();
+
+	ring[ring_head++ % RING_SIZE] = c;
+}
+
+static void serial_handler(Registers regs)
+{
+	// Reading this acknowledges the interrupt
+	inb(COM1 + UART_IIR);
+
+	spin_lock(&serial_lock);
+	fill_fifo();
+	spin_unlock(&serial_lock);
+}
+
+void serial_write(const char *str, size_t len)
+{
+	if (!present)
+		return;
+
+	uint32_t eflags = spin_lock_irqsave(&serial_lock);
+
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] == '\n')
+			push('\r');
+		push(str[i]);
+	}
+
+	// If the FIFO's already empty, there won't be an interrupt to start
+	// sending this, so get it going ourselves
+	fill_fifo();
+
+	spin_unlock_irqrestore(&serial_lock, eflags);
+}
+
+// How much can be written without having to wait on the line. Anything
+// that's going to write a lot can wait for this instead, with interrupts on.
+size_t serial_room()
+{
+	return RING_SIZE - (ring_head - ring_tail);
+}
+
+// Take the lock back from whoever had it, when they're never going to finish
+// with it
+void serial_seize()
+{
+	spin_unlock(&serial_lock);
+}
+
+// Send everything that's left in the ring, without relying on interrupts
+void serial_flush()
+{
+	if (!present)
+		return;
+
+	uint32_t eflags = spin_lock_irqsave(&serial_lock);
+	while (ring_tail != ring_head)
+		fill_fifo();
+	spin_unlock_irqrestore(&serial_lock, eflags);
+}
+
+void init_serial()
+{
+	outb(COM1 + UART_IER, 0);
+
+	outb(COM1 + UART_LCR, LCR_DLAB);
+	outb(COM1 + UART_DATA, BAUD_DIVISOR & 0xFF);
+	outb(COM1 + UART_IER,  BAUD_DIVISOR >> 8);
+	outb(COM1 + UART_LCR, LCR_8N1);
+
+	outb(COM1 + UART_FCR, FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX);
+
+	// Make sure there's actually a UART there, by sending a byte back to
+	// ourselves
+	outb(COM1 + UART_MCR, MCR_LOOPBACK | MCR_RTS);
+	outb(COM1 + UART_DATA, 0xAE);
+	if (inb(COM1 + UART_DATA) != 0xAE) {
+		klog(KLOG_WARN, " No UART on COM1");
+		return;
+	}
+
+	outb(COM1 + UART_MCR, MCR_DTR | MCR_RTS | MCR_OUT2);
+
+	present = true;
+	register_interrupt_handler(IRQ4, serial_handler);
+	outb(COM1 + UART_IER, IER_THRE);
+
+	term_add_sink(serial_write);
+}
@@ -1,39 +1,334 @@
-// Programmable Interval Timer functions
+// Programmable Interval Timer functions, and the kernel's clock
+//
+// If the CPU has a TSC, that's the clock. It's calibrated against the PIT at
+// boot, after which the PIT only runs in one-shot mode, to wake us up when
+// something's due, rather than interrupting 1000 times a second regardless.
+// Without a TSC, the PIT ticks at 1 kHz and the clock counts the ticks.
+//
+// Once there's a local APIC, the boot CPU's timer takes over from the PIT's
+// one-shots. It counts at tens of MHz rather than 1.19 MHz, so wakes us up
+// closer to when we asked, and for as long as we like rather than at most
+// 54 ms. Timers all expire on the boot CPU, so the other CPUs' are unused.
 
+#include <stdbool.h>
 #include <stdint.h>
-#include "interrupt.h"
-#include "term.h"
+#include "apic.h"
+#include "cpu.h"
 #include "dev.h"
+#include "div64.h"
+#include "interrupt.h"
+#include "klog.h"
+#include "profile.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "tasklet.h"
+#include "timer.h"
 
 #define TIMER_CHAN0 0x40
+#define TIMER_CHAN2 0x42
 #define TIMER_CMD   0x43
 
+// Channel 2's gate input and output are wired to this port, as well as the
+// PC speaker
+#define TIMER_GATE  0x61
+#define GATE_CHAN2  0x01
+#define SPEAKER_ON  0x02
+#define OUT_CHAN2   0x20
+
+// Command byte fields
+#define CMD_CHAN0   0x00
+#define CMD_CHAN2   0x80
+#define CMD_LOHI    0x30 // The count is sent low byte first, then high
+#define CMD_ONESHOT 0x00 // Mode 0, interrupt on terminal count
+#define CMD_SQUARE  0x06 // Mode 3, square wave generator
+
 #define BASE_FREQUENCY   1193180
 #define MILLISECOND_FREQ 1000
+#define MAX_COUNT        0xFFFF
 
-static unsigned long milli_uptime = 0;
+// PIT ticks per nanosecond, as a fraction of 2^22
+#define PIT_PER_NS       5005
+#define PIT_PER_NS_SHIFT 22
 
-static void timer_handler(Registers regs)
+// About as long as the PIT can count for in one go
+#define ONESHOT_MAX_MS   54
+
+// The local APIC's timer can go far longer, but the timer wheel wants to be
+// run every so often regardless (see run_timers())
+#define LAPIC_MAX_MS     1000
+
+// How long to time the TSC for at boot
+#define CALIBRATE_MS 10
+
+#define NS_PER_MS 1000000
+
+static volatile unsigned long milli_uptime = 0;
+
+// Set once the TSC has been calibrated, and used as the clock
+static bool     tsc_clock = false;
+static uint64_t tsc_start;
+static uint32_t tsc_khz;
+
+// cycles * tsc_mult >> tsc_shift gives nanoseconds
+static uint32_t tsc_mult;
+static int      tsc_shift;
+
+// When the one-shot is going to go off: the PIT, or the boot CPU's local
+// APIC timer
+static unsigned long armed_until;
+
+// Any CPU can ask for a timer interrupt, but there's only the one one-shot
+static Spinlock      oneshot_lock = SPINLOCK_INIT;
+
+// Set once the local APIC's timer is used instead. It ticks lapic_per_ns
+// times a nanosecond, as a fraction of 2^32.
+static bool          lapic_timer  = false;
+static uint32_t      lapic_khz;
+static uint32_t      lapic_per_ns;
+
+uint64_t cycles()
+{
+	return tsc_clock ? rdtsc() - tsc_start : 0;
+}
+
+uint64_t cycles_to_ns(uint64_t cycles)
+{
+	// Split up so that nothing overflows 64 bits
+	uint64_t high = (cycles >> 32) * tsc_mult;
+	uint64_t low  = (cycles & 0xFFFFFFFF) * tsc_mult;
+
+	return (high << (32 - tsc_shift)) + (low >> tsc_shift);
+}
+
+uint64_t uptime_ns()
 {
-	milli_uptime++;
+	if (tsc_clock)
+		return cycles_to_ns(cycles());
+
+	return (uint64_t)milli_uptime * NS_PER_MS;
 }
 
 unsigned long uptime()
 {
-	return milli_uptime;
+	if (!tsc_clock)
+		return milli_uptime;
+
+	uint64_t ms = uptime_ns();
+	div64(&ms, NS_PER_MS);
+	return ms;
+}
+
+// Ask for an interrupt in ns nanoseconds, or as long as the PIT can count
+// if that's further off. A local APIC's timer can only be set by its own CPU,
+// so once it's in use, only the boot CPU comes here.
+static void arm_oneshot(uint64_t ns)
+{
+	if (lapic_timer) {
+		if (ns > (uint64_t)LAPIC_MAX_MS * NS_PER_MS)
+			ns = (uint64_t)LAPIC_MAX_MS * NS_PER_MS;
+
+		uint32_t count = (ns * lapic_per_ns) >> 32;
+		lapic_timer_start(count == 0 ? 1 : count);
+		return;
+	}
+
+	uint64_t count = (ns * PIT_PER_NS) >> PIT_PER_NS_SHIFT;
+	if (count > MAX_COUNT)
+		count = MAX_COUNT;
+	if (count == 0)
+		count = 1;
+
+	outb(TIMER_CMD, CMD_CHAN0 | CMD_LOHI | CMD_ONESHOT);
+	outb(TIMER_CHAN0, count & 0xFF);
+	outb(TIMER_CHAN0, count >> 8);
+}
+
+// The lock must be held
+static void set_deadline(unsigned long ms)
+{
+	uint64_t deadline = (uint64_t)ms * NS_PER_MS;
+	uint64_t now      = uptime_ns();
+
+	arm_oneshot(deadline > now ? deadline - now : 0);
+	armed_until = ms;
+}
+
+static void arm_until(unsigned long ms)
+{
+	uint32_t eflags = spin_lock_irqsave(&oneshot_lock);
+	set_deadline(ms);
+	spin_unlock_irqrestore(&oneshot_lock, eflags);
+}
+
+// How long we can go without a timer interrupt
+static unsigned long max_sleep()
+{
+	if (profiling())
+		return PROFILE_INTERVAL_MS;
+
+	return lapic_timer ? LAPIC_MAX_MS : ONESHOT_MAX_MS;
+}
+
+// Timer callbacks are short, and expect interrupts to be disabled, so they
+// still run that way; but doing it in a tasklet means the IRQ itself is over
+// with and the EOI sent.
+static void expire_timers(void *data)
+{
+	uint32_t eflags = save_interrupts();
+
+	unsigned long now  = uptime();
+	unsigned long next = run_timers(now);
+
+	// Come back when the next timer's due, or as late as we can
+	if (tsc_clock) {
+		if ((long)(next - now) > (long)max_sleep())
+			next = now + max_sleep();
+		arm_until(next);
+	}
+
+	restore_interrupts(eflags);
+}
+
+static Tasklet timer_tasklet = TASKLET(expire_timers, NULL);
+
+// Make sure there's a timer interrupt by uptime() == ms
+void timer_wake_at(unsigned long ms)
+{
+	// Without the TSC, there's one every millisecond anyway
+	if (!tsc_clock)
+		return;
+
+	uint32_t eflags  = spin_lock_irqsave(&oneshot_lock);
+	bool     earlier = (long)(ms - armed_until) < 0;
+	bool     remote  = lapic_timer && !on_boot_cpu();
+	if (earlier && !remote)
+		set_deadline(ms);
+	spin_unlock_irqrestore(&oneshot_lock, eflags);
+
+	// The boot CPU has to set its timer itself, which the tasklet does,
+	// for whatever's due next
+	if (earlier && remote)
+		tasklet_schedule(&timer_tasklet);
+}
+
+static void timer_handler(Registers regs)
+{
+	// The PIT's IRQ, routed to another CPU. Timers all go off on the boot
+	// CPU.
+	if (!on_boot_cpu()) {
+		tasklet_schedule(&timer_tasklet);
+		return;
+	}
+
+	if (profiling())
+		profile_sample(&regs);
+
+	if (!tsc_clock)
+		milli_uptime++;
+	else
+		// In case the tasklet gets put off, so there's always another
+		// interrupt coming to run it
+		arm_until(uptime() + max_sleep());
+
+	tasklet_schedule(&timer_tasklet);
+}
+
+// Count TSC cycles while channel 2 counts down CALIBRATE_MS milliseconds.
+// Returns the TSC frequency in kHz.
+static uint32_t calibrate_tsc()
+{
+	uint16_t count = BASE_FREQUENCY / MILLISECOND_FREQ * CALIBRATE_MS;
+
+	// Let channel 2 count, without beeping at anyone
+	outb(TIMER_GATE, (inb(TIMER_GATE) & ~SPEAKER_ON) | GATE_CHAN2);
+
+	// Its output goes low now, and high again when the count runs out
+	outb(TIMER_CMD, CMD_CHAN2 | CMD_LOHI | CMD_ONESHOT);
+	outb(TIMER_CHAN2, count & 0xFF);
+	outb(TIMER_CHAN2, count >> 8);
+
+	uint64_t start = rdtsc();
+	while (!(inb(TIMER_GATE) & OUT_CHAN2))
+		;
+	uint64_t end = rdtsc();
+
+	return (uint32_t)(end - start) / CALIBRATE_MS;
+}
+
+static void init_tsc_clock()
+{
+	tsc_khz = calibrate_tsc();
+
+	// Use as much precision as fits in 32 bits
+	for (tsc_shift = 32; tsc_shift > 0; tsc_shift--) {
+		uint64_t mult = (uint64_t)NS_PER_MS << tsc_shift;
+		div64(&mult, tsc_khz);
+
+		if (mult <= UINT32_MAX) {
+			tsc_mult = mult;
+			break;
+		}
+	}
+
+	tsc_start = rdtsc();
+	tsc_clock = true;
+
+	klog(KLOG_INFO, " TSC runs at %u MHz", tsc_khz / 1000);
 }
 
 void init_timer()
 {
 	register_interrupt_handler(IRQ0, timer_handler);
 
+	if (cpu_has(CPUID_TSC)) {
+		init_tsc_clock();
+		arm_until(uptime() + ONESHOT_MAX_MS);
+		return;
+	}
+
 	// Divisor must be small enough to fit into 16 bits!
 	uint16_t divisor = BASE_FREQUENCY / MILLISECOND_FREQ;
 
-	// Send a command byte to set up the timer
-	outb(TIMER_CMD, 0x36);
+	outb(TIMER_CMD, CMD_CHAN0 | CMD_LOHI | CMD_SQUARE);
 
 	// Send the divisor byte-wise
 	outb(TIMER_CHAN0, divisor & 0xFF);
 	outb(TIMER_CHAN0, divisor >> 8);
 }
+
+// Count local APIC timer ticks over CALIBRATE_MS, by the TSC
+static uint32_t calibrate_lapic()
+{
+	uint64_t end = uptime_ns() + (uint64_t)CALIBRATE_MS * NS_PER_MS;
+
+	lapic_timer_start(UINT32_MAX);
+	while (uptime_ns() < end)
+		;
+	uint32_t ticks = UINT32_MAX - lapic_timer_count();
+	lapic_timer_start(0);
+
+	return ticks / CALIBRATE_MS;
+}
+
+// Take timer interrupts from the local APIC instead of the PIT. Without the
+// TSC, the PIT's left ticking, as that's the clock.
+void timer_use_lapic()
+{
+	if (!tsc_clock)
+		return;
+
+	register_interrupt_handler(LAPIC_TIMER, timer_handler);
+	lapic_khz = calibrate_lapic();
+
+	uint64_t per_ns = (uint64_t)lapic_khz << 32;
+	div64(&per_ns, NS_PER_MS);
+	lapic_per_ns = per_ns;
+
+	// The PIT goes off once more, if it hasn't already, and that's it
+	uint32_t eflags = spin_lock_irqsave(&oneshot_lock);
+	lapic_timer = true;
+	set_deadline(uptime() + max_sleep());
+	spin_unlock_irqrestore(&oneshot_lock, eflags);
+
+	klog(KLOG_INFO, " Local APIC timer runs at %u MHz", lapic_khz / 1000);
+}
@@ -11,10 +11,10 @@
 #include <string.h>
 #include "assert.h"
 #include "ext2.h"
+#include "klog.h"
 #include "kmalloc.h"
 #include "pata.h"
 #include "panic.h"
-#include "term.h"
 
 #define EXT2_SIGNATURE  0xEF53
 #define INODE_SIZE         128
@@ -47,31 +47,34 @@ void ext2_init_fs()
 	// Read the root inode, just for fun
 	Ext2_inode root_inode;
 	read_inode(&root_inode, ROOT_INODE);
-	term_printf(" / creation time = %d\n",   root_inode.creation_time);
-	term_printf(" / uid           = %d\n",   root_inode.uid);
-	term_printf(" / type & perms  = 0x%X\n", root_inode.type_and_permissions);
-	term_printf(" / size          = %d\n",   root_inode.size);
+	klog(KLOG_INFO, " / creation time = %d",   root_inode.creation_time);
+	klog(KLOG_INFO, " / uid           = %d",   root_inode.uid);
+	klog(KLOG_INFO, " / type & perms  = 0x%X",
+			root_inode.type_and_permissions);
+	klog(KLOG_INFO, " / size          = %d",   root_inode.size);
 
 	// Enumerate the files in it
-	term_puts(" / files:");
+	klog(KLOG_INFO, " / files:");
 
 	Ext2_file file;
 	ext2_open_inode(ROOT_INODE, &file);
 	Ext2_dirent dirent;
 
 	while (ext2_next_dirent(&file, &dirent)) {
-		term_printf("  inode %d, name `%s'\n", dirent.inode_num, dirent.name);
+		char name[MAX_NAME_LEN + 1];
+		ext2_dirent_name(&dirent, name, sizeof(name));
+		klog(KLOG_INFO, "  inode %d, name `%s'", dirent.inode_num, name);
 	}
 
 	kfree(file.buf);
 
 	// Look for a file
-	term_putsn(" looking for file `/bar/baz/quux'...");
 	uint32_t inode = ext2_look_up_path("/bar/baz/quux");
 	if (inode == 0)
-		term_puts(" not found");
+		klog(KLOG_INFO, " looking for file `/bar/baz/quux'... not found");
 	else
-		term_printf(" found: inode = %d\n", inode);
+		klog(KLOG_INFO, " looking for file `/bar/baz/quux'... found: "
+				"inode = %d", inode);
 }
 
 static void read_block(uint32_t block_num, void *buf)
@@ -95,13 +98,13 @@ static void load_superblock()
 
 	// Print some interesting stuff to check it loaded correctly
 	ASSERT(superblock.signature == EXT2_SIGNATURE);
-	term_printf(" total inodes    = 0x%X\n", superblock.total_inodes);
-	term_printf(" total blocks    = 0x%X\n", superblock.total_blocks);
-	term_printf(" block size      = %b\n",   block_size);
-	term_printf(" num blocks      = %d\n",   superblock.total_blocks);
-	term_printf(" blocks/group    = %d\n",   superblock.blocks_per_group);
-	term_printf(" inodes/group    = %d\n",   superblock.inodes_per_group);
-	term_printf(" num groups      = %d\n",   num_groups);
+	klog(KLOG_INFO, " total inodes    = 0x%X", superblock.total_inodes);
+	klog(KLOG_INFO, " total blocks    = 0x%X", superblock.total_blocks);
+	klog(KLOG_INFO, " block size      = %b",   block_size);
+	klog(KLOG_INFO, " num blocks      = %d",   superblock.total_blocks);
+	klog(KLOG_INFO, " blocks/group    = %d",   superblock.blocks_per_group);
+	klog(KLOG_INFO, " inodes/group    = %d",   superblock.inodes_per_group);
+	klog(KLOG_INFO, " num groups      = %d",   num_groups);
 }
 
 static void load_bgdt()
@@ -147,6 +150,7 @@ void ext2_open_inode(uint32_t inode_num, Ext2_file *file)
 	file->block_index    = 0;
 	file->buf            = kmalloc(block_size);
 	file->curr_block_pos = 0;
+	file->dirent_left    = 0;
 
 	// Read in the first block immediately
 	read_block(file->inode.dbp[0], file->buf);
@@ -169,8 +173,9 @@ size_t ext2_read(Ext2_file *file, uint8_t *buf, size_t count)
 			to_copy = block_size - file->curr_block_pos;
 
 		// Copy across from the buffer in the *file and advance the position
-		memcpy(buf + (count - bytes_left),
-				file->buf + file->curr_block_pos, to_copy);
+		if (buf != NULL)
+			memcpy(buf + (count - bytes_left),
+					file->buf + file->curr_block_pos, to_copy);
 		file->curr_block_pos += to_copy;
 		file->pos            += to_copy;
 		bytes_left           -= to_copy;
@@ -193,32 +198,43 @@ size_t ext2_read(Ext2_file *file, uint8_t *buf, size_t count)
 
 // Returns true if a new direntry was read, otherwise false, indicating that
 // all of the entries have been read
+// The name isn't copied out: it points into the file's buffer, so it's only
+// good until the next read from the file, and it isn't NUL terminated.
 bool ext2_next_dirent(Ext2_file *file, Ext2_dirent *dir)
 {
+	// Skip over the name and padding of the last entry
+	if (file->dirent_left > 0) {
+		ext2_read(file, NULL, file->dirent_left);
+		file->dirent_left = 0;
+	}
+
 	uint8_t buf[READ_SIZE];
 	if (ext2_read(file, buf, READ_SIZE) != READ_SIZE) // Not enough data left
 		return false;
 
 	memcpy(dir, buf, READ_SIZE);
 
-	size_t   size = dir->name_len + 1;
-	uint8_t *name = kmalloc(size);
-	if (ext2_read(file, name, size - 1) != size - 1)
+	// Entries never cross a block boundary, so the whole name is in the buffer
+	file->dirent_left = dir->total_len - READ_SIZE;
+	if (dir->name_len > file->dirent_left ||
+			file->pos + dir->name_len > file->inode.size)
 		return false;
 
-	dir->name = name;
-	dir->name[size - 1] = '\0';
-
-	// Read up to the next entry
-	size_t bytes_left = dir->total_len - (READ_SIZE + size - 1);
-	if (bytes_left > 0) {
-		uint8_t dummy[bytes_left];
-		ext2_read(file, dummy, bytes_left);
-	}
+	ASSERT(file->curr_block_pos + dir->name_len <= block_size);
+	dir->name = file->buf + file->curr_block_pos;
 
 	return true;
 }
 
+// Copy a directory entry's name into buf as a NUL terminated string,
+// truncating it if it doesn't fit
+void ext2_dirent_name(Ext2_dirent *dir, char *buf, size_t size)
+{
+	size_t len = dir->name_len < size - 1 ? dir->name_len : size - 1;
+	memcpy(buf, dir->name, len);
+	buf[len] = '\0';
+}
+
 // Returns the inode number of the file if found, and 0 otherwise
 uint32_t ext2_find_in_dir(uint32_t dir_inode, const char *name)
 {
@@ -226,9 +242,13 @@ uint32_t ext2_find_in_dir(uint32_t dir_inode, const char *name)
 	Ext2_file dir;
 	Ext2_dirent dirent;
 
+	// Entry names aren't NUL terminated, so check the lengths match first
+	size_t name_len = strnlen(name, MAX_NAME_LEN + 1);
+
 	ext2_open_inode(dir_inode, &dir);
 	while (ext2_next_dirent(&dir, &dirent)) {
-		if (strcmp((char*)dirent.name, name) == 0) {
+		if (dirent.name_len == name_len &&
+				strncmp((char*)dirent.name, name, name_len) == 0) {
 			inode = dirent.inode_num;
 			goto cleanup;
 		}
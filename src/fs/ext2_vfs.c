@@ -4,10 +4,12 @@
 #include <string.h>
 #include "assert.h"
 #include "ext2.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "vfs.h"
 #include "panic.h"
 
+static Kmem_cache *ext2_file_cache = NULL;
+
 static void ext2_vfs_open(FS_node *node)
 {
 	node->inode = ext2_look_up_path(node->name);
@@ -15,7 +17,7 @@ static void ext2_vfs_open(FS_node *node)
 	if (node->inode != 0) {
 		// TODO: We need some way of reporting errors rather than silently
 		// failing if look_up_path fails
-		Ext2_file *file = kmalloc(sizeof *file);
+		Ext2_file *file = kmem_cache_alloc(ext2_file_cache);
 		ext2_open_inode(node->inode, file);
 
 		// We use node->impl to store a pointer to our Ext2_file structure for
@@ -29,7 +31,7 @@ static void ext2_vfs_open(FS_node *node)
 static void ext2_vfs_close(FS_node *node)
 {
 	// Free the previously allocated Ext_file structure
-	kfree(node->impl);
+	kmem_cache_free(ext2_file_cache, node->impl);
 }
 
 static uint32_t ext2_vfs_read(FS_node *node, size_t offset, size_t size, char *buf)
@@ -55,10 +57,10 @@ static Dir_entry *ext2_vfs_read_dir(FS_node *node, size_t index)
 	Ext2_dirent ext2_dir;
 
 	if (ext2_next_dirent(node->impl, &ext2_dir)) {
-		Dir_entry *dir = kmalloc(sizeof *dir);
+		Dir_entry *dir = kmem_cache_alloc(dir_entry_cache);
 
 		dir->inode = ext2_dir.inode_num;
-		strcpy(dir->name, (char *)ext2_dir.name);
+		ext2_dirent_name(&ext2_dir, dir->name, MAX_NAME_LENGTH);
 
 		return dir;
 	} else {
@@ -74,7 +76,7 @@ static FS_node *ext2_vfs_find_dir(FS_node *node, char *name)
 	if (inode == 0) {
 		return NULL;
 	} else {
-		FS_node *found = kmalloc(sizeof *found);
+		FS_node *found = kmem_cache_alloc(fs_node_cache);
 		found->inode = inode;
 
 		return found;
@@ -89,7 +91,11 @@ void ext2_mount(FS_node *mountpoint)
 	// We can only mount at a directory
 	ASSERT((mountpoint->type & DIR_NODE) != 0);
 
-	FS_node *ext2_root = (FS_node*)kmalloc(sizeof(FS_node));
+	if (ext2_file_cache == NULL)
+		ext2_file_cache = kmem_cache_create("ext2_file", sizeof(Ext2_file), 0,
+				NULL);
+
+	FS_node *ext2_root = kmem_cache_alloc(fs_node_cache);
 	ext2_root->name[0]     = '\0';
 	ext2_root->permissions = 0;
 	ext2_root->uid         = 0;
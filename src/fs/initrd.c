@@ -5,6 +5,7 @@
 #include <string.h>
 #include "kmalloc.h"
 #include "initrd.h"
+#include "slab.h"
 
 uintptr_t    initrd_start;
 File_header *file_headers;
@@ -46,7 +47,7 @@ static Dir_entry *initrd_read_dir(FS_node *node, size_t index)
 	if (index >= num_root_nodes)
 		return 0;
 
-	strcpy(dir_entry.name, root_nodes[index].name);
+	strlcpy(dir_entry.name, root_nodes[index].name, MAX_NAME_LENGTH);
 	dir_entry.inode = root_nodes[index].inode;
 	return &dir_entry;
 }
@@ -69,7 +70,7 @@ FS_node *init_initrd(uintptr_t location)
 	file_headers = (File_header*)(location + 1);
 
 	// Set up the root directory
-	initrd_root  = (FS_node*)kmalloc(sizeof(FS_node));
+	initrd_root  = kmem_cache_alloc(fs_node_cache);
 	strcpy(initrd_root->name, "initrd");
 	initrd_root->permissions = 0;
 	initrd_root->uid         = 0;
@@ -87,7 +88,7 @@ FS_node *init_initrd(uintptr_t location)
 	initrd_root->impl        = NULL;
 
 	// Set up /dev
-	initrd_dev = (FS_node*)kmalloc(sizeof(FS_node));
+	initrd_dev = kmem_cache_alloc(fs_node_cache);
 	strcpy(initrd_root->name, "dev");
 	initrd_dev->permissions = 0;
 	initrd_dev->uid         = 0;
@@ -114,7 +115,7 @@ FS_node *init_initrd(uintptr_t location)
 		file_headers[i].start += location;
 
 		// Create new node for this file
-		strcpy(root_nodes[i].name, file_headers[i].name);
+		strlcpy(root_nodes[i].name, file_headers[i].name, MAX_NAME_LENGTH);
 		root_nodes[i].permissions = 0;
 		root_nodes[i].uid         = 0;
 		root_nodes[i].gid         = 0;
@@ -1,10 +1,20 @@
 // Filesystem functions
 
 #include <stddef.h>
+#include "slab.h"
 #include "vfs.h"
 
 FS_node *fs_root = NULL;
 
+Kmem_cache *fs_node_cache   = NULL;
+Kmem_cache *dir_entry_cache = NULL;
+
+void init_vfs()
+{
+	fs_node_cache   = kmem_cache_create("fs_node",   sizeof(FS_node),   0, NULL);
+	dir_entry_cache = kmem_cache_create("dir_entry", sizeof(Dir_entry), 0, NULL);
+}
+
 uint32_t read_fs_node(FS_node *node, size_t offset, size_t size, char *buf)
 {
 	if (node->read != NULL)
@@ -3,3 +3,46 @@
 
 void *alloc(Heap *heap, size_t size, bool page_align);
 void free(Heap *heap, void *ptr);
+void *realloc(Heap *heap, void *ptr, size_t size);
+
+// Magazines: per-CPU caches of recently freed small blocks, one size class
+// each, after Bonwick and Adams' "Magazines and Vmem". Each CPU has a loaded
+// and a previous magazine per class, and swaps whole magazines with the
+// depot, which is shared, when both run out.
+#define MAG_LINE      64 // Cache line size
+#define MAG_ROUNDS    14 // Enough to fill a line, on i386
+#define MAG_MIN_LOG2  4  // Classes go from 16 bytes...
+#define MAG_CLASSES   6  // ...to 512
+
+// A CPU's loaded magazines are written on every alloc and free, so each one
+// gets cache lines of its own, and comes from a slab cache that lines it up
+typedef struct Magazine
+{
+	struct Magazine *next;   // In the depot
+	uint32_t         rounds; // How many blocks are in it
+	void            *round[MAG_ROUNDS];
+} __attribute__((aligned(MAG_LINE))) Magazine;
+
+// Only ever used by the one CPU, so kept on cache lines of its own
+typedef struct Mag_cache
+{
+	Magazine *loaded[MAG_CLASSES];
+	Magazine *previous[MAG_CLASSES];
+} __attribute__((aligned(MAG_LINE))) Mag_cache;
+
+typedef struct Depot
+{
+	Magazine          *full[MAG_CLASSES];
+	Magazine          *empty[MAG_CLASSES];
+	uint32_t           num_full[MAG_CLASSES];
+	uint32_t           num_empty[MAG_CLASSES];
+	struct Kmem_cache *mags; // Where new magazines come from, MAG_LINE aligned
+} Depot;
+
+// These only touch the CPU's own cache, and fail when it can't help
+void *mag_alloc(Mag_cache *cache, size_t size);
+bool  mag_free( Mag_cache *cache, void *ptr);
+
+// These go to the depot, then the heap, so need whatever protects them
+void *mag_alloc_slow(Heap *heap, Depot *depot, Mag_cache *cache, size_t size);
+void  mag_free_slow( Heap *heap, Depot *depot, Mag_cache *cache, void *ptr);
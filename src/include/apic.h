@@ -0,0 +1,18 @@
+// Local APIC
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void     init_apic();
+void     init_lapic(uintptr_t base);
+void     init_lapic_ap();
+bool     lapic_present();
+uint8_t  lapic_id();
+void     lapic_eoi();
+void     lapic_mask_pic();
+void     lapic_timer_start(uint32_t count);
+uint32_t lapic_timer_count();
+void     lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void     lapic_send_nmi_others();
+void     lapic_send_init(uint8_t apic_id);
+void     lapic_send_startup(uint8_t apic_id, uint8_t page);
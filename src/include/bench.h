@@ -0,0 +1,4 @@
+// In-kernel microbenchmarks, run at boot in kernels built with -DBENCH
+
+void run_switch_bench();
+void run_benchmarks();
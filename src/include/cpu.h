@@ -0,0 +1,17 @@
+// CPU feature detection
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Feature flags, from EDX of CPUID leaf 1
+#define CPUID_PSE  (1 << 3)  // 4 MiB pages
+#define CPUID_TSC  (1 << 4)  // Time stamp counter
+#define CPUID_APIC (1 << 9)  // Local APIC
+#define CPUID_PGE  (1 << 13) // Global pages
+#define CPUID_FXSR (1 << 24) // fxsave/fxrstor
+#define CPUID_SSE  (1 << 25)
+#define CPUID_SSE2 (1 << 26)
+
+void     init_cpu();
+bool     cpu_has(uint32_t feature);
+uint64_t rdtsc();
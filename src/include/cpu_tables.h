@@ -0,0 +1,36 @@
+// Finding the other CPUs and the I/O APIC, from the firmware's ACPI or MP
+// tables
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// More than we'll ever start, so the boot CPU is always in there
+#define MAX_TABLE_CPUS 32
+
+#define NUM_ISA_IRQS   16
+
+// How an IRQ is signalled, if not the ISA way: edge triggered, active high
+#define IRQ_ACTIVE_LOW 0x01
+#define IRQ_LEVEL      0x02
+
+typedef struct Cpu_tables
+{
+	uintptr_t lapic_addr;  // Physical address of the local APICs
+	uint32_t  num_cpus;
+	uint8_t   apic_ids[MAX_TABLE_CPUS];
+
+	// The first I/O APIC, which the ISA IRQs are wired to, or 0 if there
+	// isn't one
+	uintptr_t ioapic_addr;
+	uint32_t  ioapic_gsi_base;
+
+	// Which of its inputs each ISA IRQ is on, and how it's signalled
+	uint32_t  irq_gsi[NUM_ISA_IRQS];
+	uint8_t   irq_flags[NUM_ISA_IRQS];
+
+	// The IMCR has to be told to send IRQs to the APICs, not the 8259s
+	bool      imcr;
+} Cpu_tables;
+
+bool              find_cpu_tables();
+const Cpu_tables *cpu_tables();
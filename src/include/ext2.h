@@ -137,6 +137,9 @@ typedef struct Ext2_inode
 // Various other flags are defined that I don't care about for now. I'll bother
 // adding them if I ever support them
 
+// Names in directory entries are at most this long
+#define MAX_NAME_LEN 255
+
 // Directory entry; a directory file's data is composed of these
 typedef struct Ext2_dirent
 {
@@ -168,11 +171,14 @@ typedef struct Ext2_file
 	uint8_t   *buf;
 	// Position in the current block
 	size_t     curr_block_pos;
+	// Bytes left in the last directory entry read
+	size_t     dirent_left;
 } Ext2_file;
 
 void ext2_init_fs();
 void ext2_open_inode(uint32_t inode_num, Ext2_file *file);
 size_t ext2_read(Ext2_file *file, uint8_t *buf, size_t count);
 bool ext2_next_dirent(Ext2_file *file, Ext2_dirent *dir);
+void ext2_dirent_name(Ext2_dirent *dir, char *buf, size_t size);
 uint32_t ext2_find_in_dir(uint32_t dir_inode, const char *name);
 uint32_t ext2_look_up_path(char *path);
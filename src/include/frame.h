@@ -0,0 +1,27 @@
+// Physical frame allocator
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Blocks of up to 2^MAX_ORDER frames (4 MiB) can be allocated at once
+#define MAX_ORDER 10
+
+#define NO_FRAME 0xFFFFFFFF
+
+// What we know about each frame. Only the first frame in a free block has
+// anything meaningful in it.
+typedef struct Frame
+{
+	uint32_t next;  // Next free block of the same order
+	uint32_t prev;  // Previous free block of the same order
+	uint8_t  order; // Order of the free block starting here
+	bool     free;  // Does a free block start here?
+} Frame;
+
+void     init_frames(uint32_t num_frames);
+uint32_t alloc_frames(size_t order);
+void     free_frames(uint32_t frame, size_t order);
+void     free_frame_range(uint32_t first, uint32_t count);
+bool     claim_frame(uint32_t frame);
+uint32_t free_frame_count();
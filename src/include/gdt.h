@@ -1,3 +1,6 @@
 // GDT functions
 
+struct Cpu;
+
 void init_gdt();
+void init_cpu_gdt(struct Cpu *cpu);
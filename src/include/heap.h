@@ -1,7 +1,6 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include "ordered_array.h"
 
 typedef struct Header
 {
@@ -16,37 +15,60 @@ typedef struct Footer
 	Header  *header;  // Pointer to block header
 } Footer;
 
+// A hole keeps its free list links just after its header, in the space that
+// holds the data once the block is allocated
+typedef struct Hole
+{
+	Header       header;
+	struct Hole *next;
+	struct Hole *prev;
+} Hole;
+
+// Any block we split off has to be big enough to become a hole later
+#define MIN_BLOCK_SIZE (sizeof(Hole) + sizeof(Footer))
+
 void print_block(Header *header, Footer *footer);
 
+// Holes are kept in segregated free lists ("bins") by size. Each power of two
+// is split into BIN_SUBDIVS bins, so a bin only holds sizes within 25% of
+// each other. The bitmaps let us find the first non-empty bin big enough for
+// a request without looking at any of the empty ones.
+#define BIN_SUB_BITS  2
+#define BIN_SUBDIVS   (1 << BIN_SUB_BITS)
+#define MIN_BIN_LOG2  4
+#define NUM_BIN_LOG2S (32 - MIN_BIN_LOG2)
+#define NUM_BINS      (NUM_BIN_LOG2S * BIN_SUBDIVS)
+
 typedef struct Heap
 {
-	Ordered_array index;      // Index of block headers
-	uintptr_t     start_addr; // Start of allocated space
-	uintptr_t     end_addr;   // End of allocated space
-	uintptr_t     max_addr;   // Maximum value of end_addr
-	bool          supervisor; // Should extra pages be supervisor-only?
-	bool          readonly;   // Should extra pages be read-only
+	Hole     *bins[NUM_BINS];            // Free lists of holes, by size
+	uint32_t  bin_log2s;                 // Bit n set if class n has holes
+	uint8_t   bin_bitmaps[NUM_BIN_LOG2S]; // Bit n set if bin n has holes
+	uintptr_t start_addr; // Start of allocated space
+	uintptr_t end_addr;   // End of allocated space
+	uintptr_t max_addr;   // Maximum value of end_addr
+	bool      supervisor; // Should extra pages be supervisor-only?
+	bool      readonly;   // Should extra pages be read-only
 } Heap;
 
 Heap   *create_heap(uintptr_t start, uintptr_t end, uintptr_t max,
 	bool supervisor, bool readonly);
-int32_t find_smallest_hole(Heap *heap, size_t size, bool align);
+Header *find_hole(Heap *heap, size_t size, bool align);
+void    insert_hole(Heap *heap, Header *header);
+void    remove_hole(Heap *heap, Header *header);
 
 void   expand(  Heap *heap, size_t new_size);
 size_t contract(Heap *heap, size_t new_size);
 
-bool    header_comparer(void *a, void *b);
 Header *make_header(uintptr_t loc, size_t size, bool is_hole);
 Footer *make_footer(uintptr_t loc, Header *assoc_header);
 
-Footer *assoc_footer(Header *header);
-Header *header_for(uintptr_t ptr);
-
-int32_t find_header_index(Heap *heap, Header *header);
+Footer   *assoc_footer(Header *header);
+Header   *header_for(uintptr_t ptr);
+uintptr_t aligned_block_pos(uintptr_t hole_pos);
 
 #define HEAP_START      0xC0000000
 #define HEAP_INIT_SIZE    0x100000
 #define HEAP_MIN_SIZE      0x70000
 #define HEAP_MAX_SIZE    0xFFFF000
-#define HEAP_INDEX_SIZE    0x20000
 #define HEAP_MAGIC      0xBEEFACED
@@ -1,4 +1,5 @@
 // IDT functions
 void init_idt();
+void load_idt();
 
 #define NUM_IDT_ENTRIES 256
@@ -4,6 +4,13 @@
 void disable_interrupts();
 void enable_interrupts();
 
+// Disable interrupts, then put them back how they were
+uint32_t save_interrupts();
+void     restore_interrupts(uint32_t eflags);
+
+// Halt until an interrupt, with interrupts disabled either side
+void     wait_for_interrupt();
+
 // IRQ numbers
 #define IRQ0 32
 #define IRQ1 33
@@ -22,6 +29,25 @@ void enable_interrupts();
 #define IRQ14 46
 #define IRQ15 47
 
+#define NUM_IRQS 16
+
+// With an I/O APIC, IRQ n comes in on vector IRQ0 + n + NUM_IRQS * priority,
+// and the local APIC delivers higher vectors first. Handlers are registered
+// for IRQ0 + n either way. The 8259s only have their own fixed priorities.
+#define IRQ_PRIO_LOW    0
+#define IRQ_PRIO_NORMAL 1
+#define IRQ_PRIO_HIGH   2
+#define IRQ_PRIORITIES  3
+
+void irq_route(uint8_t irq, uint8_t cpu, uint8_t priority);
+void use_ioapic();
+
+// Vectors for the local APIC
+#define LAPIC_TIMER   0xE0
+#define IPI_RESCHED   0xF0
+#define IPI_TLB       0xF1
+#define APIC_SPURIOUS 0xFF
+
 // Represents the registers we push onto the stack
 // in isr_common and irq_common (isrs.s)
 typedef struct Registers
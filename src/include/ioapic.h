@@ -0,0 +1,10 @@
+// I/O APIC
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void init_ioapic(uintptr_t base, uint32_t gsi_base);
+bool ioapic_present();
+void ioapic_route(uint32_t gsi, uint8_t vector, uint8_t apic_id,
+		uint8_t flags);
+void ioapic_mask(uint32_t gsi);
@@ -0,0 +1,10 @@
+// Interrupt counts and timings
+
+#include <stdint.h>
+
+uint64_t irq_stats_enter();
+void     irq_stats_exit(uint8_t vector, uint64_t start);
+void     irq_stats_spurious(uint8_t vector);
+void     irqs_off_begin();
+void     irqs_off_end();
+void     irq_stats_dump();
@@ -0,0 +1,38 @@
+// Kernel log
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum Klog_level
+{
+	KLOG_DEBUG,
+	KLOG_INFO,
+	KLOG_WARN,
+	KLOG_ERR,
+} Klog_level;
+
+// Each entry is a whole line, without the newline. Anything longer than this
+// gets cut short.
+#define KLOG_MSG_SIZE 119
+
+// How many entries the log remembers before it starts overwriting them
+#define KLOG_ENTRIES 256
+
+typedef struct Klog_entry
+{
+	volatile uint32_t seq;   // Sequence number + 1, or 0 while being written
+	unsigned long     time;  // uptime() when it was logged
+	uint8_t           level; // A Klog_level
+	char              msg[KLOG_MSG_SIZE];
+} Klog_entry;
+
+// Consoles are given each entry in turn when the log is drained
+typedef void (*Klog_console)(const Klog_entry *entry);
+
+void init_klog();
+void klog(Klog_level level, const char *fmt, ...);
+void klog_add_console(Klog_console console);
+void klog_flush();
+bool klog_read(uint32_t *seq, Klog_entry *entry);
+void klog_dump();
@@ -6,4 +6,5 @@ void *kmalloc_a( size_t size);
 void *kmalloc_p( size_t size, uint32_t *phys);
 void *kmalloc_ap(size_t size, uint32_t *phys);
 
-void kfree(void *ptr);
+void *krealloc(void *ptr, size_t size);
+void  kfree(   void *ptr);
@@ -5,12 +5,13 @@ typedef struct Multiboot_info
 	unsigned int memp           :  1;
 	unsigned int boot_device_p  :  1;
 	unsigned int cmdlinep       :  1;
+	unsigned int modsp          :  1;
 	unsigned int aoutp          :  1;
 	unsigned int elfp           :  1;
 	unsigned int mmapp          :  1;
 	unsigned int drivesp        :  1;
 	unsigned int config_table_p :  1;
-	unsigned int                : 24;
+	unsigned int                : 23;
 	uint32_t     mem_lower;
 	uint32_t     mem_upper;
 	uint32_t     boot_device;
@@ -35,3 +36,15 @@ typedef struct Multiboot_info
 	uint32_t     vbe_interface_off;
 	uint32_t     vbe_interface_len;
 } __attribute__((packed)) Multiboot_info;
+
+// An entry in the memory map at mmap_addr
+typedef struct Mmap_entry
+{
+	uint32_t     size; // Size of the rest of the entry, not including this
+	uint64_t     base;
+	uint64_t     length;
+	uint32_t     type;
+} __attribute__((packed)) Mmap_entry;
+
+// The only type of region in the memory map that we can actually use
+#define MMAP_AVAILABLE 1
@@ -6,13 +6,17 @@
 
 typedef struct Page_entry
 {
-	unsigned int present  : 1;  // Page present in memory?
-	unsigned int rw       : 1;  // Read-only (0) or read/write (1)?
-	unsigned int user     : 1;  // Kernel or user access level?
-	unsigned int accessed : 1;  // Has it been accessed since last refresh?
-	unsigned int dirty    : 1;  // Has it been written to since last refresh?
-	unsigned int unused   : 7;  // Reserved + unused available bits
-	unsigned int frame    : 20; // Physical frame address, right shifted by 12
+	unsigned int present       : 1;  // Page present in memory?
+	unsigned int rw            : 1;  // Read-only (0) or read/write (1)?
+	unsigned int user          : 1;  // Kernel or user access level?
+	unsigned int write_through : 1;  // Write-through caching?
+	unsigned int cache_disable : 1;  // Caching disabled?
+	unsigned int accessed      : 1;  // Has it been accessed since last refresh?
+	unsigned int dirty         : 1;  // Has it been written to since last refresh?
+	unsigned int pat           : 1;  // Page attribute table index
+	unsigned int global        : 1;  // Kept in the TLB when CR3 is reloaded?
+	unsigned int unused        : 3;  // Available for our use
+	unsigned int frame         : 20; // Physical frame address, right shifted by 12
 } Page_entry;
 
 typedef struct Page_table
@@ -32,13 +36,31 @@ typedef struct Page_dir
 	uint32_t physical_addr;
 } Page_dir;
 
+struct Multiboot_info;
+
 bool      aligned(uintptr_t ptr);
 uintptr_t align_up(uintptr_t ptr);
 
 Page_entry *get_page(uint32_t addr, bool make_table, Page_dir *dir);
+void set_frame(Page_entry *page, uint32_t frame, bool kernel, bool writeable);
 void alloc_frame(Page_entry *page, bool kernel, bool writeable);
 void free_frame(Page_entry *page);
-void init_paging();
+void invalidate_page(uintptr_t addr);
+void flush_tlb();
+void flush_tlb_all();
+void *map_phys(uintptr_t addr, size_t size, bool uncached);
+void init_paging(struct Multiboot_info *multiboot);
 
 // Pages are 4KiB
 #define PAGE_SIZE 0x1000
+
+// Page directory entries can map a 4 MiB page directly instead of pointing to
+// a page table, if the CPU supports PSE
+#define LARGE_PAGE_SIZE 0x400000
+
+// Page directory entry flags
+#define PDE_PRESENT 0x001
+#define PDE_RW      0x002
+#define PDE_USER    0x004
+#define PDE_LARGE   0x080 // Maps a 4 MiB page
+#define PDE_GLOBAL  0x100 // Only for 4 MiB pages
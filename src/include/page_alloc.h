@@ -0,0 +1,14 @@
+// Allocator for whole, physically contiguous pages
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+void  *page_alloc(size_t size, uint32_t *phys);
+void   page_free(void *ptr);
+size_t page_alloc_size(void *ptr);
+bool   page_alloc_owns(void *ptr);
+
+// The page allocator maps its blocks into its own region, after the slabs
+#define PAGES_START    0xD8000000
+#define PAGES_MAX_SIZE  0x1000000
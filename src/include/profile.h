@@ -0,0 +1,14 @@
+// Sampling profiler
+
+#include <stdbool.h>
+
+// How often to take a sample while profiling
+#define PROFILE_INTERVAL_MS 1
+
+struct Registers;
+
+void profile_start(bool stacks);
+void profile_stop();
+bool profiling();
+void profile_sample(const struct Registers *regs);
+void profile_dump();
@@ -0,0 +1,9 @@
+// 16550 UART driver, for COM1
+
+#include <stddef.h>
+
+void   init_serial();
+void   serial_write(const char *str, size_t len);
+void   serial_flush();
+void   serial_seize();
+size_t serial_room();
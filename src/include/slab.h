@@ -0,0 +1,55 @@
+// Slab allocator for fixed-size kernel objects
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*Ctor)(void*);
+
+struct Kmem_cache;
+
+typedef struct Slab
+{
+	struct Slab       *next;   // Next slab in the cache's list
+	struct Slab       *prev;   // Previous slab in the cache's list
+	struct Kmem_cache *cache;  // Cache this slab belongs to
+	uintptr_t          start;  // Address of the first page
+	void              *free;   // Free list of objects in this slab
+	size_t             in_use; // How many objects are allocated
+} Slab;
+
+typedef struct Kmem_cache
+{
+	const char        *name;
+	size_t             size;        // Size of each object
+	size_t             stride;      // Distance between objects in a slab
+	size_t             link_offset; // Where the free list link goes
+	size_t             first_obj;   // Offset of the first object in a slab
+	size_t             slab_pages;  // Number of pages in each slab
+	size_t             per_slab;    // Number of objects in each slab
+	bool               off_slab;    // Is the Slab kept outside the pages?
+	Ctor               ctor;        // Called on each object in a new slab
+
+	Slab              *partial;     // Slabs with some objects allocated
+	Slab              *full;        // Slabs with every object allocated
+	Slab              *empty;       // Slabs with no objects allocated
+
+	// Usage stats
+	size_t             in_use;
+	size_t             peak_in_use;
+	size_t             total_allocs;
+	size_t             total_frees;
+	size_t             num_slabs;
+
+	struct Kmem_cache *next;        // Next cache in the list of all caches
+} Kmem_cache;
+
+Kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+		Ctor ctor);
+void *kmem_cache_alloc(Kmem_cache *cache);
+void  kmem_cache_free( Kmem_cache *cache, void *obj);
+void  kmem_cache_print_stats();
+
+// Slabs get their own chunk of the address space, after the heap
+#define SLAB_START    0xD0000000
+#define SLAB_MAX_SIZE  0x1000000
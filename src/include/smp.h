@@ -0,0 +1,30 @@
+// Multiprocessor support, and per-CPU data
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_CPUS 8
+
+typedef struct Cpu
+{
+	struct Cpu    *self;    // At %gs:0, so this_cpu() is a single load
+	uint32_t       id;      // Index in cpus[]; the boot CPU is 0
+	uint8_t        apic_id;
+	volatile bool  online;
+	void          *stack;   // The stack it started on, for APs
+} Cpu;
+
+extern Cpu      cpus[MAX_CPUS];
+extern uint32_t num_cpus;
+
+// Only meaningful while we can't be moved to another CPU, e.g. with
+// interrupts disabled
+Cpu     *this_cpu();
+uint32_t cpu_id();
+bool     on_boot_cpu();
+
+void     init_smp();
+void     send_resched(uint32_t cpu);
+void     tlb_shootdown();
+void     tlb_poll();
+void     stop_other_cpus();
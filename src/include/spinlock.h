@@ -0,0 +1,17 @@
+// Spinlocks, for data shared between CPUs
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Spinlock
+{
+	volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+void     spin_lock(Spinlock *lock);
+bool     spin_trylock(Spinlock *lock);
+void     spin_unlock(Spinlock *lock);
+uint32_t spin_lock_irqsave(Spinlock *lock);
+void     spin_unlock_irqrestore(Spinlock *lock, uint32_t eflags);
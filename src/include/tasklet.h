@@ -0,0 +1,21 @@
+// Deferred interrupt work
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*Tasklet_func)(void *data);
+
+typedef struct Tasklet
+{
+	struct Tasklet *next;
+	Tasklet_func    func;
+	void           *data;
+	bool            scheduled; // Waiting to run
+} Tasklet;
+
+#define TASKLET(func, data) { NULL, func, data, false }
+
+void tasklet_schedule(Tasklet *tasklet);
+void run_tasklets();
+bool tasklets_pending();
+bool tasklets_running();
@@ -1,3 +1,5 @@
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -23,11 +25,24 @@ enum VGAColor
 };
 
 void update_cursor();
+void term_flush();
+void term_hold();
+void term_release();
+bool term_busy();
+void term_seize();
 void term_putchar(char c);
 void term_puts(const char *data);
 void term_putsn(const char *data);
+void term_write(const char *str, size_t len);
 void term_set_color(uint8_t color);
 void init_term();
 uint8_t make_color(enum VGAColor fg, enum VGAColor bg);
 
-void term_printf(const char *fmt, ...);
+// Somewhere else for term_printf() output to go
+typedef void (*Term_sink)(const char *str, size_t len);
+void   term_add_sink(Term_sink sink);
+
+void   term_printf(const char *fmt, ...);
+void   term_vprintf(const char *fmt, va_list args);
+size_t ksnprintf(char *buf, size_t size, const char *fmt, ...);
+size_t kvsnprintf(char *buf, size_t size, const char *fmt, va_list args);
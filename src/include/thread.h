@@ -0,0 +1,22 @@
+// Kernel threads
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Thread Thread;
+
+typedef void (*Thread_func)(void *data);
+
+void    init_threads();
+void    idle();
+Thread *thread_create(const char *name, Thread_func func, void *data);
+void    thread_exit();
+Thread *current_thread();
+void    yield();
+void    block();
+void    wake(Thread *thread);
+void    sleep(unsigned long ms);
+void    resched_if_needed();
+bool    threads_started();
+bool    on_thread_stack(uintptr_t addr, size_t len);
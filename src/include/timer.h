@@ -1,4 +1,32 @@
+#include <stdbool.h>
 #include <stdint.h>
 
-void init_timer(uint32_t frequency);
+void          init_timer();
+void          timer_use_lapic();
 unsigned long uptime();
+uint64_t      uptime_ns();
+uint64_t      cycles();
+uint64_t      cycles_to_ns(uint64_t cycles);
+void          timer_wake_at(unsigned long ms);
+
+// Timers call a function once a given number of milliseconds have passed.
+// The function is called from the timer's tasklet, with interrupts disabled,
+// so it should be quick.
+// A Timer has to start off zeroed, or at least not pending.
+typedef void (*Timer_func)(void *data);
+
+typedef struct Timer
+{
+	struct Timer  *next;
+	struct Timer **pprev;   // Whatever points to this timer
+	unsigned long  expires; // uptime() to go off at
+	Timer_func     func;
+	void          *data;
+	bool           pending; // Added and hasn't gone off yet
+} Timer;
+
+void          timer_add(Timer *timer, unsigned long ms, Timer_func func,
+		void *data);
+bool          timer_cancel(Timer *timer);
+void          msleep(unsigned long ms);
+unsigned long run_timers(unsigned long now);
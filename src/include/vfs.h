@@ -20,6 +20,7 @@ typedef enum Node_type
 
 struct FS_node;
 struct Dir_entry;
+struct Kmem_cache;
 
 // Standard file function types
 typedef uint32_t (*Read) (struct FS_node*, size_t, size_t, char*);
@@ -63,6 +64,12 @@ typedef struct Dir_entry
 
 extern FS_node *fs_root; // The root of the filesystem
 
+// Slab caches that filesystems should allocate nodes and entries from
+extern struct Kmem_cache *fs_node_cache;
+extern struct Kmem_cache *dir_entry_cache;
+
+void init_vfs();
+
 // Wrapper functions for calling file functions on an FS_node
 uint32_t    read_fs_node(FS_node *node, size_t offset, size_t size, char *buf);
 uint32_t   write_fs_node(FS_node *node, size_t offset, size_t size, char *buf);
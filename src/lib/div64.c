@@ -0,0 +1,23 @@
+// 64-bit division, without libgcc
+//
+// We don't link against libgcc, which is where the compiler would go for
+// 64-bit division, so this does it as two 32-bit divisions.
+
+#include <stdint.h>
+#include "div64.h"
+
+// Divide x by d in place, returning the remainder
+uint32_t div64(uint64_t *x, uint32_t d)
+{
+	uint32_t high   = *x >> 32;
+	uint32_t low    = *x;
+	uint32_t q_high = high / d;
+	uint32_t q_low, rem;
+
+	// high % d < d, so the quotient fits in 32 bits
+	__asm__ ("divl %4" : "=a" (q_low), "=d" (rem)
+			: "a" (low), "d" (high % d), "rm" (d));
+
+	*x = (uint64_t)q_high << 32 | q_low;
+	return rem;
+}
@@ -0,0 +1,4 @@
+// 64-bit division, without libgcc
+#include <stdint.h>
+
+uint32_t div64(uint64_t *x, uint32_t d);
@@ -1,54 +1,298 @@
 // String functions
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "string.h"
+
+// Below this a plain loop is quicker than setting up rep movs/stos
+#define SMALL_SIZE 16
+
+// From this size up, the SSE2 loops are used if we have them
+#define SSE2_MIN_SIZE 512
+
+// The SSE2 loops run with interrupts off, so big jobs are split up to let
+// interrupts in every so often
+#define SSE2_CHUNK_SIZE 0x10000
+
+// In string_sse2.s
+void copy_sse2(void *dest, const void *src, size_t n);
+void set_sse2(void *dest, uint32_t pattern, size_t n);
+
+static bool use_sse2 = false;
+
+// Called once the CPU has been set up to run SSE instructions
+void string_enable_sse2()
+{
+	use_sse2 = true;
+}
+
+// Bytes needed to get ptr aligned to align, which is a power of two
+static size_t align_gap(void *ptr, size_t align)
+{
+	return -(uintptr_t)ptr & (align - 1);
+}
 
 void *memset(void *s, int c, size_t n)
 {
-	for (size_t i = 0; i < n; i++)
-		((uint8_t*)s)[i] = c;
+	uint8_t *d = s;
+
+	if (n < SMALL_SIZE) {
+		while (n-- > 0)
+			*d++ = c;
+
+		return s;
+	}
+
+	bool   sse2 = use_sse2 && n >= SSE2_MIN_SIZE;
+	size_t head = align_gap(d, sse2 ? 16 : 4);
+	for (n -= head; head > 0; head--)
+		*d++ = c;
+
+	uint32_t pattern = (uint8_t)c * 0x01010101;
+
+	if (sse2) {
+		while (n >= 64) {
+			size_t chunk = n < SSE2_CHUNK_SIZE ? n & ~63 : SSE2_CHUNK_SIZE;
+			set_sse2(d, pattern, chunk);
+			d += chunk;
+			n -= chunk;
+		}
+	}
+
+	size_t words = n / 4;
+	__asm__ volatile ("rep stosl"
+			: "+D" (d), "+c" (words) : "a" (pattern) : "memory");
+
+	for (n %= 4; n > 0; n--)
+		*d++ = c;
 
 	return s;
 }
 
 void *memcpy(void *dest, const void *src, size_t n)
 {
-	uint8_t *dest8 = (uint8_t*)dest;
-	uint8_t *src8  = (uint8_t*)src;
+	uint8_t       *d = dest;
+	const uint8_t *s = src;
+
+	if (n < SMALL_SIZE) {
+		while (n-- > 0)
+			*d++ = *s++;
+
+		return dest;
+	}
+
+	// Align the destination; unaligned stores hurt more than loads
+	bool   sse2 = use_sse2 && n >= SSE2_MIN_SIZE;
+	size_t head = align_gap(d, sse2 ? 16 : 4);
+	for (n -= head; head > 0; head--)
+		*d++ = *s++;
 
-	for (size_t i = 0; i < n; i++)
-		dest8[i] = src8[i];
+	if (sse2) {
+		while (n >= 64) {
+			size_t chunk = n < SSE2_CHUNK_SIZE ? n & ~63 : SSE2_CHUNK_SIZE;
+			copy_sse2(d, s, chunk);
+			d += chunk;
+			s += chunk;
+			n -= chunk;
+		}
+	}
+
+	size_t words = n / 4;
+	__asm__ volatile ("rep movsl"
+			: "+D" (d), "+S" (s), "+c" (words) :: "memory");
+
+	for (n %= 4; n > 0; n--)
+		*d++ = *s++;
 
 	return dest;
 }
 
-char *strcpy(char *dest, const char *src)
+void *memmove(void *dest, const void *src, size_t n)
 {
-	size_t i;
-	for (i = 0; src[i] != '\0'; i++)
-		dest[i] = src[i];
+	uint8_t       *d = dest;
+	const uint8_t *s = src;
+
+	// Copying forwards is fine unless dest starts inside src
+	if (d <= s || d >= s + n)
+		return memcpy(dest, src, n);
+
+	// Otherwise go backwards, a word at a time after any odd bytes on the end
+	d += n;
+	s += n;
+	for (; n % 4 != 0; n--)
+		*--d = *--s;
+
+	for (; n > 0; n -= 4) {
+		d -= 4;
+		s -= 4;
+		*(uint32_t*)d = *(const uint32_t*)s;
+	}
 
-	dest[++i] = '\0';
 	return dest;
 }
 
-int strcmp(const char *s1, const char *s2)
+int memcmp(const void *s1, const void *s2, size_t n)
 {
-	for (size_t i = 0;; i++) {
-		if (s1[i] < s2[i])
-			return -1;
-		if (s1[i] > s2[i])
-			return  1;
-		if (s1[i] == '\0')
-			return 0;
+	const uint8_t *a = s1;
+	const uint8_t *b = s2;
+
+	// Skip the part that's the same a word at a time, then find the byte
+	// that differs
+	for (; n >= 4 && *(const uint32_t*)a == *(const uint32_t*)b; n -= 4) {
+		a += 4;
+		b += 4;
+	}
+
+	for (; n > 0; n--, a++, b++) {
+		if (*a != *b)
+			return *a < *b ? -1 : 1;
 	}
+
+	return 0;
+}
+
+// The string functions below go a word at a time where they can, using the
+// trick from Hacker's Delight to spot a zero byte in a word. Words are only
+// ever read from aligned addresses, so a read can't cross into the next page
+// past the end of a string.
+#define ONES  0x01010101
+#define HIGHS 0x80808080
+
+// Non-zero if any byte of x is zero
+#define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+
+static bool word_aligned(const void *ptr)
+{
+	return ((uintptr_t)ptr & 3) == 0;
 }
 
 size_t strlen(const char *str)
+{
+	const char *s = str;
+
+	for (; !word_aligned(s); s++) {
+		if (*s == '\0')
+			return s - str;
+	}
+
+	const uint32_t *w = (const uint32_t*)s;
+	while (!HAS_ZERO(*w))
+		w++;
+
+	for (s = (const char*)w; *s != '\0'; s++)
+		;
+
+	return s - str;
+}
+
+size_t strnlen(const char *str, size_t max)
 {
 	size_t len = 0;
-	while (str[len++] != '\0')
+
+	for (; len < max && !word_aligned(str + len); len++) {
+		if (str[len] == '\0')
+			return len;
+	}
+
+	for (; max - len >= 4 && !HAS_ZERO(*(const uint32_t*)(str + len)); len += 4)
+		;
+
+	for (; len < max && str[len] != '\0'; len++)
+		;
+
+	return len;
+}
+
+char *strcpy(char *dest, const char *src)
+{
+	char *d = dest;
+
+	for (; !word_aligned(src); src++, d++) {
+		if ((*d = *src) == '\0')
+			return dest;
+	}
+
+	// Only the source has to be aligned; x86 doesn't mind unaligned stores
+	const uint32_t *w = (const uint32_t*)src;
+	for (; !HAS_ZERO(*w); w++, d += 4)
+		*(uint32_t*)d = *w;
+
+	for (src = (const char*)w; (*d = *src) != '\0'; src++, d++)
 		;
 
+	return dest;
+}
+
+// Copy as much of src as fits in size bytes, always NUL terminating dest if
+// size isn't 0. Returns the length of src, so truncation can be spotted by a
+// return value >= size.
+size_t strlcpy(char *dest, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size > 0) {
+		size_t to_copy = len < size - 1 ? len : size - 1;
+		memcpy(dest, src, to_copy);
+		dest[to_copy] = '\0';
+	}
+
 	return len;
 }
+
+static int char_cmp(const char *s1, const char *s2)
+{
+	uint8_t c1 = *s1, c2 = *s2;
+	return c1 < c2 ? -1 : c1 > c2 ? 1 : 0;
+}
+
+int strcmp(const char *s1, const char *s2)
+{
+	// Words can only be compared if the strings are aligned the same way
+	if (((uintptr_t)s1 & 3) == ((uintptr_t)s2 & 3)) {
+		for (; !word_aligned(s1); s1++, s2++) {
+			if (*s1 != *s2 || *s1 == '\0')
+				return char_cmp(s1, s2);
+		}
+
+		const uint32_t *w1 = (const uint32_t*)s1;
+		const uint32_t *w2 = (const uint32_t*)s2;
+		for (; *w1 == *w2 && !HAS_ZERO(*w1); w1++, w2++)
+			;
+
+		s1 = (const char*)w1;
+		s2 = (const char*)w2;
+	}
+
+	for (; *s1 == *s2 && *s1 != '\0'; s1++, s2++)
+		;
+
+	return char_cmp(s1, s2);
+}
+
+// Like strcmp(), but only looks at the first n characters, so the strings
+// don't need to be NUL terminated if they're at least that long
+int strncmp(const char *s1, const char *s2, size_t n)
+{
+	if (((uintptr_t)s1 & 3) == ((uintptr_t)s2 & 3)) {
+		for (; n > 0 && !word_aligned(s1); n--, s1++, s2++) {
+			if (*s1 != *s2 || *s1 == '\0')
+				return char_cmp(s1, s2);
+		}
+
+		const uint32_t *w1 = (const uint32_t*)s1;
+		const uint32_t *w2 = (const uint32_t*)s2;
+		for (; n >= 4 && *w1 == *w2 && !HAS_ZERO(*w1); n -= 4, w1++, w2++)
+			;
+
+		s1 = (const char*)w1;
+		s2 = (const char*)w2;
+	}
+
+	for (; n > 0; n--, s1++, s2++) {
+		if (*s1 != *s2 || *s1 == '\0')
+			return char_cmp(s1, s2);
+	}
+
+	return 0;
+}
@@ -3,6 +3,13 @@
 
 void  *memset(void *s, int c, size_t n);
 void  *memcpy(void *dest, const void *src, size_t n);
+void  *memmove(void *dest, const void *src, size_t n);
+int    memcmp(const void *s1, const void *s2, size_t n);
 int    strcmp(const char *s1, const char *s2);
+int    strncmp(const char *s1, const char *s2, size_t n);
 char  *strcpy(char *dest, const char *src);
+size_t strlcpy(char *dest, const char *src, size_t size);
 size_t strlen(const char *str);
+size_t strnlen(const char *str, size_t max);
+
+void string_enable_sse2();
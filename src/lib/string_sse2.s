@@ -0,0 +1,68 @@
+# SSE2 versions of the bulk loops in memcpy() and memset(). Nothing else in
+# the kernel saves the XMM registers, so these run with interrupts off.
+
+# void copy_sse2(void *dest, const void *src, size_t n)
+# dest must be 16 byte aligned, and n a multiple of 64
+.global copy_sse2
+copy_sse2:
+	pushl	%esi
+	pushl	%edi
+	pushfl
+	cli
+
+	movl	16(%esp), %edi	# dest
+	movl	20(%esp), %esi	# src
+	movl	24(%esp), %ecx	# n
+	shrl	$6, %ecx	# We do 64 bytes at a time
+	jz	2f
+
+1:
+	movdqu	(%esi), %xmm0
+	movdqu	16(%esi), %xmm1
+	movdqu	32(%esi), %xmm2
+	movdqu	48(%esi), %xmm3
+	movdqa	%xmm0, (%edi)
+	movdqa	%xmm1, 16(%edi)
+	movdqa	%xmm2, 32(%edi)
+	movdqa	%xmm3, 48(%edi)
+
+	addl	$64, %esi
+	addl	$64, %edi
+	decl	%ecx
+	jnz	1b
+
+2:
+	popfl			# Restores the interrupt flag
+	popl	%edi
+	popl	%esi
+	ret
+
+# void set_sse2(void *dest, uint32_t pattern, size_t n)
+# dest must be 16 byte aligned, and n a multiple of 64
+.global set_sse2
+set_sse2:
+	pushl	%edi
+	pushfl
+	cli
+
+	movl	12(%esp), %edi	# dest
+	movd	16(%esp), %xmm0	# pattern
+	movl	20(%esp), %ecx	# n
+	pshufd	$0, %xmm0, %xmm0	# Fill all of xmm0 with the pattern
+	shrl	$6, %ecx
+	jz	2f
+
+1:
+	movdqa	%xmm0, (%edi)
+	movdqa	%xmm0, 16(%edi)
+	movdqa	%xmm0, 32(%edi)
+	movdqa	%xmm0, 48(%edi)
+
+	addl	$64, %edi
+	decl	%ecx
+	jnz	1b
+
+2:
+	popfl
+	popl	%edi
+	ret
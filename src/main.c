@@ -1,11 +1,15 @@
 #include <stdint.h>
 #include <string.h>
+#include "apic.h"
 #include "assert.h"
+#include "bench.h"
+#include "cpu.h"
 #include "ext2.h"
 #include "gdt.h"
 #include "idt.h"
 #include "initrd.h"
 #include "interrupt.h"
+#include "klog.h"
 #include "kmalloc.h"
 #include "multiboot.h"
 #include "term.h"
@@ -13,24 +17,16 @@
 #include "page.h"
 #include "pata.h"
 #include "ps2.h"
+#include "serial.h"
+#include "smp.h"
+#include "thread.h"
 
 void notify(void (*func)(), char *str)
 {
-	term_puts(str);
+	klog(KLOG_INFO, "%s", str);
 	func();
 }
 
-void print_time()
-{
-	term_printf("[%lms] ", uptime());
-}
-
-void timer_notify(void (*func)(), char *str)
-{
-	print_time();
-	notify(func, str);
-}
-
 size_t file_count(FS_node *root)
 {
 	size_t i = 0, count = 0;
@@ -49,39 +45,56 @@ size_t file_count(FS_node *root)
 
 void kernel_main(Multiboot_info *multiboot)
 {
+	// Per-CPU data is at %gs, which the terminal's lock already needs
+	init_gdt();
 	init_term();
-	term_puts(NAME " booting");
-
-	notify(init_gdt,   "Initializing GDT");
-	notify(init_idt,   "Initializing IDT");
-	notify(init_timer, "Initializing PIT"); // Now we can use timer_notify()
-
-	enable_interrupts();
+	init_klog();
+	klog(KLOG_INFO, NAME " booting");
 
 	ASSERT(multiboot->module_count > 0);
 	uintptr_t initrd_addr = *(uintptr_t*)multiboot->modules_addr;
 	uintptr_t initrd_end  = *(uintptr_t*)(multiboot->modules_addr + 4);
-	// Make sure the placment allocator doesn't overwrite the initial ramdisk
+	// Make sure the placment allocator doesn't overwrite the initial ramdisk,
+	// which starts where the kernel ends. Nothing can be allocated before this.
 	extern uintptr_t placement_addr;
 	placement_addr = initrd_end;
 
-	timer_notify(init_paging, "Initializing page table");
+	notify(init_cpu,     "Detecting CPU features");
+	notify(init_idt,     "Initializing IDT");
+	notify(init_timer,   "Initializing PIT"); // Log lines get drawn from now on
+	notify(init_serial,  "Initializing serial port");
+	notify(init_threads, "Starting threads");
+
+	enable_interrupts();
+
+	klog(KLOG_INFO, "Initializing page table");
+	init_paging(multiboot);
+	notify(init_apic,   "Initializing APICs");
+#ifdef BENCH
+	notify(run_switch_bench, "Timing thread switches");
+#endif
+	notify(init_smp,    "Starting other CPUs");
+	notify(init_vfs,    "Initializing VFS");
 
-	print_time();
-	term_putsn("Loading initial ramdisk");
+	klog(KLOG_INFO, "Loading initial ramdisk");
 	FS_node *root = init_initrd(initrd_addr);
-	term_printf(". Found %u file(s)\n", file_count(root));
+	klog(KLOG_INFO, " Found %u file(s)", file_count(root));
+
+	notify(init_ps2,     "Initializing PS/2 controller");
+	notify(init_ata,     "Initializing ATA controller");
+	notify(ext2_init_fs, "Initializing ext2 filesystem");
 
-	timer_notify(init_ps2,     "Initializing PS/2 controller");
-	timer_notify(init_ata,     "Initializing ATA controller");
-	timer_notify(ext2_init_fs, "Initializing ext2 filesystem");
+#ifdef BENCH
+	notify(run_benchmarks, "Running benchmarks");
+#endif
 
-	// Allocate some memory, just for fun
-	uintptr_t a = (uintptr_t)kmalloc(8);
-	uintptr_t b = (uintptr_t)kmalloc(8);
+	// Allocate some memory, just for fun. These are too big for the
+	// magazines, so go straight back to the heap when they're freed.
+	uintptr_t a = (uintptr_t)kmalloc(0x400);
+	uintptr_t b = (uintptr_t)kmalloc(0x400);
 	kfree((void*)b);
 	kfree((void*)a);
-	uintptr_t c = (uintptr_t)kmalloc(12);
+	uintptr_t c = (uintptr_t)kmalloc(0x600);
 
 	ASSERT(a == c); // a & b should have been merged
 }
@@ -1,13 +1,18 @@
 // Simple memory allocator
 // Based on kheap.c from JamesM's kernel development tutorial:
 //  http://www.jamesmolloy.co.uk/tutorial_html/7.-The%20Heap.html
+//
+// In front of it are the magazines (see alloc.h), which keep small freed
+// blocks on the CPU that freed them, to hand straight back out again.
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include "alloc.h"
 #include "assert.h"
-#include "heap.h"
 #include "page.h"
+#include "slab.h"
 
 static void make_space(Heap *heap, size_t needed_size)
 {
@@ -18,74 +23,73 @@ static void make_space(Heap *heap, size_t needed_size)
 	expand(heap, old_length + needed_size);
 	uintptr_t new_length = heap->end_addr - heap->start_addr;
 
-	// Find the last header
-	int32_t   header_index = -1;
-	uintptr_t value        =  0;
-	for (size_t i = 0; i < heap->index.size; i++) {
-		uintptr_t tmp = (uintptr_t)ordered_array_lookup(&heap->index, i);
-
-		if (tmp > value) {
-			value = tmp;
-			header_index++;
-		}
-	}
-
-	if (header_index != -1) {
+	// Blocks cover the whole heap, so the footer of the last one sits right
+	// at the old end. If it's a hole we can just make it bigger.
+	Footer *last_footer = (Footer*)(old_end_addr - sizeof(Footer));
+	if (last_footer->magic == HEAP_MAGIC && last_footer->header->is_hole) {
 		// The last header needs adjusting
-		Header *header = ordered_array_lookup(&heap->index, header_index);
+		Header *header = last_footer->header;
+		remove_hole(heap, header);
 		header->size  += new_length - old_length;
 
 		make_footer((uintptr_t)assoc_footer(header), header);
+		insert_hole(heap, header);
 	} else {
 		Header *header =
 			make_header(old_end_addr, new_length - old_length, true);
 
 		make_footer(old_end_addr + header->size - sizeof(Footer), header);
-		ordered_array_insert(&heap->index, (void*)header);
+		insert_hole(heap, header);
 	}
 }
 
-void *alloc(Heap *heap, size_t size, bool align)
+// The size of the block needed to hold size bytes
+static size_t block_size(size_t size)
 {
-	// Account for header/footer
+	// Account for header/footer, and keep every block word aligned
 	size_t total_block_size = size + sizeof(Header) + sizeof(Footer);
-	int32_t i = find_smallest_hole(heap, total_block_size, align);
+	total_block_size = (total_block_size + 3) & ~3;
+	if (total_block_size < MIN_BLOCK_SIZE)
+		total_block_size = MIN_BLOCK_SIZE;
+
+	return total_block_size;
+}
 
-	if (i == -1) { // Uh oh, there's no hole big enough!
+void *alloc(Heap *heap, size_t size, bool align)
+{
+	size_t total_block_size = block_size(size);
+
+	Header *orig_hole_header = find_hole(heap, total_block_size, align);
+
+	if (orig_hole_header == NULL) { // Uh oh, there's no hole big enough!
 		make_space(heap, total_block_size);
 
 		// Now we have enough space. Try again.
 		return alloc(heap, size, align);
 	}
 
-	Header *orig_hole_header = (Header*)ordered_array_lookup(&heap->index, i);
+	remove_hole(heap, orig_hole_header);
+
 	uintptr_t orig_hole_pos  = (uintptr_t)orig_hole_header;
 	size_t    orig_hole_size = orig_hole_header->size;
 
-	// Don't split the hole if the other half wouldn't be big enough
-	if (orig_hole_size - total_block_size < sizeof(Header) + sizeof(Footer)) {
-		size += orig_hole_size - total_block_size;
-		total_block_size = orig_hole_size;
-	}
-
 	// If we need to page-align it, then do, and create a new hole in the gap
 	if (align && !aligned(orig_hole_pos + sizeof(Header))) {
-		uintptr_t new_hole_loc  = orig_hole_pos + PAGE_SIZE -
-			(orig_hole_pos & 0xFFF) - sizeof(Header);
+		uintptr_t new_hole_loc  = aligned_block_pos(orig_hole_pos);
 		Header *new_hole_header =
 			make_header(orig_hole_pos, new_hole_loc - orig_hole_pos, true);
 
 		make_footer(new_hole_loc - sizeof(Footer), new_hole_header);
+		insert_hole(heap, new_hole_header);
 
 		orig_hole_pos           = new_hole_loc;
 		orig_hole_size         -= new_hole_header->size;
-	} else {
-		// We only need to remove the hole from the index if we're using it
-		// as the location for our new block. In the branch above we create
-		// a new, free, hole at the location we're removing here
-		ordered_array_remove(&heap->index, i);
 	}
 
+	// Don't split the hole if the other half wouldn't be big enough
+	if (orig_hole_size - total_block_size < MIN_BLOCK_SIZE)
+		total_block_size = orig_hole_size;
+
 	// Overwrite the old header
 	Header *block_header = make_header(orig_hole_pos, total_block_size, false);
 
@@ -102,28 +106,30 @@ void *alloc(Heap *heap, size_t size, bool align)
 		// So we now create a new header and footer for this new block
 		Header *new_hole_header = make_header(orig_hole_pos + total_block_size,
 				orig_hole_size - total_block_size, true);
-		Footer *new_hole_footer = assoc_footer(new_hole_header);
 
-		if ((uintptr_t)new_hole_footer + sizeof(Footer) < heap->end_addr) {
-			new_hole_footer->magic  = HEAP_MAGIC;
-			new_hole_footer->header = new_hole_header;
-		}
-
-		ordered_array_insert(&heap->index, (void*)new_hole_header);
+		make_footer((uintptr_t)assoc_footer(new_hole_header), new_hole_header);
+		insert_hole(heap, new_hole_header);
 	}
 
 	// Phew!
 	return (void*)((uintptr_t)block_header + sizeof(Header));
 }
 
-Header *unify_left(Header *header, Footer *footer)
+Header *unify_left(Heap *heap, Header *header, Footer *footer)
 {
-	// Check if we're immediately next to another footer on the right
-	Footer *potential_footer = (Footer*)((uintptr_t)header - sizeof(Header));
+	// The first block has nothing to its left
+	if ((uintptr_t)header == heap->start_addr)
+		return header;
+
+	// Check if we're immediately next to another footer on the left
+	Footer *potential_footer = (Footer*)((uintptr_t)header - sizeof(Footer));
 	if (potential_footer->magic == HEAP_MAGIC &&
 			potential_footer->header->is_hole) {
 		size_t curr_size = header->size;
 		header           = potential_footer->header;
+
+		// Its size is changing, so it has to move bins
+		remove_hole(heap, header);
 		footer->header   = header;
 		header->size    += curr_size;
 	}
@@ -131,23 +137,21 @@ Header *unify_left(Header *header, Footer *footer)
 	return header;
 }
 
-Footer *unify_right(Header *header, Footer *footer, Heap *heap)
+Footer *unify_right(Heap *heap, Header *header, Footer *footer)
 {
+	// The last block has nothing to its right
+	if ((uintptr_t)footer + sizeof(Footer) == heap->end_addr)
+		return footer;
+
 	// Check if we're immediately next to another header on the right
 	Header *potential_header = (Header*)((uintptr_t)footer + sizeof(Footer));
 	if (potential_header->magic == HEAP_MAGIC &&
 			potential_header->is_hole) {
-		// Merge the two holes
-		header->size += potential_header->size;
-		footer = (Footer*)((uintptr_t)potential_header +
-			potential_header->size - sizeof(Footer));
+		// Take it out of its bin, and merge the two holes
+		remove_hole(heap, potential_header);
 
-		// Remove the header from the index
-		int32_t i = find_header_index(heap, potential_header);
-
-		// It should definitely be in the index
-		ASSERT(i != -1);
-		ordered_array_remove(&heap->index, i);
+		header->size += potential_header->size;
+		footer = make_footer((uintptr_t)assoc_footer(header), header);
 	}
 
 	return footer;
@@ -159,9 +163,8 @@ void free(Heap *heap, void *ptr)
 		return;
 
 	// Find the header and footer for the pointer
-	Header *orig_header = header_for((uintptr_t)ptr);
-	Header *header      = orig_header;
-	Footer *footer      = assoc_footer(header);
+	Header *header = header_for((uintptr_t)ptr);
+	Footer *footer = assoc_footer(header);
 
 	// Sanity checks
 	// Check the footer has a correct pointer to the header
@@ -171,29 +174,258 @@ void free(Heap *heap, void *ptr)
 	ASSERT(footer->magic == HEAP_MAGIC);
 
 	header->is_hole = true;
-	header = unify_left( header, footer);
-	footer = unify_right(header, footer, heap);
+	header = unify_left( heap, header, footer);
+	footer = unify_right(heap, header, footer);
 
-	// We can contract the heap if this hole is at the end
+	// We can contract the heap if this hole is at the end. We always leave
+	// enough of it behind to still be a hole, which saves having to deal
+	// with the heap ending in the middle of nowhere.
 	if ((uintptr_t)footer + sizeof(Footer) == heap->end_addr) {
 		size_t old_length = heap->end_addr - heap->start_addr;
-		size_t new_length = contract(heap,
-				(uintptr_t)header - heap->start_addr);
-		if (header->size > old_length - new_length) {
-			// We'll still exist, so resize us
+		size_t new_length = align_up((uintptr_t)header + MIN_BLOCK_SIZE) -
+			heap->start_addr;
+
+		if (new_length < old_length) {
+			new_length = contract(heap, new_length);
+
 			header->size -= old_length - new_length;
 			footer = make_footer((uintptr_t)assoc_footer(header), header);
-		} else {
-			// We're not going to be around anymore
-			int32_t i = find_header_index(heap, header);
+		}
+	}
+
+	insert_hole(heap, header);
+}
+
+void *realloc(Heap *heap, void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return alloc(heap, size, false);
+
+	if (size == 0) {
+		free(heap, ptr);
+		return NULL;
+	}
 
-			if (i != -1)
-				ordered_array_remove(&heap->index, i);
+	Header *header = header_for((uintptr_t)ptr);
+	Footer *footer = assoc_footer(header);
+
+	// Sanity checks
+	ASSERT(footer->header == header);
+	ASSERT(header->magic == HEAP_MAGIC);
+	ASSERT(footer->magic == HEAP_MAGIC);
+	ASSERT(!header->is_hole);
+
+	size_t old_size = header->size;
+	size_t new_size = block_size(size);
+
+	if (new_size > old_size) {
+		// See what's to our right
+		Header *next      = (Header*)((uintptr_t)footer + sizeof(Footer));
+		bool    at_end    = (uintptr_t)next == heap->end_addr;
+		bool    next_hole = !at_end && next->magic == HEAP_MAGIC &&
+			next->is_hole;
+		size_t  available = old_size + (next_hole ? next->size : 0);
+
+		if (available < new_size &&
+				(at_end || (next_hole && (uintptr_t)assoc_footer(next) +
+					sizeof(Footer) == heap->end_addr))) {
+			// We're the last thing in the heap, or only a hole is, so we
+			// can make room by expanding it
+			if (heap->end_addr + (new_size - available) <= heap->max_addr) {
+				make_space(heap, new_size - available);
+				available = new_size;
+			}
+		}
+
+		if (available < new_size) {
+			// No way to grow in place, so move it
+			void *new_ptr = alloc(heap, size, false);
+			memcpy(new_ptr, ptr, old_size - sizeof(Header) - sizeof(Footer));
+			free(heap, ptr);
+
+			return new_ptr;
 		}
+
+		footer = unify_right(heap, header, footer);
+	}
+
+	// Give back what's left over on the end if it's enough for a hole. It's
+	// made into a block and freed, so it gets merged with any hole after it.
+	if (header->size - new_size >= MIN_BLOCK_SIZE) {
+		uintptr_t rest      = (uintptr_t)header + new_size;
+		size_t    rest_size = header->size - new_size;
+
+		header->size = new_size;
+		make_footer((uintptr_t)assoc_footer(header), header);
+
+		Header *rest_header = make_header(rest, rest_size, false);
+		make_footer((uintptr_t)assoc_footer(rest_header), rest_header);
+		free(heap, (void*)(rest + sizeof(Header)));
+	}
+
+	return ptr;
+}
+
+// Blocks the depot runs out of come from the heap this many at a time,
+// leaving room in the magazine for whatever's freed next
+#define MAG_BATCH     (MAG_ROUNDS / 2)
+
+// Past this many spare magazines of a class, full ones are emptied back into
+// the heap and empty ones freed, so the depot can't hoard memory forever
+#define DEPOT_MAX     4
+
+// The class for a request of size bytes, or -1 if it's too big. Any block in
+// class n holds at least 2^(MAG_MIN_LOG2 + n) bytes.
+static int size_class(size_t size)
+{
+	if (size <= 1 << MAG_MIN_LOG2)
+		return 0;
+
+	int log2 = 32 - __builtin_clz((uint32_t)size - 1);
+	return log2 < MAG_MIN_LOG2 + MAG_CLASSES ? log2 - MAG_MIN_LOG2 : -1;
+}
+
+// The class a freed block can go back into, or -1 if it's too big (or
+// somehow too small). Blocks are rounded down, so one that's been resized
+// still holds whatever its class promises.
+static int block_class(void *ptr)
+{
+	Header *header = header_for((uintptr_t)ptr);
+	ASSERT(header->magic == HEAP_MAGIC);
+	ASSERT(!header->is_hole);
+
+	size_t usable = header->size - sizeof(Header) - sizeof(Footer);
+	if (usable < 1 << MAG_MIN_LOG2)
+		return -1;
+
+	int log2 = 31 - __builtin_clz((uint32_t)usable);
+	return log2 < MAG_MIN_LOG2 + MAG_CLASSES ? log2 - MAG_MIN_LOG2 : -1;
+}
+
+void *mag_alloc(Mag_cache *cache, size_t size)
+{
+	int class = size_class(size);
+	if (class < 0)
+		return NULL;
+
+	Magazine *mag = cache->loaded[class];
+	if (mag == NULL || mag->rounds == 0) {
+		// The previous one might still have some
+		Magazine *prev = cache->previous[class];
+		if (prev == NULL || prev->rounds == 0)
+			return NULL;
+
+		cache->previous[class] = mag;
+		cache->loaded[class]   = prev;
+		mag                    = prev;
 	}
 
-	// If our header is still the same as at the start, we need to add it
-	// to the free hole index
-	if (header == orig_header)
-		ordered_array_insert(&heap->index, header);
+	return mag->round[--mag->rounds];
+}
+
+bool mag_free(Mag_cache *cache, void *ptr)
+{
+	int class = block_class(ptr);
+	if (class < 0)
+		return false;
+
+	Magazine *mag = cache->loaded[class];
+	if (mag == NULL || mag->rounds == MAG_ROUNDS) {
+		Magazine *prev = cache->previous[class];
+		if (prev == NULL || prev->rounds == MAG_ROUNDS)
+			return false;
+
+		cache->previous[class] = mag;
+		cache->loaded[class]   = prev;
+		mag                    = prev;
+	}
+
+	mag->round[mag->rounds++] = ptr;
+	return true;
+}
+
+static Magazine *get_empty(Depot *depot, int class)
+{
+	Magazine *mag = depot->empty[class];
+	if (mag != NULL) {
+		depot->empty[class] = mag->next;
+		depot->num_empty[class]--;
+	} else {
+		mag         = kmem_cache_alloc(depot->mags);
+		mag->rounds = 0;
+	}
+
+	return mag;
+}
+
+static void put_empty(Depot *depot, int class, Magazine *mag)
+{
+	if (depot->num_empty[class] < DEPOT_MAX) {
+		mag->next           = depot->empty[class];
+		depot->empty[class] = mag;
+		depot->num_empty[class]++;
+	} else {
+		kmem_cache_free(depot->mags, mag);
+	}
+}
+
+// Both magazines are empty, so swap one for a full one from the depot, or
+// fill one from the heap if there aren't any
+void *mag_alloc_slow(Heap *heap, Depot *depot, Mag_cache *cache, size_t size)
+{
+	int class = size_class(size);
+	if (class < 0)
+		return alloc(heap, size, false);
+
+	Magazine *full = depot->full[class];
+	if (full != NULL) {
+		depot->full[class] = full->next;
+		depot->num_full[class]--;
+
+		if (cache->previous[class] != NULL)
+			put_empty(depot, class, cache->previous[class]);
+		cache->previous[class] = cache->loaded[class];
+		cache->loaded[class]   = full;
+	} else {
+		if (cache->loaded[class] == NULL)
+			cache->loaded[class] = get_empty(depot, class);
+
+		Magazine *mag        = cache->loaded[class];
+		size_t    class_size = 1 << (MAG_MIN_LOG2 + class);
+		while (mag->rounds < MAG_BATCH)
+			mag->round[mag->rounds++] = alloc(heap, class_size, false);
+	}
+
+	Magazine *mag = cache->loaded[class];
+	return mag->round[--mag->rounds];
+}
+
+// Both magazines are full, so give the previous one to the depot and load an
+// empty one. If the depot has enough full ones already, the previous one is
+// emptied into the heap instead, and loaded again.
+void mag_free_slow(Heap *heap, Depot *depot, Mag_cache *cache, void *ptr)
+{
+	int class = block_class(ptr);
+	if (class < 0) {
+		free(heap, ptr);
+		return;
+	}
+
+	Magazine *prev = cache->previous[class];
+	if (prev != NULL && depot->num_full[class] < DEPOT_MAX) {
+		prev->next         = depot->full[class];
+		depot->full[class] = prev;
+		depot->num_full[class]++;
+		prev               = NULL;
+	} else if (prev != NULL) {
+		while (prev->rounds > 0)
+			free(heap, prev->round[--prev->rounds]);
+	}
+
+	cache->previous[class] = cache->loaded[class];
+	cache->loaded[class]   = prev != NULL ? prev :
+		get_empty(depot, class);
+
+	Magazine *mag = cache->loaded[class];
+	mag->round[mag->rounds++] = ptr;
 }
@@ -0,0 +1,186 @@
+// Buddy allocator for physical frames
+//
+// Free frames are kept in blocks of 2^order frames, with a free list for each
+// order. Allocating takes a block from the smallest order that has one and
+// splits it in half until it's the right size. Freeing merges a block with
+// its buddy (the other half of the block it was split from) for as long as
+// the buddy is free too. Both take O(MAX_ORDER) steps, under one lock.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "assert.h"
+#include "frame.h"
+#include "kmalloc.h"
+#include "panic.h"
+#include "spinlock.h"
+
+static Frame    *frames;
+static uint32_t  num_frames;
+static uint32_t  num_free;
+
+static uint32_t  free_lists[MAX_ORDER + 1];
+
+static Spinlock  frame_lock = SPINLOCK_INIT;
+
+static void push_block(uint32_t block, size_t order)
+{
+	frames[block].order = order;
+	frames[block].free  = true;
+	frames[block].prev  = NO_FRAME;
+	frames[block].next  = free_lists[order];
+
+	if (free_lists[order] != NO_FRAME)
+		frames[free_lists[order]].prev = block;
+	free_lists[order] = block;
+}
+
+static void remove_block(uint32_t block, size_t order)
+{
+	Frame *frame = &frames[block];
+
+	if (frame->prev != NO_FRAME)
+		frames[frame->prev].next = frame->next;
+	else
+		free_lists[order] = frame->next;
+
+	if (frame->next != NO_FRAME)
+		frames[frame->next].prev = frame->prev;
+
+	frame->free = false;
+}
+
+// Start off with every frame allocated; the caller frees the ones that
+// actually exist
+void init_frames(uint32_t count)
+{
+	num_frames = count;
+	num_free   = 0;
+	frames     = (Frame*)kmalloc(num_frames * sizeof(Frame));
+
+	for (uint32_t i = 0; i < num_frames; i++)
+		frames[i].free = false;
+
+	for (size_t order = 0; order <= MAX_ORDER; order++)
+		free_lists[order] = NO_FRAME;
+}
+
+// Allocate 2^order physically contiguous frames, returning the first one
+uint32_t alloc_frames(size_t order)
+{
+	ASSERT(order <= MAX_ORDER);
+
+	uint32_t eflags      = spin_lock_irqsave(&frame_lock);
+	size_t   block_order = order;
+	while (block_order <= MAX_ORDER && free_lists[block_order] == NO_FRAME)
+		block_order++;
+
+	if (block_order > MAX_ORDER)
+		PANIC("No free frames!");
+
+	uint32_t block = free_lists[block_order];
+	remove_block(block, block_order);
+
+	// Split it down to size, giving the top halves back
+	while (block_order > order) {
+		block_order--;
+		push_block(block + (1 << block_order), block_order);
+	}
+
+	num_free -= 1 << order;
+
+	spin_unlock_irqrestore(&frame_lock, eflags);
+	return block;
+}
+
+static void free_block(uint32_t block, size_t order)
+{
+	ASSERT(order <= MAX_ORDER);
+	ASSERT(block + (1 << order) <= num_frames);
+	ASSERT(!frames[block].free);
+
+	num_free += 1 << order;
+
+	// Merge with our buddy for as long as it's free
+	for (; order < MAX_ORDER; order++) {
+		uint32_t buddy = block ^ (1 << order);
+
+		if (buddy + (1 << order) > num_frames || !frames[buddy].free ||
+				frames[buddy].order != order)
+			break;
+
+		remove_block(buddy, order);
+		block &= ~(1 << order);
+	}
+
+	push_block(block, order);
+}
+
+void free_frames(uint32_t block, size_t order)
+{
+	uint32_t eflags = spin_lock_irqsave(&frame_lock);
+	free_block(block, order);
+	spin_unlock_irqrestore(&frame_lock, eflags);
+}
+
+// Free an arbitrary run of frames, in the biggest blocks it can be split into
+void free_frame_range(uint32_t first, uint32_t count)
+{
+	uint32_t eflags = spin_lock_irqsave(&frame_lock);
+
+	while (count > 0) {
+		size_t order = MAX_ORDER;
+		while ((first & ((1 << order) - 1)) != 0 || (1u << order) > count)
+			order--;
+
+		free_block(first, order);
+		first += 1 << order;
+		count -= 1 << order;
+	}
+
+	spin_unlock_irqrestore(&frame_lock, eflags);
+}
+
+// Take a specific frame out of the free lists, e.g. because something already
+// lives there. Returns false if it wasn't free to begin with.
+bool claim_frame(uint32_t frame)
+{
+	if (frame >= num_frames)
+		return false;
+
+	uint32_t eflags = spin_lock_irqsave(&frame_lock);
+
+	// Find the free block that contains it, if there is one
+	for (size_t order = 0; order <= MAX_ORDER; order++) {
+		uint32_t block = frame & ~((1 << order) - 1);
+		if (!frames[block].free || frames[block].order != order)
+			continue;
+
+		remove_block(block, order);
+
+		// Give back the halves that don't contain the frame
+		while (order > 0) {
+			order--;
+
+			uint32_t half = block + (1 << order);
+			if (frame >= half) {
+				push_block(block, order);
+				block = half;
+			} else {
+				push_block(half, order);
+			}
+		}
+
+		num_free--;
+		spin_unlock_irqrestore(&frame_lock, eflags);
+		return true;
+	}
+
+	spin_unlock_irqrestore(&frame_lock, eflags);
+	return false;
+}
+
+uint32_t free_frame_count()
+{
+	return num_free;
+}
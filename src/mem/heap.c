@@ -4,10 +4,12 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "assert.h"
 #include "kmalloc.h"
 #include "heap.h"
 #include "page.h"
+#include "smp.h"
 #include "term.h"
 
 extern Page_dir *kernel_dir;
@@ -22,30 +24,137 @@ void print_block(Header *header, Footer *footer)
 		footer->header, (uintptr_t)footer + sizeof(Footer));
 }
 
-int32_t find_smallest_hole(Heap *heap, size_t size, bool align)
+// Work out which bin a hole of the given size belongs in
+static void bin_index(size_t size, size_t *log2, size_t *sub)
 {
-	for (size_t i = 0; i < heap->index.size; i++) {
-		Header *header = (Header*)ordered_array_lookup(&heap->index, i);
+	size_t top = 31 - __builtin_clz(size);
 
-		if (align) {
-			uintptr_t loc    = (uintptr_t)header;
+	*log2 = top - MIN_BIN_LOG2;
+	*sub  = (size >> (top - BIN_SUB_BITS)) & (BIN_SUBDIVS - 1);
+}
+
+// Find the first non-empty bin at or after the given one, or -1 if there are
+// none. This is where the bitmaps pay off, as it only takes a couple of bit
+// scans however many bins there are.
+static int32_t next_full_bin(Heap *heap, size_t log2, size_t sub)
+{
+	uint32_t sub_map = heap->bin_bitmaps[log2] & (0xFF << sub);
 
-			size_t    offset = 0;
-			if (!aligned(loc + sizeof(Header)))
-				offset = PAGE_SIZE - (loc + sizeof(Header)) % PAGE_SIZE;
+	if (sub_map == 0) {
+		uint32_t log2_map = heap->bin_log2s & ~((2u << log2) - 1);
+		if (log2_map == 0)
+			return -1;
 
-			if (header->size - offset >= size)
-				return i;
-		} else if (header->size >= size)
-			return i;
+		log2    = __builtin_ctz(log2_map);
+		sub_map = heap->bin_bitmaps[log2];
 	}
 
-	return -1;
+	return log2 * BIN_SUBDIVS + __builtin_ctz(sub_map);
+}
+
+// Where the block would have to go to be page aligned if it was allocated in
+// the hole at hole_pos. If that would leave a gap too small to be a hole in
+// front of it we have to skip ahead another page.
+uintptr_t aligned_block_pos(uintptr_t hole_pos)
+{
+	uintptr_t block_pos = align_up(hole_pos + sizeof(Header)) - sizeof(Header);
+
+	if (block_pos != hole_pos && block_pos - hole_pos < MIN_BLOCK_SIZE)
+		block_pos += PAGE_SIZE;
+
+	return block_pos;
 }
 
-bool header_comparer(void *a, void *b)
+static bool hole_fits(Header *header, size_t size, bool align)
 {
-	return ((Header*)a)->size < ((Header*)b)->size;
+	if (align) {
+		uintptr_t loc    = (uintptr_t)header;
+		size_t    offset = aligned_block_pos(loc) - loc;
+
+		return header->size >= offset + size;
+	}
+
+	return header->size >= size;
+}
+
+Header *find_hole(Heap *heap, size_t size, bool align)
+{
+	size_t log2, sub;
+
+	if (!align) {
+		// Round the size up to the start of the next bin, so that any hole
+		// in the bin we get back is guaranteed to be big enough
+		size_t top     = 31 - __builtin_clz(size);
+		size_t rounded = size + (1 << (top - BIN_SUB_BITS)) - 1;
+
+		bin_index(rounded, &log2, &sub);
+		int32_t i = next_full_bin(heap, log2, sub);
+		if (i != -1)
+			return &heap->bins[i]->header;
+	}
+
+	// Either that didn't work, or we need to check every hole for alignment.
+	// Either way we have to walk the lists, starting at the bin the size
+	// itself would go in as it can contain holes that are big enough.
+	bin_index(size, &log2, &sub);
+	for (int32_t i = next_full_bin(heap, log2, sub); i != -1;) {
+		for (Hole *hole = heap->bins[i]; hole != NULL; hole = hole->next)
+			if (hole_fits(&hole->header, size, align))
+				return &hole->header;
+
+		// In the unaligned case only the first bin can have been missed
+		if (!align)
+			break;
+
+		if (++i == NUM_BINS)
+			break;
+
+		i = next_full_bin(heap, i / BIN_SUBDIVS, i % BIN_SUBDIVS);
+	}
+
+	return NULL;
+}
+
+void insert_hole(Heap *heap, Header *header)
+{
+	size_t log2, sub;
+	bin_index(header->size, &log2, &sub);
+
+	Hole **bin  = &heap->bins[log2 * BIN_SUBDIVS + sub];
+	Hole  *hole = (Hole*)header;
+
+	hole->prev = NULL;
+	hole->next = *bin;
+	if (*bin != NULL)
+		(*bin)->prev = hole;
+	*bin = hole;
+
+	heap->bin_bitmaps[log2] |= 1 << sub;
+	heap->bin_log2s         |= 1 << log2;
+}
+
+void remove_hole(Heap *heap, Header *header)
+{
+	size_t log2, sub;
+	bin_index(header->size, &log2, &sub);
+
+	Hole **bin  = &heap->bins[log2 * BIN_SUBDIVS + sub];
+	Hole  *hole = (Hole*)header;
+
+	if (hole->prev != NULL)
+		hole->prev->next = hole->next;
+	else
+		*bin = hole->next;
+
+	if (hole->next != NULL)
+		hole->next->prev = hole->prev;
+
+	// Keep the bitmaps in sync if we just emptied the bin
+	if (*bin == NULL) {
+		heap->bin_bitmaps[log2] &= ~(1 << sub);
+		if (heap->bin_bitmaps[log2] == 0)
+			heap->bin_log2s &= ~(1 << log2);
+	}
 }
 
 Header *make_header(uintptr_t loc, size_t size, bool is_hole)
@@ -76,11 +185,9 @@ Heap *create_heap(uintptr_t start, uintptr_t end, uintptr_t max,
 	ASSERT(aligned(start));
 	ASSERT(aligned(end));
 
-	heap->index = place_ordered_array((void*)start, HEAP_INDEX_SIZE,
-			header_comparer);
-	start      += sizeof(void*) * HEAP_INDEX_SIZE;
-
-	align_up(start);
+	memset(heap->bins, 0, sizeof(heap->bins));
+	memset(heap->bin_bitmaps, 0, sizeof(heap->bin_bitmaps));
+	heap->bin_log2s  = 0;
 
 	heap->start_addr = start;
 	heap->end_addr   = end;
@@ -90,7 +197,8 @@ Heap *create_heap(uintptr_t start, uintptr_t end, uintptr_t max,
 
 	// At the start, the whole thing is a hole
 	Header *hole = make_header(start, end - start, true);
-	ordered_array_insert(&heap->index, (void*)hole);
+	make_footer((uintptr_t)assoc_footer(hole), hole);
+	insert_hole(heap, hole);
 
 	return heap;
 }
@@ -105,12 +213,8 @@ void expand(Heap *heap, size_t new_size)
 	// We don't want to expand over the max address
 	ASSERT(heap->start_addr + new_size <= heap->max_addr);
 
-	size_t old_size = heap->end_addr - heap->start_addr;
-
-	for (size_t i = old_size; i < new_size; i += PAGE_SIZE)
-		alloc_frame(get_page(heap->start_addr + i, 1, kernel_dir),
-				heap->supervisor, heap->readonly);
-
+	// No need to map anything, the page fault handler gives pages frames as
+	// they get touched
 	heap->end_addr = heap->start_addr + new_size;
 }
 
@@ -124,8 +228,24 @@ size_t contract(Heap *heap, size_t new_size)
 		new_size = HEAP_MIN_SIZE;
 
 	size_t old_size = heap->end_addr - heap->start_addr;
-	for (size_t i = old_size - PAGE_SIZE; i > new_size; i -= PAGE_SIZE)
-		free_frame(get_page(heap->start_addr + i, 0, kernel_dir));
+	if (new_size >= old_size)
+		return old_size;
+
+	// Only some of these pages will ever have been touched
+	bool freed = false;
+	for (size_t i = new_size; i < old_size; i += PAGE_SIZE) {
+		Page_entry *page = get_page(heap->start_addr + i, false, kernel_dir);
+		if (page != NULL && page->present) {
+			free_frame(page);
+			invalidate_page(heap->start_addr + i);
+			freed = true;
+		}
+	}
+
+	// Other CPUs may still have the pages cached, and the addresses can be
+	// given new frames as soon as we let go of the heap
+	if (freed)
+		tlb_shootdown();
 
 	heap->end_addr = heap->start_addr + new_size;
 	return new_size;
@@ -140,12 +260,3 @@ Header *header_for(uintptr_t ptr)
 {
 	return (Header*)(ptr - sizeof(Header));
 }
-
-int32_t find_header_index(Heap *heap, Header *header)
-{
-	for (size_t i = 0; i < heap->index.size; i++)
-		if (ordered_array_lookup(&heap->index, i) == header)
-			return i;
-
-	return -1;
-}
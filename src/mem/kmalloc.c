@@ -2,9 +2,17 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "alloc.h"
+#include "assert.h"
+#include "interrupt.h"
+#include "kmalloc.h"
 #include "term.h"
 #include "page.h"
+#include "page_alloc.h"
+#include "slab.h"
+#include "smp.h"
+#include "spinlock.h"
 
 // We need to allocate some memory before we even have virtual
 // memory set up, so we use a dumb placement allocator at first
@@ -15,13 +23,49 @@ extern Page_dir *kernel_dir;
 
 uintptr_t placement_addr = (uintptr_t)&end;
 
-static void *kmalloc_aux(size_t size, bool align,
-		uint32_t *phys)
+// Threads can be preempted, or running on another CPU, so the allocators
+// below us are only used with this held, and interrupts disabled
+static Spinlock heap_lock = SPINLOCK_INIT;
+
+// Small blocks are mostly handed out from, and freed back to, the CPU's own
+// magazines, which only need interrupts disabled to keep us on it. Only
+// swapping magazines with the depot, or with the heap, takes the lock.
+static Mag_cache mag_caches[MAX_CPUS];
+static Depot     depot;
+
+// The depot's magazines come from a slab cache, made the first time one's
+// needed. Slabs never come back to the heap, so that's fine with heap_lock
+// held.
+static Depot *get_depot()
+{
+	if (depot.mags == NULL)
+		depot.mags = kmem_cache_create("magazine", sizeof(Magazine),
+				MAG_LINE, NULL);
+
+	return &depot;
+}
+
+static void *kmalloc_locked(size_t size, bool align, uint32_t *phys)
 {
 	if (kheap != NULL) {
-		void *addr = alloc(kheap, size, align);
+		void *addr;
+
+		// Page aligned requests get whole pages to themselves, so the heap
+		// only has to deal with small objects
+		if (align)
+			addr = page_alloc(size, phys);
+		else
+			addr = alloc(kheap, size, false);
+
+#ifdef TRACE_KMALLOC
+		// In the format tools/heapbench replays
+		term_printf("%c %p %u\n", align ? 'A' : 'a', addr, size);
+#endif
+
+		if (phys && !align) {
+			// Heap pages don't get a frame until they're touched
+			*(volatile uint8_t*)addr;
 
-		if (phys) {
 			Page_entry *page = get_page((uintptr_t)addr, false, kernel_dir);
 			*phys = page->frame * PAGE_SIZE + ((uintptr_t)addr & 0xFFF);
 		}
@@ -41,6 +85,47 @@ static void *kmalloc_aux(size_t size, bool align,
 	return (void*)temp;
 }
 
+static void *kmalloc_small(size_t size)
+{
+	uint32_t   eflags = save_interrupts();
+	Mag_cache *cache  = &mag_caches[cpu_id()];
+
+	void *addr = mag_alloc(cache, size);
+	if (addr == NULL) {
+		spin_lock(&heap_lock);
+		addr = mag_alloc_slow(kheap, get_depot(), cache, size);
+		spin_unlock(&heap_lock);
+	}
+
+	restore_interrupts(eflags);
+
+#ifdef TRACE_KMALLOC
+	term_printf("a %p %u\n", addr, size);
+#endif
+
+	return addr;
+}
+
+static void *kmalloc_aux(size_t size, bool align, uint32_t *phys)
+{
+	if (kheap != NULL && !align && phys == NULL)
+		return kmalloc_small(size);
+
+	uint32_t eflags = spin_lock_irqsave(&heap_lock);
+	void    *addr   = kmalloc_locked(size, align, phys);
+	spin_unlock_irqrestore(&heap_lock, eflags);
+
+	return addr;
+}
+
+static void kfree_locked(void *ptr)
+{
+	if (page_alloc_owns(ptr))
+		page_free(ptr);
+	else
+		free(kheap, ptr);
+}
+
 void *kmalloc(size_t size)
 {
 	return kmalloc_aux(size, false, NULL);
@@ -61,7 +146,64 @@ void *kmalloc_ap(size_t size, uint32_t *phys)
 	return kmalloc_aux(size, true, phys);
 }
 
+// Resize a block, in place if there's room. Blocks from kmalloc_a() stay page
+// aligned.
+void *krealloc(void *ptr, size_t size)
+{
+	ASSERT(kheap != NULL);
+
+	uint32_t eflags = spin_lock_irqsave(&heap_lock);
+
+	void *new_ptr;
+	if (size == 0) {
+		kfree_locked(ptr);
+		new_ptr = NULL;
+	} else if (page_alloc_owns(ptr)) {
+		size_t old_size = page_alloc_size(ptr);
+		if (size <= old_size && size > old_size - PAGE_SIZE) {
+			spin_unlock_irqrestore(&heap_lock, eflags);
+			return ptr;
+		}
+
+		new_ptr = page_alloc(size, NULL);
+		memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+		page_free(ptr);
+	} else {
+		new_ptr = realloc(kheap, ptr, size);
+	}
+
+#ifdef TRACE_KMALLOC
+	term_printf("r %p %p %u\n", ptr, new_ptr, size);
+#endif
+
+	spin_unlock_irqrestore(&heap_lock, eflags);
+	return new_ptr;
+}
+
 void kfree(void *ptr)
 {
-	free(kheap, ptr);
+#ifdef TRACE_KMALLOC
+	term_printf("f %p\n", ptr);
+#endif
+
+	if (ptr == NULL)
+		return;
+
+	if (page_alloc_owns(ptr)) {
+		uint32_t eflags = spin_lock_irqsave(&heap_lock);
+		page_free(ptr);
+		spin_unlock_irqrestore(&heap_lock, eflags);
+		return;
+	}
+
+	uint32_t   eflags = save_interrupts();
+	Mag_cache *cache  = &mag_caches[cpu_id()];
+
+	if (!mag_free(cache, ptr)) {
+		spin_lock(&heap_lock);
+		mag_free_slow(kheap, get_depot(), cache, ptr);
+		spin_unlock(&heap_lock);
+	}
+
+	restore_interrupts(eflags);
 }
@@ -4,22 +4,37 @@
 #include <stdint.h>
 #include <string.h>
 #include "alloc.h"
+#include "assert.h"
+#include "cpu.h"
+#include "frame.h"
 #include "interrupt.h"
+#include "klog.h"
 #include "kmalloc.h"
+#include "multiboot.h"
 #include "page.h"
+#include "page_alloc.h"
 #include "panic.h"
-#include "term.h"
+#include "slab.h"
+#include "spinlock.h"
 
 Page_dir *curr_dir   = NULL;
 Page_dir *kernel_dir = NULL;
 
-uint32_t *frames;
-uint32_t num_frames;
-
 extern uintptr_t placement_addr;
 
-#define BIT_INDEX(a)  (a / (8 * 4))
-#define BIT_OFFSET(a) (a % (8 * 4))
+static Kmem_cache *page_table_cache = NULL;
+
+// For changes to the kernel's page tables that could happen on any CPU at
+// once, like faulting in heap pages
+static Spinlock    page_lock        = SPINLOCK_INIT;
+
+// Set in init_paging() if the CPU supports them
+static bool large_pages  = false;
+static bool global_pages = false;
+
+// Control register bits to turn them on
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
 
 bool aligned(uintptr_t ptr)
 {
@@ -36,60 +51,23 @@ uintptr_t align_up(uintptr_t ptr)
 	}
 }
 
-static void set_frame(uint32_t frame_addr)
+// Point a page at a frame that's already been allocated
+void set_frame(Page_entry *page, uint32_t frame, bool kernel, bool writeable)
 {
-	uint32_t frame  = frame_addr / PAGE_SIZE;
-	uint32_t index  = BIT_INDEX( frame);
-	uint32_t offset = BIT_OFFSET(frame);
-
-	frames[index] |= 1 << offset;
-}
-
-// Clear a bit in the bitset
-static void clear_frame(uint32_t frame_addr)
-{
-	uint32_t frame = frame_addr / PAGE_SIZE;
-	uint32_t index  = BIT_INDEX( frame);
-	uint32_t offset = BIT_OFFSET(frame);
-
-	frames[index] &= ~(1 << offset);
-}
-
-// Find the first free frame
-static uint32_t first_frame()
-{
-	uint32_t i = 0;
-	for (; i < BIT_INDEX(num_frames); i++) {
-		if (frames[i] == 0xFFFFFFFF) {
-			continue;
-		}
-
-		for (uint32_t j = 0; j < 32; j++) {
-			if (!(frames[i] & (1 << j)))
-				return i * 8 * 4 + j;
-		}
-	}
-
-	return i;
+	page->present = 1;
+	page->rw      = writeable ? 1 : 0;
+	page->user    = kernel    ? 0 : 1;
+	page->global  = kernel && global_pages;
+	page->frame   = frame;
 }
 
 // Allocate a new frame
 void alloc_frame(Page_entry *page, bool kernel, bool writeable)
 {
-	if (page->frame) {
+	if (page->frame)
 		return; // Frame is already allocated
-	} else {
-		uint32_t index = first_frame();
-
-		if (index == (uint32_t)-1)
-			PANIC("No free frames!");
-
-		set_frame(index * PAGE_SIZE);
-		page->present = 1;
-		page->rw      = writeable ? 1 : 0;
-		page->user    = kernel    ? 0 : 1;
-		page->frame   = index;
-	}
+	else
+		set_frame(page, alloc_frames(0), kernel, writeable);
 }
 
 // Free an allocated frame
@@ -100,22 +78,43 @@ void free_frame(Page_entry *page)
 	if (!frame) {
 		return; // Page doesn't even have a frame allocated
 	} else {
-		clear_frame(frame);
-		page->frame = 0;
+		free_frames(frame, 0);
+		page->frame   = 0;
+		page->present = 0;
 	}
 }
 
+// Map a page to a specific frame, which is taken out of the free lists if
+// it's in them
+static void map_frame(Page_entry *page, uint32_t frame, bool kernel,
+		bool writeable)
+{
+	claim_frame(frame);
+	set_frame(page, frame, kernel, writeable);
+}
+
 Page_entry *get_page(uint32_t addr, bool make_table, Page_dir *dir)
 {
 	addr /= PAGE_SIZE;
 
 	uint32_t index = addr / 1024;
+
+	// There are no page tables in a 4 MiB page to give out entries from
+	ASSERT(!(dir->tables_physical[index] & PDE_LARGE));
+
 	if (dir->tables[index]) { // Table is already assigned
 		return &dir->tables[index]->pages[addr % 1024];
 	} else if (make_table) {
 		uint32_t phys_addr;
-		dir->tables[index] =
-			(Page_table*)kmalloc_ap(sizeof(Page_table), &phys_addr);
+		if (page_table_cache != NULL) {
+			dir->tables[index] = kmem_cache_alloc(page_table_cache);
+			phys_addr = get_page((uintptr_t)dir->tables[index], false,
+					kernel_dir)->frame * PAGE_SIZE;
+		} else {
+			// Too early for slabs, so use the placement allocator
+			dir->tables[index] =
+				(Page_table*)kmalloc_ap(sizeof(Page_table), &phys_addr);
+		}
 		memset(dir->tables[index], 0, PAGE_SIZE);
 		dir->tables_physical[index] = phys_addr | 7; // Present, RW, user
 
@@ -139,6 +138,110 @@ void switch_page_dir(Page_dir *dir)
 	__asm__ volatile ("mov %0, %%cr0" :: "r" (cr0));
 }
 
+void invalidate_page(uintptr_t addr)
+{
+	__asm__ volatile ("invlpg (%0)" :: "r" (addr) : "memory");
+}
+
+// Flush every TLB entry, apart from global ones
+void flush_tlb()
+{
+	uint32_t cr3;
+	__asm__ volatile ("mov %%cr3, %0" : "=r" (cr3));
+	__asm__ volatile ("mov %0, %%cr3" :: "r" (cr3) : "memory");
+}
+
+// Flush every TLB entry, global ones too, which turning global pages off
+// does
+void flush_tlb_all()
+{
+	if (!global_pages) {
+		flush_tlb();
+		return;
+	}
+
+	uint32_t cr4;
+	__asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+	__asm__ volatile ("mov %0, %%cr4" :: "r" (cr4 & ~CR4_PGE) : "memory");
+	__asm__ volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+// Identity map low memory with 4 MiB pages. The frames the kernel is actually
+// using are claimed; the rest of the last large page is mapped but can still
+// be handed out.
+static void identity_map_large(uintptr_t end)
+{
+	uint32_t flags = PDE_PRESENT | PDE_RW | PDE_LARGE;
+	if (global_pages)
+		flags |= PDE_GLOBAL;
+
+	for (uintptr_t i = 0; i < end; i += LARGE_PAGE_SIZE)
+		kernel_dir->tables_physical[i / LARGE_PAGE_SIZE] = i | flags;
+
+	for (uintptr_t i = 0; i < end; i += PAGE_SIZE)
+		claim_frame(i / PAGE_SIZE);
+}
+
+static void enable_paging_features()
+{
+	if (!large_pages && !global_pages)
+		return;
+
+	uint32_t cr4;
+	__asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+	if (large_pages)
+		cr4 |= CR4_PSE;
+	if (global_pages)
+		cr4 |= CR4_PGE;
+	__asm__ volatile ("mov %0, %%cr4" :: "r" (cr4));
+}
+
+// The whole of the kernel heap's address space is reserved for it, but pages
+// only get frames once they're touched. Give the faulting page one if it's in
+// there.
+static bool heap_fault(uintptr_t fault_addr, uint8_t err)
+{
+	// Kernel mode, and the page wasn't present
+	if ((err & 0x01) || (err & 0x04))
+		return false;
+
+	if (fault_addr < HEAP_START || fault_addr >= HEAP_START + HEAP_MAX_SIZE)
+		return false;
+
+	// Another CPU may have just faulted the same page in, in which case
+	// this leaves it be
+	uint32_t eflags = spin_lock_irqsave(&page_lock);
+	alloc_frame(get_page(fault_addr, true, kernel_dir), true, true);
+	spin_unlock_irqrestore(&page_lock, eflags);
+
+	return true;
+}
+
+// Identity map some physical memory that isn't RAM we manage, like the
+// local APIC's registers or the ACPI tables, if it isn't already. Device
+// registers should be uncached. Returns a pointer to it.
+void *map_phys(uintptr_t addr, size_t size, bool uncached)
+{
+	uint32_t eflags = spin_lock_irqsave(&page_lock);
+
+	for (uintptr_t page = addr & ~(PAGE_SIZE - 1); page < addr + size;
+			page += PAGE_SIZE) {
+		if (kernel_dir->tables_physical[page / LARGE_PAGE_SIZE] & PDE_LARGE)
+			continue;
+
+		Page_entry *entry = get_page(page, true, kernel_dir);
+		if (entry->present)
+			continue;
+
+		set_frame(entry, page / PAGE_SIZE, true, true);
+		entry->cache_disable = uncached;
+		invalidate_page(page);
+	}
+
+	spin_unlock_irqrestore(&page_lock, eflags);
+	return (void*)addr;
+}
+
 void page_fault_handler(Registers regs)
 {
 	// The faulting address is stored in the CR2 register.
@@ -146,6 +249,9 @@ void page_fault_handler(Registers regs)
 	__asm__ volatile("mov %%cr2, %0" : "=r" (fault_addr));
 	uint8_t   err = regs.err;
 
+	if (heap_fault(fault_addr, err))
+		return;
+
 	// The error code gives us details of what happened.
 	bool present   = !(err & 0x01); // Page not present
 	bool read      =   err & 0x02;  // Write operation?
@@ -154,54 +260,154 @@ void page_fault_handler(Registers regs)
 	bool fetch     =   err & 0x10;  // Caused by an instruction fetch?
 
 	// Output an error message.
-	term_printf("Page fault at %p\n", fault_addr);
-	term_printf(" %s\n caused by a %s access in %s mode\n",
-		present ? "protection fault"     : "page was not found",
+	klog(KLOG_ERR, "Page fault at %p", fault_addr);
+	klog(KLOG_ERR, " %s", present ? "protection fault" : "page was not found");
+	klog(KLOG_ERR, " caused by a %s access in %s mode",
 		read    ? "read"                 : "write",
 		user    ? "user"                 : "kernel");
-	term_printf(" reserved bits were %soverwritten\n",
+	klog(KLOG_ERR, " reserved bits were %soverwritten",
 		overwrite ? "" : "not ");
-	term_printf(" %s caused by instruction fetch\n",
+	klog(KLOG_ERR, " %s caused by instruction fetch",
 		fetch ? "was" : "not");
 
 	__asm__ volatile ("xchg %bx, %bx"); // Magic breakpoint!
 	PANIC("Page fault!");
 }
 
-Heap *kheap = NULL;
+// We can't get at anything past 4 GiB without PAE
+#define MAX_PHYS_ADDR 0x100000000ULL
+
+// Upper memory, as reported in mem_upper, starts at 1 MiB
+#define UPPER_MEM_FRAME (0x100000 / PAGE_SIZE)
+
+#define FRAMES_PER_MIB (0x100000 / PAGE_SIZE)
+
+static Mmap_entry *next_mmap_entry(Mmap_entry *entry)
+{
+	return (Mmap_entry*)((uintptr_t)entry + entry->size + sizeof(entry->size));
+}
 
-void init_paging()
+// Work out how many frames we need to keep track of to cover all usable RAM
+static uint32_t count_frames(Multiboot_info *multiboot)
 {
-	// Assume physical memory is 64MB, for now
-	uint32_t phys_mem_size = 0x4000000;
+	if (!multiboot->mmapp) {
+		if (!multiboot->memp)
+			PANIC("Bootloader didn't tell us how much memory there is!");
+
+		// mem_upper is in KiB
+		return UPPER_MEM_FRAME + multiboot->mem_upper / (PAGE_SIZE / 1024);
+	}
+
+	uint32_t  top_frame = 0;
+	uintptr_t mmap_end  = multiboot->mmap_addr + multiboot->mmap_length;
+	for (Mmap_entry *entry = (Mmap_entry*)multiboot->mmap_addr;
+			(uintptr_t)entry < mmap_end; entry = next_mmap_entry(entry)) {
+		if (entry->type != MMAP_AVAILABLE)
+			continue;
 
-	num_frames = phys_mem_size / PAGE_SIZE;
-	frames     = (uint32_t*)kmalloc(BIT_INDEX(num_frames));
-	memset(frames, 0, BIT_INDEX(num_frames));
+		uint64_t end = entry->base + entry->length;
+		if (end > MAX_PHYS_ADDR)
+			end = MAX_PHYS_ADDR;
+
+		if (end / PAGE_SIZE > top_frame)
+			top_frame = end / PAGE_SIZE;
+	}
+
+	return top_frame;
+}
+
+// Give the frame allocator every whole frame in a usable region of RAM
+static void free_usable_frames(Multiboot_info *multiboot, uint32_t num_frames)
+{
+	if (!multiboot->mmapp) {
+		free_frame_range(UPPER_MEM_FRAME, num_frames - UPPER_MEM_FRAME);
+		return;
+	}
+
+	uintptr_t mmap_end = multiboot->mmap_addr + multiboot->mmap_length;
+	for (Mmap_entry *entry = (Mmap_entry*)multiboot->mmap_addr;
+			(uintptr_t)entry < mmap_end; entry = next_mmap_entry(entry)) {
+		if (entry->type != MMAP_AVAILABLE || entry->base >= MAX_PHYS_ADDR)
+			continue;
+
+		uint64_t end = entry->base + entry->length;
+		if (end > MAX_PHYS_ADDR)
+			end = MAX_PHYS_ADDR;
+
+		// Regions don't have to start or end on a page boundary
+		uint32_t first = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+		uint32_t last  = end / PAGE_SIZE;
+		if (first < last)
+			free_frame_range(first, last - first);
+	}
+}
+
+Heap *kheap = NULL;
+
+void init_paging(Multiboot_info *multiboot)
+{
+	// Only keep track of as much memory as there actually is, and only hand
+	// out frames that are really RAM
+	uint32_t num_frames = count_frames(multiboot);
+	init_frames(num_frames);
+	free_usable_frames(multiboot, num_frames);
+	uint32_t usable_frames = free_frame_count();
+
+	// Build with -DNO_LARGE_PAGES to compare against plain 4 KiB pages
+#ifndef NO_LARGE_PAGES
+	large_pages  = cpu_has(CPUID_PSE);
+	global_pages = cpu_has(CPUID_PGE);
+#endif
 
 	// Create page directory
 	kernel_dir = (Page_dir*)kmalloc_a(sizeof(Page_dir));
 	memset(kernel_dir, 0, sizeof(Page_dir));
 	curr_dir   = kernel_dir;
 
-	// Map some kernel heap pages
+	// Make the page tables for the start of the heap. Its frames get
+	// allocated when they're first touched, in page_fault_handler().
 	for (size_t i = HEAP_START; i < HEAP_START + HEAP_INIT_SIZE;
-			i += PAGE_SIZE)
+			i += PAGE_SIZE * 1024)
+		get_page(i, true, kernel_dir);
+
+	// Make all the page tables for the slab region up front, so that mapping
+	// in a new slab never has to allocate one
+	for (size_t i = SLAB_START; i < SLAB_START + SLAB_MAX_SIZE;
+			i += PAGE_SIZE * 1024)
 		get_page(i, true, kernel_dir);
 
-	// Allocate an extra page for the kernel heap
-	for (size_t i = 0; i < placement_addr + PAGE_SIZE; i += PAGE_SIZE)
-		alloc_frame(get_page(i, true, kernel_dir), false, false);
+	// Same for the page allocator's region
+	for (size_t i = PAGES_START; i < PAGES_START + PAGES_MAX_SIZE;
+			i += PAGE_SIZE * 1024)
+		get_page(i, true, kernel_dir);
 
-	// Allocate those pages from earlier
-	for (size_t i = HEAP_START; i <HEAP_START + HEAP_INIT_SIZE;
-			i += PAGE_SIZE)
-		alloc_frame(get_page(i, true, kernel_dir), false, false);
+	// Identity map everything the placement allocator has handed out, plus an
+	// extra page for the kernel heap. This covers the kernel image, the
+	// initrd and everything allocated so far, and claims their frames so
+	// they never get handed out.
+	if (large_pages) {
+		identity_map_large(placement_addr + PAGE_SIZE);
+	} else {
+		for (size_t i = 0; i < placement_addr + PAGE_SIZE; i += PAGE_SIZE)
+			map_frame(get_page(i, true, kernel_dir), i / PAGE_SIZE, true,
+					true);
+	}
 
 	register_interrupt_handler(14, page_fault_handler);
 
+	enable_paging_features();
 	switch_page_dir(kernel_dir);
 
+	// Page tables for the rest of the heap are made as it faults pages in,
+	// and that mustn't recurse back into the heap
+	page_table_cache = kmem_cache_create("page_table", sizeof(Page_table),
+			PAGE_SIZE, NULL);
+
 	kheap = create_heap(HEAP_START, HEAP_START + HEAP_INIT_SIZE,
 			HEAP_START + HEAP_MAX_SIZE, false, false);
+
+	klog(KLOG_INFO, " %u MiB of usable memory, %u MiB free%s%s",
+			usable_frames / FRAMES_PER_MIB, free_frame_count() / FRAMES_PER_MIB,
+			large_pages  ? ", 4 MiB pages" : "",
+			global_pages ? ", global pages" : "");
 }
@@ -0,0 +1,124 @@
+// Allocator for page-aligned blocks of whole pages
+//
+// Every block is backed by physically contiguous frames straight from the
+// frame allocator, so we know its physical address without walking the page
+// tables. Blocks are mapped into their own region of the address space, which
+// keeps page-aligned requests out of the heap, where each one would leave a
+// hole in front of it.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "assert.h"
+#include "frame.h"
+#include "page.h"
+#include "page_alloc.h"
+#include "panic.h"
+#include "smp.h"
+
+extern Page_dir *kernel_dir;
+
+#define NUM_PAGES (PAGES_MAX_SIZE / PAGE_SIZE)
+
+// The first page is never handed out, so 0 can mean "no block"
+#define NO_BLOCK  0
+
+// The number of pages in the block starting at each page, or 0 if there isn't
+// one
+static uint16_t block_pages[NUM_PAGES];
+
+// Address space is handed out in blocks of 2^order pages, and freed blocks
+// are kept in a list for each order to be reused
+static uint16_t next_block[NUM_PAGES];
+static uint16_t free_blocks[MAX_ORDER + 1];
+
+// The first page that's never been used
+static uint32_t next_page = 1;
+
+static size_t order_for(size_t num_pages)
+{
+	size_t order = 0;
+	while ((1u << order) < num_pages)
+		order++;
+
+	return order;
+}
+
+void *page_alloc(size_t size, uint32_t *phys)
+{
+	size_t num_pages = align_up(size) / PAGE_SIZE;
+	size_t order     = order_for(num_pages);
+	ASSERT(num_pages > 0 && order <= MAX_ORDER);
+
+	// Find some address space for it
+	uint32_t block = free_blocks[order];
+	if (block != NO_BLOCK) {
+		free_blocks[order] = next_block[block];
+	} else {
+		if (next_page + (1 << order) > NUM_PAGES)
+			PANIC("Out of page allocator space!");
+
+		block      = next_page;
+		next_page += 1 << order;
+	}
+
+	// The frame allocator only deals in powers of two, so give back whatever
+	// we don't need off the end
+	uint32_t frame = alloc_frames(order);
+	if (num_pages < (1u << order))
+		free_frame_range(frame + num_pages, (1 << order) - num_pages);
+
+	uintptr_t addr = PAGES_START + block * PAGE_SIZE;
+	for (size_t i = 0; i < num_pages; i++)
+		set_frame(get_page(addr + i * PAGE_SIZE, false, kernel_dir), frame + i,
+				true, true);
+
+	block_pages[block] = num_pages;
+
+	if (phys)
+		*phys = frame * PAGE_SIZE;
+
+	return (void*)addr;
+}
+
+void page_free(void *ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+
+	// Sanity checks
+	ASSERT(page_alloc_owns(ptr) && aligned(addr));
+	uint32_t block     = (addr - PAGES_START) / PAGE_SIZE;
+	size_t   num_pages = block_pages[block];
+	ASSERT(num_pages != 0);
+
+	uint32_t frame = get_page(addr, false, kernel_dir)->frame;
+
+	for (size_t i = 0; i < num_pages; i++) {
+		Page_entry *page = get_page(addr + i * PAGE_SIZE, false, kernel_dir);
+		page->present    = 0;
+		page->frame      = 0;
+		invalidate_page(addr + i * PAGE_SIZE);
+	}
+
+	// Before anyone else can have the frames, or the address space
+	tlb_shootdown();
+	free_frame_range(frame, num_pages);
+
+	size_t order        = order_for(num_pages);
+	block_pages[block]  = 0;
+	next_block[block]   = free_blocks[order];
+	free_blocks[order]  = block;
+}
+
+// How many bytes the block at ptr has room for
+size_t page_alloc_size(void *ptr)
+{
+	ASSERT(page_alloc_owns(ptr));
+	return block_pages[((uintptr_t)ptr - PAGES_START) / PAGE_SIZE] * PAGE_SIZE;
+}
+
+bool page_alloc_owns(void *ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+	return addr >= PAGES_START && addr < PAGES_START + PAGES_MAX_SIZE;
+}
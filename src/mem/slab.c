@@ -0,0 +1,279 @@
+// Slab allocator for fixed-size kernel objects
+// Loosely based on Bonwick's "The Slab Allocator: An Object-Caching Kernel
+// Memory Allocator" (USENIX 1994)
+//
+// Each cache hands out objects of one size from slabs: runs of pages that
+// are carved up into equal sized objects. Slabs are mapped straight from the
+// frame allocator into their own region of the address space, so none of
+// this touches the heap. That matters, as the heap itself allocates page
+// tables from here when it expands.
+//
+// One lock covers every cache. Slabs are only made while holding it, so
+// that's also what keeps the slab region's bookkeeping consistent.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "assert.h"
+#include "page.h"
+#include "panic.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "term.h"
+
+extern Page_dir *kernel_dir;
+
+// Small objects share their pages with the Slab describing them. Anything
+// bigger than this has its Slab allocated separately, so it doesn't waste
+// most of a page.
+#define MAX_ON_SLAB_SIZE (PAGE_SIZE / 8)
+
+// Off-slab caches get slabs big enough for at least this many objects
+#define MIN_OBJS_PER_SLAB 8
+
+// The slab each page in the slab region belongs to, so we can find the slab
+// for an object from its address alone
+static Slab *page_slabs[SLAB_MAX_SIZE / PAGE_SIZE];
+
+static uintptr_t slab_next = SLAB_START;
+
+// Caches for the caches and off-slab Slabs themselves
+static Kmem_cache cache_cache;
+static Kmem_cache slab_cache;
+
+static Kmem_cache *caches = NULL;
+
+static Spinlock    slab_lock = SPINLOCK_INIT;
+
+static void *cache_alloc(Kmem_cache *cache);
+
+static void slab_push(Slab **list, Slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list != NULL)
+		(*list)->prev = slab;
+	*list = slab;
+}
+
+static void slab_remove(Slab **list, Slab *slab)
+{
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+}
+
+static void **obj_link(Kmem_cache *cache, void *obj)
+{
+	return (void**)((uintptr_t)obj + cache->link_offset);
+}
+
+static uintptr_t round_up(uintptr_t x, size_t align)
+{
+	return (x + align - 1) & ~(align - 1);
+}
+
+static void init_cache(Kmem_cache *cache, const char *name, size_t size,
+		size_t align, Ctor ctor)
+{
+	ASSERT(size > 0);
+	ASSERT(align <= PAGE_SIZE && (align & (align - 1)) == 0);
+
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+
+	cache->name = name;
+	cache->size = size;
+	cache->ctor = ctor;
+
+	// The free list link would overwrite the object's constructed state, so
+	// caches with a constructor keep it just past the end of the object
+	cache->link_offset = ctor == NULL ? 0 : size;
+	cache->stride      = round_up(cache->link_offset + sizeof(void*), align);
+	if (cache->stride < round_up(size, align))
+		cache->stride = round_up(size, align);
+
+	cache->off_slab = cache->stride > MAX_ON_SLAB_SIZE;
+	if (cache->off_slab) {
+		cache->first_obj  = 0;
+		cache->slab_pages =
+			align_up(cache->stride * MIN_OBJS_PER_SLAB) / PAGE_SIZE;
+	} else {
+		cache->first_obj  = round_up(sizeof(Slab), align);
+		cache->slab_pages = 1;
+	}
+
+	cache->per_slab = (cache->slab_pages * PAGE_SIZE - cache->first_obj) /
+		cache->stride;
+
+	cache->partial      = NULL;
+	cache->full         = NULL;
+	cache->empty        = NULL;
+	cache->in_use       = 0;
+	cache->peak_in_use  = 0;
+	cache->total_allocs = 0;
+	cache->total_frees  = 0;
+	cache->num_slabs    = 0;
+
+	cache->next = caches;
+	caches      = cache;
+}
+
+static void init_boot_caches()
+{
+	init_cache(&cache_cache, "kmem_cache", sizeof(Kmem_cache), 0, NULL);
+	init_cache(&slab_cache,  "slab",       sizeof(Slab),       0, NULL);
+}
+
+// Map in fresh pages for a new slab and carve it up into objects
+static Slab *new_slab(Kmem_cache *cache)
+{
+	size_t    length = cache->slab_pages * PAGE_SIZE;
+	uintptr_t start  = slab_next;
+
+	if (start + length > SLAB_START + SLAB_MAX_SIZE)
+		PANIC("Out of slab space!");
+
+	slab_next += length;
+
+	// The page tables for the slab region were all made in init_paging(),
+	// so this never has to allocate anything
+	for (uintptr_t page = start; page < start + length; page += PAGE_SIZE)
+		alloc_frame(get_page(page, false, kernel_dir), true, true);
+
+	Slab *slab;
+	if (cache->off_slab)
+		slab = cache_alloc(&slab_cache);
+	else
+		slab = (Slab*)start;
+
+	slab->cache  = cache;
+	slab->start  = start;
+	slab->in_use = 0;
+	slab->free   = NULL;
+
+	for (uintptr_t page = start; page < start + length; page += PAGE_SIZE)
+		page_slabs[(page - SLAB_START) / PAGE_SIZE] = slab;
+
+	// Thread the free list through the objects backwards, so that they get
+	// handed out in address order
+	for (size_t i = cache->per_slab; i > 0; i--) {
+		uintptr_t obj = start + cache->first_obj + (i - 1) * cache->stride;
+
+		if (cache->ctor != NULL)
+			cache->ctor((void*)obj);
+
+		*obj_link(cache, (void*)obj) = slab->free;
+		slab->free                   = (void*)obj;
+	}
+
+	cache->num_slabs++;
+
+	return slab;
+}
+
+Kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+		Ctor ctor)
+{
+	uint32_t eflags = spin_lock_irqsave(&slab_lock);
+
+	if (cache_cache.size == 0)
+		init_boot_caches();
+
+	Kmem_cache *cache = cache_alloc(&cache_cache);
+	init_cache(cache, name, size, align, ctor);
+
+	spin_unlock_irqrestore(&slab_lock, eflags);
+	return cache;
+}
+
+static void *cache_alloc(Kmem_cache *cache)
+{
+	Slab *slab = cache->partial;
+
+	if (slab == NULL) {
+		// Use up empty slabs before we go asking for more pages
+		if (cache->empty != NULL) {
+			slab = cache->empty;
+			slab_remove(&cache->empty, slab);
+		} else {
+			slab = new_slab(cache);
+		}
+
+		slab_push(&cache->partial, slab);
+	}
+
+	void *obj  = slab->free;
+	slab->free = *obj_link(cache, obj);
+	slab->in_use++;
+
+	if (slab->free == NULL) {
+		slab_remove(&cache->partial, slab);
+		slab_push(&cache->full, slab);
+	}
+
+	cache->total_allocs++;
+	if (++cache->in_use > cache->peak_in_use)
+		cache->peak_in_use = cache->in_use;
+
+	return obj;
+}
+
+void *kmem_cache_alloc(Kmem_cache *cache)
+{
+	uint32_t eflags = spin_lock_irqsave(&slab_lock);
+	void    *obj    = cache_alloc(cache);
+	spin_unlock_irqrestore(&slab_lock, eflags);
+
+	return obj;
+}
+
+void kmem_cache_free(Kmem_cache *cache, void *obj)
+{
+	if (obj == NULL)
+		return;
+
+	uintptr_t addr   = (uintptr_t)obj;
+	uint32_t  eflags = spin_lock_irqsave(&slab_lock);
+
+	// Sanity checks
+	ASSERT(addr >= SLAB_START && addr < slab_next);
+	Slab *slab = page_slabs[(addr - SLAB_START) / PAGE_SIZE];
+	ASSERT(slab != NULL && slab->cache == cache);
+	ASSERT((addr - slab->start - cache->first_obj) % cache->stride == 0);
+
+	// A full slab is about to have a free object again
+	if (slab->free == NULL) {
+		slab_remove(&cache->full, slab);
+		slab_push(&cache->partial, slab);
+	}
+
+	*obj_link(cache, obj) = slab->free;
+	slab->free            = obj;
+
+	// Empty slabs are kept around for the next time the cache runs out,
+	// rather than giving their frames back
+	if (--slab->in_use == 0) {
+		slab_remove(&cache->partial, slab);
+		slab_push(&cache->empty, slab);
+	}
+
+	cache->total_frees++;
+	cache->in_use--;
+
+	spin_unlock_irqrestore(&slab_lock, eflags);
+}
+
+void kmem_cache_print_stats()
+{
+	for (Kmem_cache *cache = caches; cache != NULL; cache = cache->next) {
+		term_printf("%s: %b objects, %u in use (peak %u), %u allocs, "
+				"%u frees, %u slab(s)\n", cache->name, cache->size,
+				cache->in_use, cache->peak_in_use, cache->total_allocs,
+				cache->total_frees, cache->num_slabs);
+	}
+}
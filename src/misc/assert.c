@@ -1,13 +1,19 @@
 // Called by the ASSERT macro
 #include <stdbool.h>
 #include "interrupt.h"
+#include "klog.h"
+#include "serial.h"
 #include "term.h"
 
 void assert(const char *asserted_expr, const char *filename, const char *func,
 		int line)
 {
+	term_seize();
+	klog_flush();
+
 	term_printf("\nFailed assert at %s, %s:%d\n %s",
 			filename, func, line, asserted_expr);
+	serial_flush();
 
 	// That's it, I'm done
 	disable_interrupts();
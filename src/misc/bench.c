@@ -0,0 +1,452 @@
+// In-kernel microbenchmarks, run at boot in kernels built with -DBENCH
+// (make DEFS=-DBENCH). Times are in TSC cycles.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "assert.h"
+#include "bench.h"
+#include "cpu.h"
+#include "div64.h"
+#include "interrupt.h"
+#include "klog.h"
+#include "kmalloc.h"
+#include "page.h"
+#include "smp.h"
+#include "string.h"
+#include "thread.h"
+#include "timer.h"
+#include "vfs.h"
+
+extern uintptr_t placement_addr;
+
+// Passes over the pages for the TLB benchmark
+#define TLB_PASSES 32
+
+// Read a word from each page of identity mapped low memory, which is at least
+// the first MiB plus the kernel. That's far more pages than the TLB has
+// entries for with 4 KiB pages, but only one or two 4 MiB ones. Reloading
+// CR3 before a pass is what a context switch does; it throws away every TLB
+// entry that isn't global.
+static uint32_t tlb_pass(uintptr_t end, bool flush)
+{
+	if (flush)
+		flush_tlb();
+
+	uint32_t start = rdtsc();
+	for (uintptr_t addr = 0; addr < end; addr += PAGE_SIZE)
+		(void)*(volatile uint32_t*)addr;
+
+	return (uint32_t)rdtsc() - start;
+}
+
+static void tlb_bench()
+{
+	uintptr_t end       = placement_addr & ~(PAGE_SIZE - 1);
+	uint32_t  num_pages = end / PAGE_SIZE;
+	uint32_t  warm = 0, flushed = 0;
+
+	tlb_pass(end, false);
+	for (int i = 0; i < TLB_PASSES; i++) {
+		warm    += tlb_pass(end, false);
+		flushed += tlb_pass(end, true);
+	}
+
+	klog(KLOG_INFO, " TLB: %u pages, %u cycles/page warm, "
+			"%u cycles/page after a CR3 reload", num_pages,
+			warm / (TLB_PASSES * num_pages),
+			flushed / (TLB_PASSES * num_pages));
+}
+
+// The memory benchmarks do about this many bytes' worth of calls for each size
+#define MEM_BENCH_BYTES 0x400000
+#define MEM_BENCH_MAX   0x100000
+
+// What memcpy() used to be, for comparison
+static void *byte_copy(void *dest, const void *src, size_t n)
+{
+	uint8_t       *d = dest;
+	const uint8_t *s = src;
+
+	for (size_t i = 0; i < n; i++)
+		d[i] = s[i];
+
+	return dest;
+}
+
+typedef void *(*Copy_func)(void*, const void*, size_t);
+
+// Average cycles for one call of func with n bytes
+static uint32_t time_copy(Copy_func func, uint8_t *dest, uint8_t *src,
+		size_t n)
+{
+	uint32_t iters = MEM_BENCH_BYTES / n;
+
+	uint32_t start = rdtsc();
+	for (uint32_t i = 0; i < iters; i++)
+		func(dest, src, n);
+
+	return ((uint32_t)rdtsc() - start) / iters;
+}
+
+static uint32_t time_memset(uint8_t *dest, size_t n)
+{
+	uint32_t iters = MEM_BENCH_BYTES / n;
+
+	uint32_t start = rdtsc();
+	for (uint32_t i = 0; i < iters; i++)
+		memset(dest, i, n);
+
+	return ((uint32_t)rdtsc() - start) / iters;
+}
+
+static uint32_t time_memcmp(uint8_t *s1, uint8_t *s2, size_t n)
+{
+	uint32_t iters = MEM_BENCH_BYTES / n;
+
+	uint32_t start = rdtsc();
+	for (uint32_t i = 0; i < iters; i++)
+		memcmp(s1, s2, n);
+
+	return ((uint32_t)rdtsc() - start) / iters;
+}
+
+// Cycles per call of the memory functions for sizes from 8 B to 1 MiB, both
+// aligned and with the source off by one byte
+static void mem_bench()
+{
+	uint8_t *src  = kmalloc(MEM_BENCH_MAX + 16);
+	uint8_t *dest = kmalloc(MEM_BENCH_MAX + 16);
+
+	// Fault the pages in first
+	memset(src,  1, MEM_BENCH_MAX + 16);
+	memset(dest, 1, MEM_BENCH_MAX + 16);
+
+	static const size_t sizes[] = { 8, 64, 512, 4096, 65536, MEM_BENCH_MAX };
+
+	klog(KLOG_INFO, " size: byte loop/memcpy/unaligned memcpy/memmove/"
+			"memset/memcmp");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t   n         = sizes[i];
+		uint32_t bytes     = time_copy(byte_copy, dest,     src,     n);
+		uint32_t copy      = time_copy(memcpy,    dest,     src,     n);
+		uint32_t unaligned = time_copy(memcpy,    dest,     src + 1, n);
+		uint32_t move      = time_copy(memmove,   dest + 1, dest,    n);
+		uint32_t set       = time_memset(dest, n);
+
+		// memcmp() has to get all the way to the end
+		memcpy(dest, src, n);
+		uint32_t cmp       = time_memcmp(dest, src, n);
+
+		klog(KLOG_INFO, " %b: %u/%u/%u/%u/%u/%u cycles", n, bytes, copy,
+				unaligned, move, set, cmp);
+	}
+
+	kfree(dest);
+	kfree(src);
+}
+
+// Directory entry names of the lengths we see in our trees
+static const char *bench_names[] =
+{
+	"..",
+	"quux",
+	"lost+found",
+	"initrd_module_file_name",
+	"a_rather_long_file_name_of_the_sort_you_see_in_source_trees.c",
+};
+
+#define STR_BENCH_ITERS 10000
+
+// What the string functions used to be, for comparison
+static size_t byte_strlen(const char *s)
+{
+	size_t len = 0;
+	while (s[len] != '\0')
+		len++;
+
+	return len;
+}
+
+static int byte_strcmp(const char *s1, const char *s2)
+{
+	for (; *s1 == *s2 && *s1 != '\0'; s1++, s2++)
+		;
+
+	return (uint8_t)*s1 - (uint8_t)*s2;
+}
+
+static char *byte_strcpy(char *dest, const char *src)
+{
+	size_t i;
+	for (i = 0; src[i] != '\0'; i++)
+		dest[i] = src[i];
+
+	dest[i] = '\0';
+	return dest;
+}
+
+// Time a string function over STR_BENCH_ITERS calls
+#define TIME_STR(result, call) \
+	do { \
+		uint32_t start = rdtsc(); \
+		for (int i = 0; i < STR_BENCH_ITERS; i++) \
+			call; \
+		result = ((uint32_t)rdtsc() - start) / STR_BENCH_ITERS; \
+	} while (0)
+
+// Cycles per call of the string functions against the byte at a time
+// versions, on names of different lengths. strcmp() gets two equal strings,
+// so it has to look at every character, like a lookup that matches.
+static void str_bench()
+{
+	char *a = kmalloc(MAX_NAME_LENGTH);
+	char *b = kmalloc(MAX_NAME_LENGTH);
+
+	klog(KLOG_INFO, " length: strlen/strcmp/strcpy, then byte at a time "
+			"versions");
+	for (size_t i = 0; i < sizeof(bench_names) / sizeof(bench_names[0]); i++) {
+		uint32_t len, cmp, cpy, old_len, old_cmp, old_cpy;
+
+		strcpy(a, bench_names[i]);
+		strcpy(b, bench_names[i]);
+
+		TIME_STR(len,     strlen(a));
+		TIME_STR(cmp,     strcmp(a, b));
+		TIME_STR(cpy,     strcpy(b, a));
+		TIME_STR(old_len, byte_strlen(a));
+		TIME_STR(old_cmp, byte_strcmp(a, b));
+		TIME_STR(old_cpy, byte_strcpy(b, a));
+
+		klog(KLOG_INFO, " %u: %u/%u/%u vs %u/%u/%u cycles", strlen(a),
+				len, cmp, cpy, old_len, old_cmp, old_cpy);
+	}
+
+	kfree(b);
+	kfree(a);
+}
+
+#define SWITCH_BENCH_ITERS 10000
+
+static volatile bool  partner_stop;
+static Thread        *bench_thread;
+
+static void yield_partner(void *data)
+{
+	while (!partner_stop)
+		yield();
+}
+
+// Wake whoever's waiting on us, then wait for them to do the same
+static void ping_pong()
+{
+	disable_interrupts();
+	wake(bench_thread);
+	block();
+	enable_interrupts();
+}
+
+static void wake_partner(void *data)
+{
+	while (!partner_stop)
+		ping_pong();
+
+	wake(bench_thread);
+}
+
+// Cycles per thread switch, with two threads taking turns. Once by yielding,
+// then by waking each other up and blocking.
+static void switch_bench()
+{
+	uint32_t start, yielding, waking;
+
+	bench_thread = current_thread();
+
+	partner_stop = false;
+	thread_create("yield_bench", yield_partner, NULL);
+	yield();
+
+	start = rdtsc();
+	for (int i = 0; i < SWITCH_BENCH_ITERS; i++)
+		yield();
+	yielding = ((uint32_t)rdtsc() - start) / (SWITCH_BENCH_ITERS * 2);
+
+	partner_stop = true;
+	yield();
+
+	// The partner goes first, and starts off by waking us, so we have to
+	// be blocked by then
+	partner_stop = false;
+	disable_interrupts();
+	Thread *partner = thread_create("wake_bench", wake_partner, NULL);
+	block();
+	enable_interrupts();
+
+	start = rdtsc();
+	for (int i = 0; i < SWITCH_BENCH_ITERS; i++) {
+		disable_interrupts();
+		wake(partner);
+		block();
+		enable_interrupts();
+	}
+	waking = ((uint32_t)rdtsc() - start) / (SWITCH_BENCH_ITERS * 2);
+
+	partner_stop = true;
+	disable_interrupts();
+	wake(partner);
+	block();
+	enable_interrupts();
+
+	klog(KLOG_INFO, " thread switch: %u cycles yielding, %u waking",
+			yielding, waking);
+}
+
+// The same amount of work split between 1, 2, ... threads, one for each CPU
+#define SMP_BENCH_SPINS  0x2000000
+#define SMP_BENCH_ALLOCS 0x40000
+#define SMP_BENCH_STRESS 0x40000
+
+// Each stress thread keeps this many blocks alive at once
+#define STRESS_SLOTS     64
+
+static volatile uint32_t  jobs_left;
+static Thread            *jobs_waiter;
+
+static void job_done()
+{
+	if (__sync_sub_and_fetch(&jobs_left, 1) == 0)
+		wake(jobs_waiter);
+}
+
+// Pure computation, which shares nothing and should scale perfectly
+static void spin_job(void *data)
+{
+	volatile uint32_t sum = 0;
+	for (uint32_t i = 0; i < (uintptr_t)data; i++)
+		sum += i;
+
+	job_done();
+}
+
+// Small allocations, which mostly stay in the CPU's magazines
+static void kmalloc_job(void *data)
+{
+	for (uint32_t i = 0; i < (uintptr_t)data; i++)
+		kfree(kmalloc(16 << (i % 4)));
+
+	job_done();
+}
+
+// Random sizes, freed in random order, so the magazines keep running out
+// and filling up. Each block is marked with where it is, to catch any
+// handed out twice.
+static void stress_job(void *data)
+{
+	uint32_t *slots[STRESS_SLOTS] = { NULL };
+	uint32_t  seed = (uintptr_t)current_thread();
+
+	for (uint32_t i = 0; i < (uintptr_t)data; i++) {
+		// Xorshift
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		uint32_t **slot = &slots[seed % STRESS_SLOTS];
+		if (*slot != NULL) {
+			ASSERT(**slot == (uintptr_t)slot);
+			kfree(*slot);
+			*slot = NULL;
+		} else {
+			*slot  = kmalloc(sizeof(uint32_t) << (seed >> 8) % 8);
+			**slot = (uintptr_t)slot;
+		}
+	}
+
+	for (uint32_t i = 0; i < STRESS_SLOTS; i++)
+		kfree(slots[i]);
+
+	job_done();
+}
+
+// Microseconds for n threads to do total units of func's work between them
+static uint32_t run_jobs(Thread_func func, uint32_t total, uint32_t n)
+{
+	jobs_waiter = current_thread();
+	jobs_left   = n;
+
+	uint64_t start = uptime_ns();
+	for (uint32_t i = 0; i < n; i++)
+		thread_create("smp_bench", func, (void*)(uintptr_t)(total / n));
+
+	// Waking us leaves a token if we're not blocked yet, so wakes can't
+	// get lost, but there might be an old one lying around too
+	while (jobs_left != 0)
+		block();
+
+	uint64_t time = uptime_ns() - start;
+	div64(&time, 1000);
+	return time;
+}
+
+// Speedup over one thread, in hundredths
+static uint32_t speedup(uint32_t one, uint32_t n)
+{
+	if (n == 0)
+		return 0;
+
+	uint64_t ratio = (uint64_t)one * 100;
+	div64(&ratio, n);
+	return ratio;
+}
+
+// How well work spreads over the CPUs, with more and more threads
+static void smp_bench()
+{
+	uint32_t spin_one = 0, alloc_one = 0, stress_one = 0;
+
+	klog(KLOG_INFO, " threads: compute, kmalloc/kfree, then kmalloc "
+			"stress (speedup)");
+	for (uint32_t n = 1; n <= num_cpus; n++) {
+		uint32_t spin   = run_jobs(spin_job,    SMP_BENCH_SPINS,  n);
+		uint32_t alloc  = run_jobs(kmalloc_job, SMP_BENCH_ALLOCS, n);
+		uint32_t stress = run_jobs(stress_job,  SMP_BENCH_STRESS, n);
+		if (n == 1) {
+			spin_one   = spin;
+			alloc_one  = alloc;
+			stress_one = stress;
+		}
+
+		uint32_t spin_up   = speedup(spin_one,   spin);
+		uint32_t alloc_up  = speedup(alloc_one,  alloc);
+		uint32_t stress_up = speedup(stress_one, stress);
+		klog(KLOG_INFO, " %u: %u us (%u.%02ux), %u us (%u.%02ux), "
+				"%u us (%u.%02ux)", n,
+				spin,   spin_up   / 100, spin_up   % 100,
+				alloc,  alloc_up  / 100, alloc_up  % 100,
+				stress, stress_up / 100, stress_up % 100);
+	}
+}
+
+void run_benchmarks()
+{
+	if (!cpu_has(CPUID_TSC)) {
+		klog(KLOG_INFO, " No TSC, skipping benchmarks");
+		return;
+	}
+
+	tlb_bench();
+	mem_bench();
+	str_bench();
+	smp_bench();
+}
+
+// With other CPUs running, each thread would get one to itself, and yield()
+// wouldn't switch at all, so this has to be run before they're started
+void run_switch_bench()
+{
+	if (!cpu_has(CPUID_TSC)) {
+		klog(KLOG_INFO, " No TSC, skipping benchmark");
+		return;
+	}
+
+	switch_bench();
+}
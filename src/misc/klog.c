@@ -0,0 +1,180 @@
+// Kernel log, like dmesg
+//
+// klog() formats a line into the next slot of a ring buffer and returns,
+// without drawing anything. Consoles get the lines later, from a tasklet that
+// drains the log, so whoever logged something doesn't have to wait for the
+// VGA terminal. A panic flushes whatever's left straight away.
+//
+// Logging doesn't take a lock, as it has to work from interrupt handlers that
+// may have interrupted another klog(). Each call reserves a slot by bumping
+// the head with an atomic add, then marks the slot as written by storing its
+// sequence number in it. Readers check the sequence number before and after
+// copying an entry out, so one that got overwritten under them is noticed.
+
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "klog.h"
+#include "tasklet.h"
+#include "term.h"
+#include "timer.h"
+
+#define MAX_CONSOLES 4
+
+static Klog_entry        ring[KLOG_ENTRIES];
+
+// Sequence number of the next entry to be reserved
+static volatile uint32_t head = 0;
+
+// Sequence number of the next entry the consoles haven't seen
+static uint32_t          drained = 0;
+static uint32_t          lost    = 0;
+static volatile int      draining = 0;
+
+static Klog_console      consoles[MAX_CONSOLES];
+static size_t            num_consoles = 0;
+
+static void drain_tasklet(void *data);
+static Tasklet           drainer = TASKLET(drain_tasklet, NULL);
+
+#define barrier() __asm__ volatile ("" ::: "memory")
+
+void klog(Klog_level level, const char *fmt, ...)
+{
+	uint32_t    seq   = __sync_fetch_and_add(&head, 1);
+	Klog_entry *entry = &ring[seq % KLOG_ENTRIES];
+
+	entry->seq = 0;
+	barrier();
+
+	entry->time  = uptime();
+	entry->level = level;
+
+	va_list args;
+	va_start(args, fmt);
+	kvsnprintf(entry->msg, KLOG_MSG_SIZE, fmt, args);
+	va_end(args);
+
+	barrier();
+	entry->seq = seq + 1;
+
+	tasklet_schedule(&drainer);
+}
+
+// Copy out the entry with sequence number *seq, or the oldest one after it
+// that's still around, and move *seq past it. Returns false if there's
+// nothing there yet, either because we've caught up or because the next
+// entry is still being written.
+bool klog_read(uint32_t *seq, Klog_entry *entry)
+{
+	for (;;) {
+		uint32_t newest = head;
+		if (*seq == newest)
+			return false;
+
+		// Fallen behind by more than the ring holds
+		if (newest - *seq > KLOG_ENTRIES)
+			*seq = newest - KLOG_ENTRIES;
+
+		Klog_entry *slot = &ring[*seq % KLOG_ENTRIES];
+		if (slot->seq != *seq + 1) {
+			// Overwritten by a newer entry, so go round again
+			if (head - *seq > KLOG_ENTRIES)
+				continue;
+			return false;
+		}
+
+		barrier();
+		memcpy(entry, slot, sizeof(Klog_entry));
+		barrier();
+
+		if (slot->seq != *seq + 1)
+			continue;
+
+		(*seq)++;
+		return true;
+	}
+}
+
+static void drain()
+{
+	Klog_entry entry;
+	uint32_t   start = drained;
+
+	while (klog_read(&drained, &entry)) {
+		lost += drained - 1 - start;
+		start = drained;
+
+		for (size_t i = 0; i < num_consoles; i++)
+			consoles[i](&entry);
+	}
+}
+
+// Hand new entries to the consoles. Tasklets can run in the middle of
+// anything, so this gives up if it'd get in the way of someone already
+// drawing, and tries again after the next interrupt, by which time they've
+// hopefully finished.
+static void drain_tasklet(void *data)
+{
+	if (drained == head)
+		return;
+
+	if (term_busy() || __sync_lock_test_and_set(&draining, 1)) {
+		tasklet_schedule(&drainer);
+		return;
+	}
+
+	drain();
+	__sync_lock_release(&draining);
+}
+
+// Get everything out now, whatever else is going on. For panics, where
+// there's no later.
+void klog_flush()
+{
+	drain();
+}
+
+void klog_add_console(Klog_console console)
+{
+	if (num_consoles < MAX_CONSOLES)
+		consoles[num_consoles++] = console;
+}
+
+static void term_console(const Klog_entry *entry)
+{
+	static const enum VGAColor colors[] = {
+		[KLOG_DEBUG] = DARK_GREY,
+		[KLOG_INFO]  = WHITE,
+		[KLOG_WARN]  = LIGHT_BROWN,
+		[KLOG_ERR]   = LIGHT_RED,
+	};
+
+	term_hold();
+	term_set_color(make_color(colors[entry->level], BLACK));
+	term_printf("[%lums] %s\n", entry->time, entry->msg);
+	term_set_color(make_color(WHITE, BLACK));
+	term_release();
+}
+
+// Print everything the log still remembers, e.g. after it's scrolled off
+// the screen
+void klog_dump()
+{
+	Klog_entry entry;
+	uint32_t   seq = head > KLOG_ENTRIES ? head - KLOG_ENTRIES : 0;
+
+	term_hold();
+	term_printf("%u entries logged, %u dropped before reaching a console\n",
+			head, lost);
+	while (klog_read(&seq, &entry))
+		term_console(&entry);
+	term_release();
+}
+
+void init_klog()
+{
+	klog_add_console(term_console);
+}
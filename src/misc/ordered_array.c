@@ -69,5 +69,5 @@ void ordered_array_remove(Ordered_array *array, size_t i)
 	for (; i < array->size; i++)
 		array->array[i] = array->array[i + 1];
 
-	array->size++;
+	array->size--;
 }
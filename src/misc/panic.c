@@ -1,14 +1,27 @@
 // AAAARRRGGHHH!!!!
 #include "interrupt.h"
+#include "klog.h"
+#include "serial.h"
+#include "smp.h"
 #include "term.h"
 
 void panic(const char *message, const char *filename, const char *func, int line)
 {
+	// Nothing else should carry on regardless, or get in the way
+	disable_interrupts();
+	stop_other_cpus();
+
+	// Whoever was drawing or sending isn't going to finish now
+	term_seize();
+	serial_seize();
+
+	// Whatever led up to this is probably still in the log
+	klog_flush();
+
 	term_printf("Kernel panic!\n%s, %s:%d: %s", filename, func, line, message);
+	serial_flush();
 
 	// That's it, I'm done
-	disable_interrupts();
-
 	for (;;)
 		;
 }
@@ -0,0 +1,161 @@
+// Sampling profiler
+//
+// While profiling, the timer interrupts every PROFILE_INTERVAL_MS and
+// records where it interrupted, and optionally the chain of return addresses
+// above that, found by following the saved frame pointers. Samples go in a
+// fixed buffer, so taking one never allocates; once it's full, the rest are
+// just counted.
+//
+// profile_dump() sends the samples over the serial port as hex addresses,
+// and tools/profile.sh turns them into a flat profile or folded stacks for
+// flame graphs, using the symbols in the kernel binary. That takes a while
+// at 115200 baud, so it's done by a thread of its own rather than holding
+// up whatever asked for it.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "interrupt.h"
+#include "klog.h"
+#include "profile.h"
+#include "serial.h"
+#include "term.h"
+#include "thread.h"
+#include "timer.h"
+
+// Each sample is its length, then the interrupted EIP, then the return
+// addresses above it, innermost first
+#define PROFILE_WORDS 0x8000 // 128 KiB
+#define MAX_DEPTH     16
+
+// No stack is bigger than this, so neither is the gap between two frames
+#define MAX_FRAME_GAP 0x4000
+
+static uint32_t samples[PROFILE_WORDS];
+static size_t   used     = 0;
+static uint32_t taken    = 0;
+static uint32_t dropped  = 0;
+static bool     running  = false;
+static bool     stacks   = false;
+
+// Set while a thread is sending the samples, which mustn't change under it
+static volatile bool dumping = false;
+
+// Keep what's already there, if anything, so that profiling can be paused
+// and carried on
+void profile_start(bool with_stacks)
+{
+	if (dumping) {
+		klog(KLOG_WARN, "Still sending the last profile");
+		return;
+	}
+
+	uint32_t eflags = save_interrupts();
+	stacks  = with_stacks;
+	running = true;
+	restore_interrupts(eflags);
+
+	// Rather than whenever the timer was next going to go off
+	timer_wake_at(uptime() + PROFILE_INTERVAL_MS);
+}
+
+void profile_stop()
+{
+	running = false;
+}
+
+bool profiling()
+{
+	return running;
+}
+
+// Frames are two words, and have to be on the stack we were interrupted on
+// before we go looking at them
+static bool frame_ok(const uint32_t *frame)
+{
+	return ((uintptr_t)frame & 3) == 0 &&
+		on_thread_stack((uintptr_t)frame, 2 * sizeof(uint32_t));
+}
+
+// Called from the timer interrupt
+void profile_sample(const Registers *regs)
+{
+	uint32_t frames[MAX_DEPTH];
+	size_t   depth = 0;
+
+	frames[depth++] = regs->eip;
+
+	// Each frame starts with the caller's frame pointer, then the return
+	// address. Stacks grow down, so a frame pointer that doesn't go up a
+	// little is garbage, and one of 0 marks the top of every thread's stack.
+	// The interrupted code needn't have been using %ebp as one at all.
+	uint32_t *frame = (uint32_t*)regs->ebp;
+	while (stacks && depth < MAX_DEPTH && frame_ok(frame)) {
+		frames[depth++] = frame[1];
+
+		uint32_t *next = (uint32_t*)frame[0];
+		if ((uintptr_t)next <= (uintptr_t)frame ||
+				(uintptr_t)next - (uintptr_t)frame > MAX_FRAME_GAP)
+			break;
+		frame = next;
+	}
+
+	taken++;
+	if (used + depth + 1 > PROFILE_WORDS) {
+		dropped++;
+		return;
+	}
+
+	samples[used++] = depth;
+	for (size_t i = 0; i < depth; i++)
+		samples[used++] = frames[i];
+}
+
+// Wait for the serial port to have room for a line, rather than have
+// serial_write() wait for it with interrupts disabled. Newlines go out as
+// two bytes.
+static void send(const char *str, size_t len)
+{
+	while (serial_room() < len * 2)
+		sleep(1);
+
+	serial_write(str, len);
+}
+
+// Send the samples over the serial port, one per line, between markers that
+// tools/profile.sh looks for, and start again from empty
+static void send_samples(void *data)
+{
+	char line[MAX_DEPTH * 9 + 1];
+
+	size_t len = ksnprintf(line, sizeof(line),
+			"profile: %u samples, %u dropped\n", taken, dropped);
+	send(line, len);
+
+	for (size_t i = 0; i < used; i += samples[i] + 1) {
+		len = 0;
+		for (uint32_t j = 1; j <= samples[i]; j++)
+			len += ksnprintf(line + len, sizeof(line) - len, "%x%s",
+					samples[i + j], j < samples[i] ? " " : "\n");
+		send(line, len);
+	}
+
+	send("profile: end\n", 13);
+	klog(KLOG_INFO, "Sent %u profile samples to the serial port", taken);
+
+	used    = 0;
+	taken   = 0;
+	dropped = 0;
+	dumping = false;
+}
+
+// Stop profiling, and start sending what we've got
+void profile_dump()
+{
+	profile_stop();
+	if (dumping)
+		return;
+
+	dumping = true;
+	thread_create("profile_dump", send_samples, NULL);
+}
@@ -0,0 +1,49 @@
+// Spinlocks, for data shared between CPUs
+//
+// Anything an interrupt handler can also take has to be locked with
+// interrupts disabled, or the handler could spin forever on a lock the code
+// it interrupted holds; that's what the irqsave versions are for. With only
+// one CPU, they come down to disabling interrupts, as before.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "interrupt.h"
+#include "smp.h"
+#include "spinlock.h"
+
+void spin_lock(Spinlock *lock)
+{
+	while (__sync_lock_test_and_set(&lock->locked, 1)) {
+		// Wait until it looks free before trying again, so we're not
+		// bouncing the cache line between CPUs the whole time. Whoever
+		// has it might be waiting for us to flush our TLB, which we
+		// can't be interrupted to do if interrupts are disabled.
+		while (lock->locked) {
+			tlb_poll();
+			__asm__ volatile ("pause");
+		}
+	}
+}
+
+bool spin_trylock(Spinlock *lock)
+{
+	return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+void spin_unlock(Spinlock *lock)
+{
+	__sync_lock_release(&lock->locked);
+}
+
+uint32_t spin_lock_irqsave(Spinlock *lock)
+{
+	uint32_t eflags = save_interrupts();
+	spin_lock(lock);
+	return eflags;
+}
+
+void spin_unlock_irqrestore(Spinlock *lock, uint32_t eflags)
+{
+	spin_unlock(lock);
+	restore_interrupts(eflags);
+}
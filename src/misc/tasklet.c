@@ -0,0 +1,112 @@
+// Deferred interrupt work, like Linux's tasklets
+//
+// IRQ handlers run with interrupts disabled, so anything slow in one holds up
+// every other interrupt. Handlers should only do what the hardware needs
+// doing right away, and schedule a tasklet for the rest. Tasklets run on the
+// way out of the IRQ, after the EOI, with interrupts enabled, or from the
+// idle loop. Each tasklet only ever has one run going at once, and they never
+// run alongside each other.
+//
+// They can be scheduled from any CPU, but only the boot CPU runs them, and
+// gets an IPI if it's another CPU that schedules one. It's the one that
+// takes device interrupts by default, so that's where nearly all of them
+// come from anyway, and it keeps them from ever running alongside each other.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "interrupt.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "tasklet.h"
+
+// Tasklets that get scheduled while tasklets are running go round again,
+// but only this many times, so a tasklet that keeps rescheduling itself
+// can't keep us out of the interrupted code for good. Whatever's left runs
+// after the next interrupt, or when we're idle.
+#define MAX_ROUNDS 4
+
+static Tasklet *pending_head = NULL;
+static Tasklet *pending_tail = NULL;
+static bool     running      = false;
+static Spinlock tasklet_lock = SPINLOCK_INIT;
+
+void tasklet_schedule(Tasklet *tasklet)
+{
+	uint32_t eflags = spin_lock_irqsave(&tasklet_lock);
+	bool     remote = false;
+
+	if (!tasklet->scheduled) {
+		tasklet->scheduled = true;
+		tasklet->next      = NULL;
+
+		if (pending_tail != NULL)
+			pending_tail->next = tasklet;
+		else
+			pending_head = tasklet;
+		pending_tail = tasklet;
+
+		remote = !on_boot_cpu();
+	}
+
+	spin_unlock(&tasklet_lock);
+
+	// The boot CPU could be halted, with nothing else coming to wake it,
+	// and its way out of any interrupt runs tasklets
+	if (remote)
+		send_resched(0);
+
+	restore_interrupts(eflags);
+}
+
+void run_tasklets()
+{
+	uint32_t eflags = save_interrupts();
+
+	if (running || !on_boot_cpu()) {
+		restore_interrupts(eflags);
+		return;
+	}
+	running = true;
+
+	for (int round = 0; round < MAX_ROUNDS && pending_head != NULL; round++) {
+		spin_lock(&tasklet_lock);
+		Tasklet *tasklet = pending_head;
+		pending_head = pending_tail = NULL;
+		spin_unlock(&tasklet_lock);
+
+		enable_interrupts();
+
+		while (tasklet != NULL) {
+			Tasklet *next = tasklet->next;
+
+			// Cleared first, so it can be scheduled again while it runs.
+			// Under the lock, so whatever another CPU did before
+			// scheduling it is done by the time it runs.
+			uint32_t flags = spin_lock_irqsave(&tasklet_lock);
+			tasklet->scheduled = false;
+			spin_unlock_irqrestore(&tasklet_lock, flags);
+
+			tasklet->func(tasklet->data);
+
+			tasklet = next;
+		}
+
+		disable_interrupts();
+	}
+
+	running = false;
+	restore_interrupts(eflags);
+}
+
+// Are there any for this CPU to run?
+bool tasklets_pending()
+{
+	return pending_head != NULL && on_boot_cpu();
+}
+
+// Is this CPU in the middle of running tasklets? An interrupt that comes in
+// while it is leaves any new ones for it to get to.
+bool tasklets_running()
+{
+	return running && on_boot_cpu();
+}
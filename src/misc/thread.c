@@ -0,0 +1,486 @@
+// Kernel threads, and a round-robin scheduler
+//
+// Each thread has its own stack, and switching threads is just switching
+// stacks (see switch.s). A thread that gets preempted is switched away from
+// in the middle of an IRQ handler, and carries on from there, out through
+// the iret, when it next runs.
+//
+// Threads that are ready to run wait in a FIFO run queue, shared by every
+// CPU. Whenever there's more than one thread that could be running on a CPU,
+// the running one gets a time slice, using a timer. When that runs out, the
+// next IRQ to finish switches to the thread at the front of the queue. A CPU
+// with nothing to do runs its own idle thread, and gets sent an IPI when
+// something's put in the queue for it to pick up.
+//
+// Everything here runs with interrupts disabled, as that's what stops an
+// IRQ handler coming in and rescheduling halfway through, and under
+// sched_lock, which keeps the other CPUs out. The lock is held across the
+// switch itself, and let go of by the thread being switched to, so that no
+// other CPU can pick up a thread whose stack we're still on.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "heap.h"
+#include "interrupt.h"
+#include "kmalloc.h"
+#include "panic.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "tasklet.h"
+#include "timer.h"
+#include "thread.h"
+
+#define THREAD_STACK_SIZE 0x2000 // 8 KiB
+#define KERNEL_START      0x100000 // Where linker.ld puts us
+#define SLICE_MS          10
+
+typedef enum Thread_state
+{
+	THREAD_RUNNING,
+	THREAD_READY,   // In the run queue
+	THREAD_BLOCKED, // Waiting for someone to wake() it
+	THREAD_DEAD,    // Finished, and waiting to be freed
+} Thread_state;
+
+struct Thread
+{
+	uint32_t       esp;   // Saved stack pointer, while it's not running
+	struct Thread *next;  // Next thread in the run queue
+	Thread_state   state;
+	const char    *name;
+	uint32_t       id;
+	void          *stack; // NULL for boot threads, whose stacks aren't ours
+	Thread_func    func;
+	void          *data;
+	Timer          timer; // For sleep()
+
+	// Someone called wake() while it wasn't blocked, so the next block()
+	// returns straight away. Another CPU can wake us between checking what
+	// we're waiting for and blocking, even with interrupts disabled.
+	bool           wake_pending;
+};
+
+// Each CPU's own scheduling state
+typedef struct Cpu_sched
+{
+	Thread        *current;
+
+	// Runs when nothing else can
+	Thread        *idle_thread;
+
+	// A thread that's exited, whose stack can be freed once we're off it
+	Thread        *dead;
+
+	volatile bool  need_resched;
+	Timer          slice_timer;
+
+	// Whatever this CPU was running when it called init_threads()
+	Thread         boot_thread;
+} Cpu_sched;
+
+// In switch.s
+void switch_stacks(uint32_t *old_esp, uint32_t new_esp);
+
+static Cpu_sched sched[MAX_CPUS];
+
+static Spinlock  sched_lock = SPINLOCK_INIT;
+
+static Thread   *run_head   = NULL;
+static Thread   *run_tail   = NULL;
+
+// A bit for each CPU that's running its idle thread
+static uint32_t  idle_cpus  = 0;
+
+static uint32_t  next_id    = 0;
+
+// Only meaningful with interrupts disabled
+static Cpu_sched *here()
+{
+	return &sched[cpu_id()];
+}
+
+static void enqueue(Thread *thread)
+{
+	thread->state = THREAD_READY;
+	thread->next  = NULL;
+
+	if (run_tail != NULL)
+		run_tail->next = thread;
+	else
+		run_head = thread;
+	run_tail = thread;
+}
+
+static Thread *dequeue()
+{
+	Thread *thread = run_head;
+	if (thread != NULL) {
+		run_head = thread->next;
+		if (run_head == NULL)
+			run_tail = NULL;
+	}
+
+	return thread;
+}
+
+// Timers all go off on the boot CPU, so the CPU whose slice it was may need
+// telling
+static void end_slice(void *data)
+{
+	uint32_t cpu = (uintptr_t)data;
+
+	sched[cpu].need_resched = true;
+	if (cpu != cpu_id())
+		send_resched(cpu);
+}
+
+// Make sure the thread running on a CPU gets switched away from at some
+// point, now that something else wants to run
+static void start_slice(uint32_t cpu)
+{
+	Cpu_sched *s = &sched[cpu];
+
+	if (s->current == s->idle_thread)
+		s->need_resched = true;
+	else if (!s->slice_timer.pending)
+		timer_add(&s->slice_timer, SLICE_MS, end_slice,
+				(void*)(uintptr_t)cpu);
+}
+
+// Something's just been put in the run queue. Get an idle CPU to pick it up,
+// this one if possible, or failing that, start a time slice here.
+static void kick()
+{
+	uint32_t me = cpu_id();
+
+	if (idle_cpus & (1 << me)) {
+		sched[me].need_resched = true;
+		return;
+	}
+
+	if (idle_cpus != 0) {
+		uint32_t cpu = __builtin_ctz(idle_cpus);
+
+		// So that the next kick goes somewhere else. It gets set again if
+		// someone beats it to the thread.
+		idle_cpus &= ~(1 << cpu);
+		sched[cpu].need_resched = true;
+		send_resched(cpu);
+		return;
+	}
+
+	start_slice(me);
+}
+
+static void reap(Cpu_sched *cpu)
+{
+	Thread *dead = cpu->dead;
+
+	if (dead != NULL && dead != cpu->current) {
+		cpu->dead = NULL;
+
+		// Boot threads aren't ours to free
+		if (dead->stack != NULL) {
+			kfree(dead->stack);
+			kfree(dead);
+		}
+	}
+}
+
+// Switch to the next thread in the run queue. If the current thread is still
+// runnable, it goes to the back. Interrupts must be disabled and sched_lock
+// held; it's unlocked by the time this returns.
+static void schedule()
+{
+	uint32_t   me   = cpu_id();
+	Cpu_sched *cpu  = &sched[me];
+	Thread    *prev = cpu->current;
+
+	if (prev->state == THREAD_RUNNING && prev != cpu->idle_thread)
+		enqueue(prev);
+
+	Thread *next = dequeue();
+	if (next == NULL)
+		next = cpu->idle_thread;
+
+	cpu->need_resched = false;
+	next->state       = THREAD_RUNNING;
+	cpu->current      = next;
+
+	if (next == cpu->idle_thread)
+		idle_cpus |= 1 << me;
+	else
+		idle_cpus &= ~(1 << me);
+
+	// Anything still waiting either goes to an idle CPU, or waits for this
+	// one's slice to run out
+	if (prev->state == THREAD_READY && prev != next)
+		kick();
+	else if (run_head != NULL)
+		start_slice(me);
+	else
+		timer_cancel(&cpu->slice_timer);
+
+	if (next != prev)
+		switch_stacks(&prev->esp, next->esp);
+
+	// We're back, some time later, and maybe on another CPU
+	spin_unlock(&sched_lock);
+	reap(here());
+}
+
+// Called on the way out of each IRQ, to switch threads if the last one's
+// used up its time slice or the idle thread has something to do
+void resched_if_needed()
+{
+	Cpu_sched *cpu = here();
+
+	if (!cpu->need_resched || cpu->current == NULL)
+		return;
+
+	spin_lock(&sched_lock);
+	if (cpu->current->state == THREAD_RUNNING)
+		schedule();
+	else
+		spin_unlock(&sched_lock);
+}
+
+// New threads start here, with interrupts still disabled and sched_lock
+// still held from schedule()
+static void thread_entry()
+{
+	spin_unlock(&sched_lock);
+	reap(here());
+	enable_interrupts();
+
+	Thread *thread = current_thread();
+	thread->func(thread->data);
+	thread_exit();
+}
+
+static Thread *new_thread(const char *name, Thread_func func, void *data)
+{
+	Thread *thread = kmalloc(sizeof(Thread));
+	thread->stack  = kmalloc(THREAD_STACK_SIZE);
+	thread->name   = name;
+
+	// Heap pages only get frames once they're touched, and with no TSS to
+	// switch stacks, a page fault on the stack it's faulting on can't push
+	// anything, so double faults. Touch the whole stack now.
+	memset(thread->stack, 0, THREAD_STACK_SIZE);
+	thread->func   = func;
+	thread->data   = data;
+
+	thread->timer.pending = false;
+	thread->wake_pending  = false;
+
+	// Make it look like it's in the middle of switch_stacks(), which
+	// "returns" to thread_entry()
+	uint32_t *sp = (uint32_t*)((uintptr_t)thread->stack + THREAD_STACK_SIZE);
+	*--sp = 0;                      // Return address for thread_entry()
+	*--sp = (uint32_t)thread_entry; // Return address for switch_stacks()
+	*--sp = 0;                      // ebp
+	*--sp = 0;                      // ebx
+	*--sp = 0;                      // esi
+	*--sp = 0;                      // edi
+	thread->esp = (uint32_t)sp;
+
+	return thread;
+}
+
+Thread *thread_create(const char *name, Thread_func func, void *data)
+{
+	Thread *thread = new_thread(name, func, data);
+
+	uint32_t eflags = spin_lock_irqsave(&sched_lock);
+	thread->id = ++next_id;
+	enqueue(thread);
+	kick();
+	spin_unlock_irqrestore(&sched_lock, eflags);
+
+	return thread;
+}
+
+void thread_exit()
+{
+	disable_interrupts();
+
+	Cpu_sched *cpu = here();
+	if (cpu->current == cpu->idle_thread)
+		PANIC("The idle thread can't exit");
+
+	// Someone else will free this, once we're off its stack
+	reap(cpu);
+
+	spin_lock(&sched_lock);
+	cpu->dead           = cpu->current;
+	cpu->current->state = THREAD_DEAD;
+	schedule();
+
+	PANIC("A dead thread was scheduled");
+}
+
+Thread *current_thread()
+{
+	uint32_t eflags = save_interrupts();
+	Thread  *thread = here()->current;
+	restore_interrupts(eflags);
+
+	return thread;
+}
+
+// Let the next thread in the run queue have a go
+void yield()
+{
+	uint32_t eflags = spin_lock_irqsave(&sched_lock);
+	if (run_head != NULL)
+		schedule();
+	else
+		spin_unlock(&sched_lock);
+	restore_interrupts(eflags);
+}
+
+// Stop running until someone calls wake(), or return straight away if
+// they already have since we last blocked. Interrupts should be disabled
+// from before checking whatever we're waiting for, or the wake() could come
+// in between from this CPU and never be seen.
+void block()
+{
+	uint32_t eflags  = spin_lock_irqsave(&sched_lock);
+	Thread  *current = here()->current;
+
+	if (current->wake_pending) {
+		current->wake_pending = false;
+		spin_unlock(&sched_lock);
+	} else {
+		current->state = THREAD_BLOCKED;
+		schedule();
+	}
+
+	restore_interrupts(eflags);
+}
+
+void wake(Thread *thread)
+{
+	uint32_t eflags = spin_lock_irqsave(&sched_lock);
+
+	if (thread->state == THREAD_BLOCKED) {
+		enqueue(thread);
+		kick();
+	} else {
+		thread->wake_pending = true;
+	}
+
+	spin_unlock_irqrestore(&sched_lock, eflags);
+}
+
+// Unlike wake(), this leaves nothing pending if the thread's already awake:
+// all that means is the sleep was cut short
+static void wake_timer(void *data)
+{
+	Thread  *thread = data;
+	uint32_t eflags = spin_lock_irqsave(&sched_lock);
+
+	if (thread->state == THREAD_BLOCKED) {
+		enqueue(thread);
+		kick();
+	}
+
+	spin_unlock_irqrestore(&sched_lock, eflags);
+}
+
+// Block for at least ms milliseconds
+void sleep(unsigned long ms)
+{
+	uint32_t eflags  = spin_lock_irqsave(&sched_lock);
+	Thread  *current = here()->current;
+
+	// The current millisecond is already partly over, so wait for one more
+	timer_add(&current->timer, ms + 1, wake_timer, current);
+	current->state = THREAD_BLOCKED;
+	schedule();
+
+	restore_interrupts(eflags);
+}
+
+// The boot CPU's are always the first threads
+bool threads_started()
+{
+	return sched[0].current != NULL;
+}
+
+// Each CPU's idle thread. It only runs when nothing else can, and halts until
+// an interrupt gives it something to do. It's never in the run queue, so it
+// never moves to another CPU.
+static void idle_loop(void *data)
+{
+	Cpu_sched *cpu = here();
+
+	disable_interrupts();
+
+	for (;;) {
+		if (cpu->need_resched) {
+			spin_lock(&sched_lock);
+			schedule();
+			continue;
+		}
+
+		// Tasklets left over from the last interrupt, if it had too many
+		if (tasklets_pending()) {
+			run_tasklets();
+			continue;
+		}
+
+		wait_for_interrupt();
+	}
+}
+
+// The boot thread comes here once kernel_main() returns, and each AP's once
+// it's started up, leaving the CPU to everything else
+void idle()
+{
+	thread_exit();
+}
+
+// Whether [addr, addr + len) is on the running thread's stack, so it's safe
+// to look at from an interrupt. Boot threads' stacks aren't ours, so for
+// them it just has to be in the kernel's image or heap, which is where the
+// boot CPU's and the APs' stacks are.
+bool on_thread_stack(uintptr_t addr, size_t len)
+{
+	extern uint32_t end;
+
+	Thread *thread = here()->current;
+	if (thread != NULL && thread->stack != NULL) {
+		uintptr_t bottom = (uintptr_t)thread->stack;
+		return addr >= bottom && addr <= bottom + THREAD_STACK_SIZE - len;
+	}
+
+	return (addr >= KERNEL_START && addr <= (uintptr_t)&end - len) ||
+		(addr >= HEAP_START && addr <= HEAP_START + HEAP_MAX_SIZE - len);
+}
+
+// Turn what's running now on this CPU into its first thread, and give the
+// CPU an idle thread
+void init_threads()
+{
+	Cpu_sched *cpu  = here();
+	Thread    *boot = &cpu->boot_thread;
+
+	boot->name          = on_boot_cpu() ? "main" : "ap_boot";
+	boot->state         = THREAD_RUNNING;
+	boot->stack         = NULL;
+	boot->timer.pending = false;
+	boot->wake_pending  = false;
+
+	cpu->idle_thread         = new_thread("idle", idle_loop, NULL);
+	cpu->slice_timer.pending = false;
+
+	uint32_t eflags = spin_lock_irqsave(&sched_lock);
+	boot->id              = ++next_id;
+	cpu->idle_thread->id  = ++next_id;
+	cpu->current          = boot;
+	spin_unlock_irqrestore(&sched_lock, eflags);
+}
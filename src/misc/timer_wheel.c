@@ -0,0 +1,212 @@
+// Hierarchical timer wheel
+// Based on Varghese and Lauck's "Hashed and Hierarchical Timing Wheels"
+// (SOSP 1987), much like Linux's old timer code
+//
+// Pending timers are kept in buckets by when they're due, in four wheels of
+// 64 buckets. The first wheel has a bucket for each of the next 64
+// milliseconds, the second a bucket for each of the 64 blocks of 64 ms
+// after that, and so on. Adding or cancelling a timer is just putting it in
+// or taking it out of a list. Every time the first wheel comes round, the
+// next bucket of the second is emptied out into the first (and so on up),
+// so a timer only gets moved a few times before it goes off.
+//
+// Timers can be added and cancelled from any CPU, under one lock. They only
+// go off on the boot CPU, which takes the timer interrupt.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "interrupt.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "thread.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define NUM_WHEELS 4
+
+// Timers further off than this go in the last bucket of the last wheel for
+// now, and get put back there until they're close enough
+#define MAX_DELTA  ((1ul << (WHEEL_BITS * NUM_WHEELS)) - 1)
+
+static Timer         *wheels[NUM_WHEELS][WHEEL_SIZE];
+static size_t         num_pending = 0;
+
+// Every millisecond before this one has been dealt with
+static unsigned long  wheel_time  = 0;
+
+static Spinlock       wheel_lock  = SPINLOCK_INIT;
+
+static void timer_push(Timer **list, Timer *timer)
+{
+	timer->next  = *list;
+	timer->pprev = list;
+	if (*list != NULL)
+		(*list)->pprev = &timer->next;
+	*list = timer;
+}
+
+static void timer_remove(Timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+}
+
+static void insert(Timer *timer)
+{
+	unsigned long expires = timer->expires;
+	unsigned long delta   = expires - wheel_time;
+
+	// Overdue, so it goes off next time round
+	if ((long)delta < 0) {
+		expires = wheel_time;
+		delta   = 0;
+	} else if (delta > MAX_DELTA) {
+		expires = wheel_time + MAX_DELTA;
+		delta   = MAX_DELTA;
+	}
+
+	int level = 0;
+	while (level < NUM_WHEELS - 1 &&
+			delta >= 1ul << (WHEEL_BITS * (level + 1)))
+		level++;
+
+	size_t slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	timer_push(&wheels[level][slot], timer);
+}
+
+// Spread the bucket of the given wheel that's now come round out into the
+// wheels below. Returns its index, so the caller knows when to do the same
+// to the wheel above.
+static size_t cascade(int level)
+{
+	size_t slot = (wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	Timer *timer = wheels[level][slot];
+	wheels[level][slot] = NULL;
+
+	while (timer != NULL) {
+		Timer *next = timer->next;
+		insert(timer);
+		timer = next;
+	}
+
+	return slot;
+}
+
+void timer_add(Timer *timer, unsigned long ms, Timer_func func, void *data)
+{
+	uint32_t eflags = spin_lock_irqsave(&wheel_lock);
+
+	if (timer->pending)
+		timer_remove(timer);
+	else
+		num_pending++;
+
+	timer->expires = uptime() + ms;
+	timer->func    = func;
+	timer->data    = data;
+	timer->pending = true;
+	insert(timer);
+
+	unsigned long expires = timer->expires;
+	spin_unlock_irqrestore(&wheel_lock, eflags);
+
+	timer_wake_at(expires);
+}
+
+// Returns whether the timer was still pending
+bool timer_cancel(Timer *timer)
+{
+	uint32_t eflags = spin_lock_irqsave(&wheel_lock);
+
+	bool pending = timer->pending;
+	if (pending) {
+		timer_remove(timer);
+		timer->pending = false;
+		num_pending--;
+	}
+
+	spin_unlock_irqrestore(&wheel_lock, eflags);
+	return pending;
+}
+
+// Call everything that's due by now. Called from the timer's tasklet, with
+// interrupts disabled.
+// Returns when it next needs calling, which is when the next timer is due or
+// when the first wheel next comes round, whichever's sooner.
+unsigned long run_timers(unsigned long now)
+{
+	spin_lock(&wheel_lock);
+
+	while ((long)(now - wheel_time) >= 0) {
+		size_t slot = wheel_time & WHEEL_MASK;
+
+		if (slot == 0 && cascade(1) == 0 && cascade(2) == 0)
+			cascade(3);
+
+		// Move the time on first, so that anything these add for right
+		// now goes in the next bucket, rather than this one we've emptied
+		Timer *expiring = wheels[0][slot];
+		wheels[0][slot] = NULL;
+		if (expiring != NULL)
+			expiring->pprev = &expiring;
+		wheel_time++;
+
+		// One at a time, as each one could cancel the others
+		while (expiring != NULL) {
+			Timer *timer = expiring;
+			timer_remove(timer);
+			timer->pending = false;
+			num_pending--;
+
+			// The callback may well add timers itself, or wake a thread
+			Timer_func func = timer->func;
+			void      *data = timer->data;
+			spin_unlock(&wheel_lock);
+			func(data);
+			spin_lock(&wheel_lock);
+		}
+	}
+
+	unsigned long next = wheel_time + MAX_DELTA;
+	if (num_pending != 0) {
+		next = wheel_time;
+		while (wheels[0][next & WHEEL_MASK] == NULL &&
+				(next & WHEEL_MASK) != 0)
+			next++;
+	}
+
+	spin_unlock(&wheel_lock);
+	return next;
+}
+
+static void set_flag(void *data)
+{
+	*(volatile bool*)data = true;
+}
+
+// Wait for at least ms milliseconds. Once there are threads, other threads
+// run in the meantime; before then, this just halts.
+void msleep(unsigned long ms)
+{
+	if (threads_started()) {
+		sleep(ms);
+		return;
+	}
+
+	volatile bool done = false;
+	Timer         timer;
+
+	// The current millisecond is already partly over, so wait for one more
+	timer.pending = false;
+	timer_add(&timer, ms + 1, set_flag, (void*)&done);
+
+	// Interrupts have to be off between checking and halting, or the timer
+	// could go off in between and leave us asleep
+	disable_interrupts();
+	while (!done)
+		wait_for_interrupt();
+	enable_interrupts();
+}
@@ -1,36 +1,140 @@
-// Print formatted output to the VGA terminal
+// Formatted output, into memory or to the VGA terminal
+//
+// Everything is formatted into a buffer. kvsnprintf() stops when the buffer
+// fills up; term_printf() passes the contents on to the terminal and starts
+// again, which for anything up to a line long means it's all drawn in one
+// go. Whatever term_printf() draws also goes to any sinks that have been
+// added, like the serial port.
+//
+// Conversions are %d, %u, %x, %X, %p, %s, %c, %% and %b (a size in bytes,
+// e.g. "4KiB"). Numbers can take a width, either written out or as *, which
+// pads with spaces on the left, or with zeroes if it starts with 0, or with
+// spaces on the right if preceded by -. An l or ll length modifier reads a
+// long or a 64-bit long long.
 
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include "div64.h"
 #include "term.h"
 
-static void term_print_decu(unsigned long x)
+typedef struct Out
 {
-	unsigned int divisor = 1;
+	char   *buf;
+	size_t  size;  // How many characters fit in buf
+	size_t  pos;   // Where the next one goes
+	size_t  len;   // How many characters have been output in total
 
-	for (; divisor <= x; divisor *= 10)
-		;
+	// Called with the contents of buf when it's full. If there isn't one,
+	// anything that doesn't fit gets dropped.
+	void  (*flush)(const char *str, size_t len);
+} Out;
+
+#define MAX_SINKS 4
 
-	divisor /= 10;
-	divisor = divisor == 0 ? 1 : divisor; // Always print at least one char
+static Term_sink sinks[MAX_SINKS];
+static size_t    num_sinks = 0;
 
-	for (; divisor > 0; divisor /= 10)
-		term_putchar(((x / divisor) % 10) + '0');
+void term_add_sink(Term_sink sink)
+{
+	if (num_sinks < MAX_SINKS)
+		sinks[num_sinks++] = sink;
 }
 
-static void term_print_dec(long x)
+static void out_chars(Out *out, const char *str, size_t len)
+{
+	out->len += len;
+
+	while (len > 0) {
+		if (out->pos == out->size) {
+			if (out->flush == NULL)
+				return;
+			out->flush(out->buf, out->pos);
+			out->pos = 0;
+		}
+
+		size_t n = out->size - out->pos;
+		if (n > len)
+			n = len;
+
+		for (size_t i = 0; i < n; i++)
+			out->buf[out->pos + i] = str[i];
+
+		out->pos += n;
+		str      += n;
+		len      -= n;
+	}
+}
+
+static void out_repeat(Out *out, char c, int count)
+{
+	for (; count > 0; count--)
+		out_chars(out, &c, 1);
+}
+
+// Pairs of digits for 00 to 99, so we only have to divide once every two
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+// Write x in decimal, ending just before end. Returns where it starts.
+static char *decu32(char *end, uint32_t x)
+{
+	while (x >= 100) {
+		const char *pair = &digit_pairs[(x % 100) * 2];
+		x /= 100;
+
+		*--end = pair[1];
+		*--end = pair[0];
+	}
+
+	if (x >= 10) {
+		*--end = digit_pairs[x * 2 + 1];
+		*--end = digit_pairs[x * 2];
+	} else {
+		*--end = '0' + x;
+	}
+
+	return end;
+}
+
+#define EIGHT_DIGITS 100000000
+
+static char *decu(char *end, uint64_t x)
 {
-	if (x < 0) {
-		term_putchar('-');
-		x = -x;
+	// Eight digits at a time, until what's left fits in 32 bits
+	while (x > UINT32_MAX) {
+		char *start = decu32(end, div64(&x, EIGHT_DIGITS));
+		while (start > end - 8)
+			*--start = '0';
+		end = start;
 	}
 
-	term_print_decu(x);
+	return decu32(end, x);
+}
+
+#define CASE_DIFF 32
+
+static char *hex(char *end, uint64_t x, bool upper)
+{
+	do {
+		uint8_t digit = x & 0xF;
+
+		if (digit < 0xA)
+			*--end = '0' + digit;
+		else
+			*--end = 'A' + (digit - 0xA) + (upper ? 0 : CASE_DIFF);
+
+		x >>= 4;
+	} while (x != 0);
+
+	return end;
 }
 
 #define LOG2_KIB 10
 
-static void term_print_size(unsigned long size)
+static char *human_size(char *end, uint64_t size)
 {
 	const char prefixes[] = "KMGTP";
 
@@ -38,84 +142,211 @@ static void term_print_size(unsigned long size)
 	for (; (size >> LOG2_KIB * i) > 1024; i++)
 		;
 
-	term_print_decu(size >> LOG2_KIB * i);
-
+	*--end = 'B';
 	if (i > 0) {
-		term_putchar(prefixes[i - 1]);
-		term_putchar('i');
+		*--end = 'i';
+		*--end = prefixes[i - 1];
 	}
 
-	term_putchar('B');
+	return decu(end, size >> LOG2_KIB * i);
 }
 
-#define CASE_DIFF 32
+typedef struct Spec
+{
+	int  width;
+	bool left;      // Pad on the right instead
+	bool zero;      // Pad with zeroes instead of spaces
+	int  length;    // Number of l's
+} Spec;
 
-static void term_print_hex(unsigned int x, bool upper)
+// Output a converted value with its prefix (a sign, or 0x), padded out to
+// the width. Zeroes go between the prefix and the value.
+static void out_field(Out *out, Spec *spec, const char *prefix,
+		const char *str, size_t len)
 {
-	int shift = (sizeof(unsigned int) * 8) - 4;
-	for (; ((x >> shift) & 0xF) == 0 && shift > 0; shift -= 4)
-		;
+	int prefix_len = 0;
+	while (prefix[prefix_len] != '\0')
+		prefix_len++;
 
-	for (; shift >= 0; shift -= 4) {
-		uint8_t digit = (x >> shift) & 0xF;
+	int padding = spec->width - prefix_len - (int)len;
 
-		char c;
-		if (digit < 0xA)
-			c = '0' + digit;
-		else
-			c = 'A' + (digit - 0xA) + (upper ? 0 : CASE_DIFF);
+	if (!spec->left && !spec->zero)
+		out_repeat(out, ' ', padding);
+	out_chars(out, prefix, prefix_len);
+	if (!spec->left && spec->zero)
+		out_repeat(out, '0', padding);
+	out_chars(out, str, len);
+	if (spec->left)
+		out_repeat(out, ' ', padding);
+}
+
+static uint64_t arg_unsigned(Spec *spec, va_list *args)
+{
+	if (spec->length >= 2)
+		return va_arg(*args, unsigned long long);
+	if (spec->length == 1)
+		return va_arg(*args, unsigned long);
+	return va_arg(*args, unsigned int);
+}
+
+static int64_t arg_signed(Spec *spec, va_list *args)
+{
+	if (spec->length >= 2)
+		return va_arg(*args, long long);
+	if (spec->length == 1)
+		return va_arg(*args, long);
+	return va_arg(*args, int);
+}
+
+static void format(Out *out, const char *fmt, va_list args)
+{
+	// Longest conversion is a 64-bit number in decimal
+	char  num[24];
+	char *end = num + sizeof(num);
 
-		term_putchar(c);
+	// va_list may be an array type, so pass it around by pointer
+	va_list ap;
+	va_copy(ap, args);
+
+	while (*fmt != '\0') {
+		// Copy plain text over in one go
+		const char *text = fmt;
+		while (*fmt != '\0' && *fmt != '%')
+			fmt++;
+		out_chars(out, text, fmt - text);
+
+		if (*fmt == '\0')
+			break;
+		fmt++;
+
+		Spec spec = { 0, false, false, 0 };
+		for (;; fmt++) {
+			if (*fmt == '-')
+				spec.left = true;
+			else if (*fmt == '0')
+				spec.zero = true;
+			else
+				break;
+		}
+
+		if (*fmt == '*') {
+			spec.width = va_arg(ap, int);
+			fmt++;
+		} else {
+			for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+				spec.width = spec.width * 10 + (*fmt - '0');
+		}
+
+		for (; *fmt == 'l'; fmt++)
+			spec.length++;
+
+		char *start;
+		switch (*fmt) {
+		case '%':
+			out_chars(out, "%", 1);
+			break;
+		case 'd': {
+			int64_t  x   = arg_signed(&spec, &ap);
+			uint64_t abs = x < 0 ? -(uint64_t)x : (uint64_t)x;
+			start = decu(end, abs);
+			out_field(out, &spec, x < 0 ? "-" : "", start, end - start);
+			break;
+		}
+		case 'u':
+			start = decu(end, arg_unsigned(&spec, &ap));
+			out_field(out, &spec, "", start, end - start);
+			break;
+		case 'x':
+		case 'X':
+			start = hex(end, arg_unsigned(&spec, &ap), *fmt == 'X');
+			out_field(out, &spec, "", start, end - start);
+			break;
+		case 'p':
+			start = hex(end, va_arg(ap, uintptr_t), false);
+			out_field(out, &spec, "0x", start, end - start);
+			break;
+		case 'b':
+			start = human_size(end, arg_unsigned(&spec, &ap));
+			out_field(out, &spec, "", start, end - start);
+			break;
+		case 's': {
+			const char *str = va_arg(ap, const char*);
+			size_t      len = 0;
+			while (str[len] != '\0')
+				len++;
+			spec.zero = false;
+			out_field(out, &spec, "", str, len);
+			break;
+		}
+		case 'c': {
+			char c = va_arg(ap, int);
+			spec.zero = false;
+			out_field(out, &spec, "", &c, 1);
+			break;
+		}
+		default:
+			// Unknown conversion, so leave it be
+			if (*fmt == '\0')
+				fmt--;
+			break;
+		}
+
+		fmt++;
 	}
+
+	va_end(ap);
+}
+
+static void write_term(const char *str, size_t len)
+{
+	term_write(str, len);
+
+	for (size_t i = 0; i < num_sinks; i++)
+		sinks[i](str, len);
+}
+
+// Enough for a line, which is usually all anyone prints at once
+#define TERM_PRINTF_BUF 256
+
+void term_vprintf(const char *fmt, va_list args)
+{
+	char buf[TERM_PRINTF_BUF];
+	Out  out = { buf, sizeof(buf), 0, 0, write_term };
+
+	// Anything that didn't fit in the buffer gets drawn at the end too
+	term_hold();
+	format(&out, fmt, args);
+	write_term(buf, out.pos);
+	term_release();
 }
 
 void term_printf(const char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
+	term_vprintf(fmt, args);
+	va_end(args);
+}
 
-	for (int i = 0; fmt[i] != '\0'; i++) {
-		if (fmt[i] != '%') {
-			term_putchar(fmt[i]);
-		} else {
-			char fmt_type = fmt[++i];
-			switch (fmt_type) {
-			case '%':
-				term_putchar('%');
-				break;
-			case 'd':
-				term_print_dec(va_arg(args, int));
-				break;
-			case 'u':
-				term_print_decu(va_arg(args, unsigned int));
-				break;
-			case 'l':
-				term_print_decu(va_arg(args, unsigned long));
-				break;
-			case 'x':
-				term_print_hex(va_arg(args, unsigned int), false);
-				break;
-			case 'X':
-				term_print_hex(va_arg(args, unsigned int), true);
-				break;
-			case 'b':
-				term_print_size(va_arg(args, unsigned long));
-				break;
-			case 'p':
-				term_putsn("0x");
-				term_print_hex(va_arg(args, unsigned int), false);
-				break;
-			case 's':
-				term_putsn(va_arg(args, char*));
-				break;
-			case 'c':
-				term_putchar(va_arg(args, int));
-				break;
-			default:
-				break;
-			}
-		}
-	}
+// Like vsnprintf(): the output is always NUL terminated, and the return value
+// is the length it would have been given enough space
+size_t kvsnprintf(char *buf, size_t size, const char *fmt, va_list args)
+{
+	Out out = { buf, size == 0 ? 0 : size - 1, 0, 0, NULL };
+
+	format(&out, fmt, args);
+	if (size > 0)
+		buf[out.pos] = '\0';
 
+	return out.len;
+}
+
+size_t ksnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	size_t len = kvsnprintf(buf, size, fmt, args);
 	va_end(args);
+
+	return len;
 }
@@ -2,17 +2,57 @@
 #include <stdint.h>
 #include <string.h>
 #include "dev.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "term.h"
+#include "thread.h"
 
 #define VGA_WIDTH  80
 #define VGA_HEIGHT 25
 #define CRTC_PORT 0x3D4
 
+// CRTC registers
+#define CRTC_START_HIGH  0xC
+#define CRTC_START_LOW   0xD
+#define CRTC_CURSOR_HIGH 0xE
+#define CRTC_CURSOR_LOW  0xF
+
+// VGA text memory is 32 KiB, which holds this many rows. The screen is a
+// window onto it, which scrolling moves down by changing the CRTC start
+// address. Only when the window hits the end does anything get copied.
+#define VGA_ROWS (0x8000 / (VGA_WIDTH * sizeof(uint16_t)))
+
 static size_t          curr_y      = 0;
 static size_t          curr_x      = 0;
-static uint16_t *const term_buffer = (uint16_t*)0xB8000;
+static uint16_t *const vga_buffer  = (uint16_t*)0xB8000;
 static uint8_t         term_color;
 
+// Everything is drawn here first, then the rows that changed are copied to
+// the real thing in one go. Reading and writing VGA memory is slow, so this
+// beats touching it a character at a time.
+static uint16_t        term_buffer[VGA_WIDTH * VGA_ROWS];
+
+// The row at the top of the screen, and where the CRTC was last told it is
+static size_t          top_row     = 0;
+static size_t          shown_top   = 0;
+
+// Rows that need copying across, as a range. No rows are dirty when
+// dirty_first > dirty_last.
+static size_t          dirty_first = VGA_ROWS;
+static size_t          dirty_last  = 0;
+
+// Where the hardware cursor was last put. It starts off wherever the BIOS
+// left it, so this is something it can't be, to make sure it gets moved.
+static size_t          cursor_pos  = VGA_WIDTH * VGA_ROWS;
+
+// While this is non-zero, output stays in term_buffer
+static unsigned        hold_count  = 0;
+
+// Held from the outermost term_hold() to its term_release(), by whoever
+// term_owner says
+static Spinlock        term_lock   = SPINLOCK_INIT;
+static const void     *term_owner  = NULL;
+
 uint8_t make_color(enum VGAColor fg, enum VGAColor bg)
 {
 	return fg | bg << 4;
@@ -26,18 +66,30 @@ uint16_t make_vga_entry(char c, uint8_t color)
 	return c16 | color16 << 8;
 }
 
+static void mark_dirty(size_t first, size_t last)
+{
+	if (first < dirty_first)
+		dirty_first = first;
+	if (last > dirty_last)
+		dirty_last = last;
+}
+
+// x and y are relative to the screen
 static void term_put_entry(char c, uint8_t color, size_t x, size_t y)
 {
-	term_buffer[y * VGA_WIDTH + x] = make_vga_entry(c, color);
+	term_buffer[(top_row + y) * VGA_WIDTH + x] = make_vga_entry(c, color);
+	mark_dirty(top_row + y, top_row + y);
 }
 
 void init_term()
 {
 	term_color  = make_color(WHITE, BLACK);
 
+	term_hold();
 	for (size_t y = 0; y < VGA_HEIGHT; y++)
 		for (size_t x = 0; x < VGA_WIDTH; x++)
 			term_put_entry(' ', term_color, x, y);
+	term_release();
 }
 
 void term_set_color(uint8_t color)
@@ -45,16 +97,19 @@ void term_set_color(uint8_t color)
 	term_color = color;
 }
 
-static uint16_t entry_at(size_t x, size_t y)
-{
-	return term_buffer[y * VGA_WIDTH + x];
-}
-
 static void term_scroll()
 {
-	for (size_t y = 0; y < VGA_HEIGHT - 1; y++)
-		for (size_t x = 0; x < VGA_WIDTH; x++)
-			term_buffer[y * VGA_WIDTH + x] = entry_at(x, y + 1);
+	if (top_row + VGA_HEIGHT == VGA_ROWS) {
+		// We've run out of rows below the screen, so move everything but the
+		// line that's scrolling off back to the start
+		memmove(term_buffer, term_buffer + (top_row + 1) * VGA_WIDTH,
+				(VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
+
+		top_row = 0;
+		mark_dirty(0, VGA_HEIGHT - 2);
+	} else {
+		top_row++;
+	}
 
 	for (size_t x = 0; x < VGA_WIDTH; x++)
 		term_put_entry(' ', make_color(BLACK, BLACK), x, VGA_HEIGHT - 1);
@@ -65,15 +120,105 @@ static void term_scroll()
 
 void update_cursor()
 {
-	uint16_t pos = curr_y * VGA_WIDTH + curr_x;
+	// The cursor's position is in VGA memory, not on the screen
+	uint16_t pos = (top_row + curr_y) * VGA_WIDTH + curr_x;
+	if (pos == cursor_pos)
+		return;
 
-	outb(CRTC_PORT,     0xF);        // About to send the 8 LSB through...
-	outb(CRTC_PORT + 1, pos & 0xFF); // ...there you go!
-	outb(CRTC_PORT,     0xE);        // Now for the 8 MSB...
-	outb(CRTC_PORT + 1, pos >> 8);   // ..done
+	outb(CRTC_PORT,     CRTC_CURSOR_LOW);  // About to send the 8 LSB through...
+	outb(CRTC_PORT + 1, pos & 0xFF);       // ...there you go!
+	outb(CRTC_PORT,     CRTC_CURSOR_HIGH); // Now for the 8 MSB...
+	outb(CRTC_PORT + 1, pos >> 8);         // ..done
+
+	cursor_pos = pos;
 }
 
-void term_putchar(char c)
+// Point the CRTC at the row that should be at the top of the screen
+static void update_start()
+{
+	if (top_row == shown_top)
+		return;
+
+	uint16_t start = top_row * VGA_WIDTH;
+
+	outb(CRTC_PORT,     CRTC_START_LOW);
+	outb(CRTC_PORT + 1, start & 0xFF);
+	outb(CRTC_PORT,     CRTC_START_HIGH);
+	outb(CRTC_PORT + 1, start >> 8);
+
+	shown_top = top_row;
+}
+
+// Copy the dirty rows to the screen and move the cursor
+void term_flush()
+{
+	if (dirty_first <= dirty_last) {
+		size_t offset = dirty_first * VGA_WIDTH;
+		memcpy(vga_buffer + offset, term_buffer + offset,
+				(dirty_last - dirty_first + 1) * VGA_WIDTH * sizeof(uint16_t));
+
+		dirty_first = VGA_ROWS;
+		dirty_last  = 0;
+	}
+
+	// After the copy, so the new rows are there before they're shown
+	update_start();
+	update_cursor();
+}
+
+// Whoever's drawing: the current thread, or the CPU if there isn't one yet.
+// Interrupts count as the thread they interrupted.
+static const void *owner()
+{
+	Thread *thread = current_thread();
+	return thread != NULL ? (const void*)thread : (const void*)this_cpu();
+}
+
+// Hold back output until the matching term_release(), so a whole line or
+// printf gets drawn at once, and keep anyone else from drawing until then.
+// These nest.
+void term_hold()
+{
+	const void *me = owner();
+
+	// Only we ever set it to us, so this doesn't need the lock. Spin with
+	// interrupts as they were, so that if whoever has it is a thread on
+	// this CPU, it still gets a chance to finish.
+	if (term_owner != me) {
+		while (!spin_trylock(&term_lock))
+			__asm__ volatile ("pause");
+		term_owner = me;
+	}
+
+	hold_count++;
+}
+
+void term_release()
+{
+	if (--hold_count == 0) {
+		term_flush();
+		term_owner = NULL;
+		spin_unlock(&term_lock);
+	}
+}
+
+// For panics: whoever was drawing isn't going to finish, so take over
+void term_seize()
+{
+	hold_count = 0;
+	term_owner = NULL;
+	spin_unlock(&term_lock);
+}
+
+// Is something in the middle of drawing? If so, an interrupt handler mustn't
+// draw anything itself, as it could be waiting forever for whoever it
+// interrupted.
+bool term_busy()
+{
+	return hold_count != 0;
+}
+
+static void put_char(char c)
 {
 	switch (c) {
 	case '\n':
@@ -81,13 +226,14 @@ void term_putchar(char c)
 		if (++curr_y == VGA_HEIGHT)
 			term_scroll();
 
-		update_cursor();
-
 		return;
 	case '\r':
 		curr_x = 0;
 		return;
 	case '\b':
+		if (curr_x == 0 && curr_y == 0)
+			return; // Nowhere to go back to
+
 		if (curr_x == 0) {
 			curr_x = VGA_WIDTH - 1;
 			curr_y--;
@@ -103,17 +249,36 @@ void term_putchar(char c)
 	term_put_entry(c, term_color, curr_x, curr_y);
 
 	if (++curr_x == VGA_WIDTH)
-		term_putchar('\n');
+		put_char('\n');
+}
+
+void term_putchar(char c)
+{
+	term_hold();
+	put_char(c);
+	term_release();
+}
+
+void term_write(const char *str, size_t len)
+{
+	term_hold();
+	for (size_t i = 0; i < len; i++)
+		put_char(str[i]);
+	term_release();
 }
 
 void term_putsn(const char *str)
 {
+	term_hold();
 	for (size_t i = 0; str[i] != '\0'; i++)
-		term_putchar(str[i]);
+		put_char(str[i]);
+	term_release();
 }
 
 void term_puts(const char *str)
 {
+	term_hold();
 	term_putsn(str);
-	term_putchar('\n');
+	put_char('\n');
+	term_release();
 }
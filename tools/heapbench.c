@@ -0,0 +1,729 @@
+// Benchmark the kernel heap on the host by replaying alloc/free traces
+//
+// src/mem/alloc.c and src/mem/heap.c are compiled as they are (with free and
+// realloc renamed, so as not to clash with libc) and linked against the
+// stubs below. The heap lives in an mmap'd arena that starts out inaccessible.
+// Like the kernel's page fault handler, a SIGSEGV handler gives pages frames
+// (makes them accessible) when they're first touched, and contract() takes
+// them away again.
+//
+// Traces are text, one operation per line:
+//   a ID SIZE      allocate SIZE bytes
+//   A ID SIZE      allocate SIZE bytes, page aligned
+//   f ID           free the block allocated as ID
+//   r ID NEW SIZE  resize block ID to SIZE bytes; it's called NEW after that
+// IDs can be any integer (or pointer, in hex). Anything else on a line is
+// ignored, so the output of a kernel built with TRACE_KMALLOC can be replayed
+// directly.
+//
+// Usage: heapbench [-n OPS] [-s SEED] [-d] [WORKLOAD|TRACE_FILE]...
+// where WORKLOAD is one of the synthetic workloads below. With no workloads
+// given, all of the synthetic ones are run. -d dumps the trace of each
+// workload to stdout instead of running it.
+
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "heap.h"
+#include "page.h"
+#include "slab.h"
+
+// The heap's entry points; alloc.h can't be included as it declares free()
+void *alloc(Heap *heap, size_t size, bool page_align);
+void  heap_free(Heap *heap, void *ptr);
+void *heap_realloc(Heap *heap, void *ptr, size_t size);
+
+
+// Stubs for the kernel functions the heap uses
+
+Page_dir *kernel_dir = NULL;
+
+static uintptr_t   arena;
+static Page_entry  arena_pages[HEAP_MAX_SIZE / PAGE_SIZE];
+static size_t      mapped_pages;
+static size_t      peak_mapped_pages;
+
+bool aligned(uintptr_t ptr)
+{
+	return (ptr & 0xFFF) == 0;
+}
+
+uintptr_t align_up(uintptr_t ptr)
+{
+	return (ptr + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+}
+
+Page_entry *get_page(uint32_t addr, bool make_table, Page_dir *dir)
+{
+	return &arena_pages[(addr - arena) / PAGE_SIZE];
+}
+
+static uintptr_t page_addr(Page_entry *page)
+{
+	return arena + (page - arena_pages) * PAGE_SIZE;
+}
+
+void alloc_frame(Page_entry *page, bool kernel, bool writeable)
+{
+	if (page->present)
+		return;
+
+	if (mprotect((void*)page_addr(page), PAGE_SIZE,
+				PROT_READ | PROT_WRITE) != 0) {
+		perror("mprotect");
+		exit(1);
+	}
+
+	page->present = 1;
+	if (++mapped_pages > peak_mapped_pages)
+		peak_mapped_pages = mapped_pages;
+}
+
+void free_frame(Page_entry *page)
+{
+	if (!page->present)
+		return;
+
+	void *addr = (void*)page_addr(page);
+	madvise(addr, PAGE_SIZE, MADV_DONTNEED);
+	mprotect(addr, PAGE_SIZE, PROT_NONE);
+
+	page->present = 0;
+	mapped_pages--;
+}
+
+void invalidate_page(uintptr_t addr)
+{
+}
+
+// There's only the one CPU
+void tlb_shootdown()
+{
+}
+
+// Magazines aren't replayed, but alloc.c still needs these to link
+void *kmem_cache_alloc(Kmem_cache *cache)
+{
+	return NULL;
+}
+
+void kmem_cache_free(Kmem_cache *cache, void *obj)
+{
+}
+
+// Our version of the kernel's page_fault_handler()
+static void segv_handler(int sig, siginfo_t *info, void *context)
+{
+	uintptr_t addr = (uintptr_t)info->si_addr;
+
+	if (addr < arena || addr >= arena + HEAP_MAX_SIZE) {
+		// Not ours; crash for real when we return
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	alloc_frame(get_page(addr, true, kernel_dir), true, true);
+}
+
+void *kmalloc(size_t size)
+{
+	return malloc(size);
+}
+
+void term_printf(const char *fmt, ...)
+{
+}
+
+void assert(const char *asserted_expr, const char *filename, const char *func,
+		int line)
+{
+	fprintf(stderr, "Failed assert at %s, %s:%d\n %s\n",
+			filename, func, line, asserted_expr);
+	abort();
+}
+
+
+// Traces
+
+typedef struct Op
+{
+	char     type; // 'a', 'A', 'f' or 'r'
+	uint32_t slot; // IDs are mapped to dense slot numbers when loaded
+	uint32_t size;
+} Op;
+
+typedef struct Trace
+{
+	const char *name;
+	Op         *ops;
+	size_t      num_ops;
+	size_t      max_ops;
+	uint32_t    num_slots;
+} Trace;
+
+static void push_op(Trace *trace, char type, uint32_t slot, uint32_t size)
+{
+	if (trace->num_ops == trace->max_ops) {
+		trace->max_ops = trace->max_ops == 0 ? 1024 : trace->max_ops * 2;
+		trace->ops     = realloc(trace->ops, trace->max_ops * sizeof(Op));
+	}
+
+	trace->ops[trace->num_ops++] = (Op){ type, slot, size };
+	if (slot >= trace->num_slots)
+		trace->num_slots = slot + 1;
+}
+
+// Synthetic workloads are generated with a fixed seed, so runs are
+// comparable between allocator versions
+static uint64_t rng_state;
+
+static uint32_t rng()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static uint32_t rng_range(uint32_t min, uint32_t max)
+{
+	return min + rng() % (max - min + 1);
+}
+
+// Slots are handed out by the generators from a simple stack of free ones
+typedef struct Slots
+{
+	uint32_t *free;
+	size_t    num_free;
+	uint32_t  next;
+} Slots;
+
+static uint32_t get_slot(Slots *slots)
+{
+	if (slots->num_free > 0)
+		return slots->free[--slots->num_free];
+
+	return slots->next++;
+}
+
+static void put_slot(Slots *slots, uint32_t slot)
+{
+	slots->free = realloc(slots->free,
+			(slots->num_free + 1) * sizeof(uint32_t));
+	slots->free[slots->num_free++] = slot;
+}
+
+// Roughly what booting does: a burst of long-lived allocations of kernel
+// structures, with short-lived block buffers being allocated and freed
+// in between, and the odd page-aligned allocation. Everything is freed
+// at the end of each boot, so the trace can be as long as we like.
+#define BOOT_OPS 10000
+
+static void gen_boot(Trace *trace, size_t num_ops, Slots *slots)
+{
+	uint32_t *live     = calloc(BOOT_OPS, sizeof(uint32_t));
+	uint32_t *temps    = calloc(BOOT_OPS, sizeof(uint32_t));
+	size_t    num_live = 0, num_temp = 0;
+
+	while (trace->num_ops < num_ops) {
+		for (size_t i = 0; i < BOOT_OPS; i++) {
+			uint32_t r = rng() % 100;
+
+			if (r < 5) {
+				live[num_live] = get_slot(slots);
+				push_op(trace, 'A', live[num_live++], PAGE_SIZE);
+			} else if (r < 40) {
+				// Long lived: nodes, descriptors, tables of various sizes
+				static const uint32_t sizes[] = { 24, 64, 188, 512, 1024 };
+				live[num_live] = get_slot(slots);
+				push_op(trace, 'a', live[num_live++], sizes[rng() % 5]);
+			} else if (r < 70 || num_temp == 0) {
+				// Short lived: block buffers and scratch space
+				temps[num_temp] = get_slot(slots);
+				push_op(trace, 'a', temps[num_temp++],
+						rng() % 2 ? 1024 : 4096);
+			} else {
+				size_t j = rng() % num_temp;
+				push_op(trace, 'f', temps[j], 0);
+				put_slot(slots, temps[j]);
+				temps[j] = temps[--num_temp];
+			}
+		}
+
+		for (; num_temp > 0; num_temp--) {
+			push_op(trace, 'f', temps[num_temp - 1], 0);
+			put_slot(slots, temps[num_temp - 1]);
+		}
+
+		for (; num_live > 0; num_live--) {
+			push_op(trace, 'f', live[num_live - 1], 0);
+			put_slot(slots, live[num_live - 1]);
+		}
+	}
+
+	free(live);
+	free(temps);
+}
+
+// Walking an ext2 tree: each directory gets a block buffer and a handle,
+// every entry in it gets a name and a Dir_entry that are freed soon after,
+// and subdirectories are walked while their parent is still open
+static void gen_ext2_walk_dir(Trace *trace, size_t num_ops, Slots *slots,
+		int depth)
+{
+	uint32_t file = get_slot(slots);
+	uint32_t buf  = get_slot(slots);
+	push_op(trace, 'a', file, 148);
+	push_op(trace, 'a', buf,  4096);
+
+	size_t num_entries = rng_range(2, 40);
+	for (size_t i = 0; i < num_entries && trace->num_ops < num_ops; i++) {
+		uint32_t name  = get_slot(slots);
+		uint32_t entry = get_slot(slots);
+		push_op(trace, 'a', name,  rng_range(2, 32));
+		push_op(trace, 'a', entry, 132);
+		push_op(trace, 'f', name,  0);
+		put_slot(slots, name);
+
+		if (depth < 6 && rng() % 8 == 0)
+			gen_ext2_walk_dir(trace, num_ops, slots, depth + 1);
+
+		push_op(trace, 'f', entry, 0);
+		put_slot(slots, entry);
+	}
+
+	push_op(trace, 'f', buf,  0);
+	push_op(trace, 'f', file, 0);
+	put_slot(slots, buf);
+	put_slot(slots, file);
+}
+
+static void gen_ext2_walk(Trace *trace, size_t num_ops, Slots *slots)
+{
+	while (trace->num_ops < num_ops)
+		gen_ext2_walk_dir(trace, num_ops, slots, 0);
+}
+
+// Random sizes, mostly small with a long tail, around a live set of a few
+// thousand blocks
+#define RANDOM_LIVE 4096
+
+static void gen_random(Trace *trace, size_t num_ops, Slots *slots)
+{
+	uint32_t live[RANDOM_LIVE];
+	size_t   num_live = 0;
+
+	while (trace->num_ops < num_ops) {
+		if (num_live < RANDOM_LIVE && (num_live == 0 || rng() % 2 == 0)) {
+			uint32_t size = rng_range(1, rng() % 16 == 0 ? 65536 : 256);
+			live[num_live] = get_slot(slots);
+			push_op(trace, 'a', live[num_live++], size);
+		} else {
+			size_t i = rng() % num_live;
+			push_op(trace, 'f', live[i], 0);
+			put_slot(slots, live[i]);
+			live[i] = live[--num_live];
+		}
+	}
+}
+
+// Buffers that are appended to a bit at a time, like log buffers and growing
+// tables, with small objects being allocated and freed around them
+#define GROW_BUFFERS  64
+#define GROW_MAX_SIZE 65536
+
+static void gen_grow(Trace *trace, size_t num_ops, Slots *slots)
+{
+	uint32_t bufs[GROW_BUFFERS], sizes[GROW_BUFFERS];
+	uint32_t smalls[GROW_BUFFERS];
+
+	for (size_t i = 0; i < GROW_BUFFERS; i++) {
+		bufs[i]   = get_slot(slots);
+		smalls[i] = get_slot(slots);
+		sizes[i]  = rng_range(16, 256);
+		push_op(trace, 'a', bufs[i],   sizes[i]);
+		push_op(trace, 'a', smalls[i], rng_range(8, 128));
+	}
+
+	while (trace->num_ops < num_ops) {
+		size_t i = rng() % GROW_BUFFERS;
+
+		if (sizes[i] >= GROW_MAX_SIZE) {
+			// Done with this one; start again
+			push_op(trace, 'f', bufs[i], 0);
+			sizes[i] = rng_range(16, 256);
+			push_op(trace, 'a', bufs[i], sizes[i]);
+		} else if (rng() % 4 == 0) {
+			push_op(trace, 'f', smalls[i], 0);
+			push_op(trace, 'a', smalls[i], rng_range(8, 128));
+		} else {
+			sizes[i] += rng_range(16, 512);
+			push_op(trace, 'r', bufs[i], sizes[i]);
+		}
+	}
+
+	for (size_t i = 0; i < GROW_BUFFERS; i++) {
+		push_op(trace, 'f', bufs[i],   0);
+		push_op(trace, 'f', smalls[i], 0);
+	}
+}
+
+typedef struct Workload
+{
+	const char *name;
+	void      (*generate)(Trace*, size_t, Slots*);
+} Workload;
+
+static const Workload workloads[] =
+{
+	{ "boot",      gen_boot      },
+	{ "ext2-walk", gen_ext2_walk },
+	{ "random",    gen_random    },
+	{ "grow",      gen_grow      },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static bool generate_trace(Trace *trace, const char *name, size_t num_ops)
+{
+	for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+		if (strcmp(name, workloads[i].name) != 0)
+			continue;
+
+		Slots slots = { NULL, 0, 0 };
+		workloads[i].generate(trace, num_ops, &slots);
+		free(slots.free);
+
+		return true;
+	}
+
+	return false;
+}
+
+// IDs in trace files are mapped to slots with an open addressing hash table.
+// Freed IDs keep their entry, as the same address is likely to come back.
+typedef struct Id_map
+{
+	uint64_t *ids;
+	uint32_t *slots;
+	size_t    capacity;
+	size_t    count;
+} Id_map;
+
+#define HASH_MULT 0x9E3779B97F4A7C15ull
+
+// The slot for an ID, which can be changed through the pointer returned. IDs
+// we haven't seen before get a new slot.
+static uint32_t *id_slot(Id_map *map, uint64_t id)
+{
+	if (map->count * 2 >= map->capacity) {
+		Id_map bigger = { NULL, NULL, 0, 0 };
+		bigger.capacity = map->capacity ? map->capacity * 2 : 1024;
+		bigger.ids      = malloc(bigger.capacity * sizeof(uint64_t));
+		bigger.slots    = malloc(bigger.capacity * sizeof(uint32_t));
+		memset(bigger.ids, 0xFF, bigger.capacity * sizeof(uint64_t));
+
+		for (size_t i = 0; i < map->capacity; i++) {
+			if (map->ids[i] == UINT64_MAX)
+				continue;
+
+			size_t j = (map->ids[i] * HASH_MULT) % bigger.capacity;
+			while (bigger.ids[j] != UINT64_MAX)
+				j = (j + 1) % bigger.capacity;
+
+			bigger.ids[j]   = map->ids[i];
+			bigger.slots[j] = map->slots[i];
+		}
+
+		bigger.count = map->count;
+		free(map->ids);
+		free(map->slots);
+		*map = bigger;
+	}
+
+	size_t i = (id * HASH_MULT) % map->capacity;
+	for (; map->ids[i] != UINT64_MAX; i = (i + 1) % map->capacity)
+		if (map->ids[i] == id)
+			return &map->slots[i];
+
+	map->ids[i]   = id;
+	map->slots[i] = map->count++;
+	return &map->slots[i];
+}
+
+static bool load_trace(Trace *trace, const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	if (file == NULL)
+		return false;
+
+	Id_map map = { NULL, NULL, 0, 0 };
+	char   line[256];
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char          type;
+		long long     id, new_id;
+		unsigned long size = 0;
+
+		if (sscanf(line, " r %lli %lli %lu", &id, &new_id, &size) == 3) {
+			// The block keeps its slot under its new name
+			uint32_t slot = *id_slot(&map, id);
+			*id_slot(&map, new_id) = slot;
+			push_op(trace, 'r', slot, size);
+			continue;
+		}
+
+		int fields = sscanf(line, " %c %lli %lu", &type, &id, &size);
+		if (fields < 2 || (type != 'f' && fields < 3) ||
+				(type != 'a' && type != 'A' && type != 'f'))
+			continue;
+
+		push_op(trace, type, *id_slot(&map, id), size);
+	}
+
+	free(map.ids);
+	free(map.slots);
+	fclose(file);
+
+	return true;
+}
+
+static void dump_trace(Trace *trace)
+{
+	printf("# %s\n", trace->name);
+	for (size_t i = 0; i < trace->num_ops; i++) {
+		Op *op = &trace->ops[i];
+
+		if (op->type == 'f')
+			printf("f %u\n", op->slot);
+		else if (op->type == 'r')
+			printf("r %u %u %u\n", op->slot, op->slot, op->size);
+		else
+			printf("%c %u %u\n", op->type, op->slot, op->size);
+	}
+}
+
+
+// Replaying
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+// Free space that isn't in the largest hole, as a percentage of all free
+// space. 0 means all the free space is in one piece. The figure reported is
+// the average over the whole replay.
+static double fragmentation(Heap *heap)
+{
+	size_t total_free = 0, largest = 0;
+
+	for (uintptr_t pos = heap->start_addr; pos < heap->end_addr;) {
+		Header *header = (Header*)pos;
+
+		if (header->is_hole) {
+			total_free += header->size;
+			if (header->size > largest)
+				largest = header->size;
+		}
+
+		pos += header->size;
+	}
+
+	return total_free == 0 ? 0 : 100.0 * (total_free - largest) / total_free;
+}
+
+// How often (in operations) to sample fragmentation while replaying
+#define FRAG_SAMPLE_INTERVAL 4096
+
+static void replay(Trace *trace)
+{
+	// Reserve the whole heap range. Pages get mapped as they're touched.
+	void *mem = mmap(NULL, HEAP_MAX_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	arena = (uintptr_t)mem;
+	memset(arena_pages, 0, sizeof(arena_pages));
+	mapped_pages = peak_mapped_pages = 0;
+
+	Heap *heap = create_heap(arena, arena + HEAP_INIT_SIZE,
+			arena + HEAP_MAX_SIZE, false, false);
+
+	void    **ptrs     = calloc(trace->num_slots, sizeof(void*));
+	uint32_t *sizes    = calloc(trace->num_slots, sizeof(uint32_t));
+	uint32_t *times    = malloc(trace->num_ops * sizeof(uint32_t));
+	size_t    num_done = 0;
+	size_t    live     = 0, peak_live = 0;
+	size_t    peak_heap = 0;
+
+	// Work out how long it takes to read the clock, so we can take it off
+	uint64_t overhead = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t start = now_ns();
+		uint64_t t     = now_ns() - start;
+		if (t < overhead)
+			overhead = t;
+	}
+
+	uint64_t total     = 0;
+	double   frag_sum  = 0;
+	size_t   frag_runs = 0;
+
+	for (size_t i = 0; i < trace->num_ops; i++) {
+		Op *op = &trace->ops[i];
+
+		// Traces can contain frees of things allocated before recording
+		// started, or allocations on top of ones we never saw freed
+		bool needs_block = op->type == 'f' || op->type == 'r';
+		if (needs_block == (ptrs[op->slot] == NULL))
+			continue;
+
+		uint64_t start = now_ns();
+		if (op->type == 'f')
+			heap_free(heap, ptrs[op->slot]);
+		else if (op->type == 'r')
+			ptrs[op->slot] = heap_realloc(heap, ptrs[op->slot], op->size);
+		else
+			ptrs[op->slot] = alloc(heap, op->size, op->type == 'A');
+		uint64_t t = now_ns() - start;
+
+		t = t > overhead ? t - overhead : 0;
+		times[num_done++] = t;
+		total += t;
+
+		if (op->type == 'f') {
+			ptrs[op->slot] = NULL;
+			live -= sizes[op->slot];
+		} else {
+			if (op->type == 'r')
+				live -= sizes[op->slot];
+
+			sizes[op->slot] = op->size;
+			live += op->size;
+			if (live > peak_live)
+				peak_live = live;
+
+			// Touch it, so we'd notice if it wasn't mapped
+			memset(ptrs[op->slot], 0xA5, op->size < 64 ? op->size : 64);
+		}
+
+		size_t heap_size = heap->end_addr - heap->start_addr;
+		if (heap_size > peak_heap)
+			peak_heap = heap_size;
+
+		if (num_done % FRAG_SAMPLE_INTERVAL == 0) {
+			frag_sum += fragmentation(heap);
+			frag_runs++;
+		}
+	}
+
+	double frag = frag_runs ? frag_sum / frag_runs : fragmentation(heap);
+
+	qsort(times, num_done, sizeof(uint32_t), compare_u32);
+	uint32_t p50 = num_done ? times[num_done / 2]        : 0;
+	uint32_t p99 = num_done ? times[num_done * 99 / 100] : 0;
+
+	printf("%-12s %9zu %9.2f %8u %8u %10zu %10zu %7.1f%% %7.1f%%\n",
+			trace->name, num_done,
+			total ? num_done * 1000.0 / total : 0.0, p50, p99,
+			peak_heap / 1024, peak_mapped_pages * PAGE_SIZE / 1024,
+			peak_heap ? 100.0 * peak_live / peak_heap : 0.0, frag);
+
+	free(ptrs);
+	free(sizes);
+	free(times);
+	free(heap);
+	munmap(mem, HEAP_MAX_SIZE);
+}
+
+const char USAGE_FMT[] =
+	"Usage: %s [-n OPS] [-s SEED] [-d] [WORKLOAD|TRACE_FILE]...\n";
+
+int main(int argc, char *argv[])
+{
+	size_t   num_ops = 1000000;
+	uint64_t seed    = 0x5EED;
+	bool     dump    = false;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = segv_handler;
+	action.sa_flags     = SA_SIGINFO;
+	sigaction(SIGSEGV, &action, NULL);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:d")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			dump = true;
+			break;
+		default:
+			fprintf(stderr, USAGE_FMT, argv[0]);
+			return 1;
+		}
+	}
+
+	const char *defaults[NUM_WORKLOADS];
+	for (size_t i = 0; i < NUM_WORKLOADS; i++)
+		defaults[i] = workloads[i].name;
+
+	const char **names     = (const char**)argv + optind;
+	int          num_names = argc - optind;
+	if (num_names == 0) {
+		names     = defaults;
+		num_names = NUM_WORKLOADS;
+	}
+
+	if (!dump)
+		printf("%-12s %9s %9s %8s %8s %10s %10s %8s %8s\n", "workload",
+				"ops", "Mops/s", "p50 ns", "p99 ns", "peak KiB",
+				"peak RSS", "util", "frag");
+
+	for (int i = 0; i < num_names; i++) {
+		Trace trace = { names[i], NULL, 0, 0, 0 };
+		rng_state   = seed;
+
+		if (!generate_trace(&trace, names[i], num_ops) &&
+				!load_trace(&trace, names[i])) {
+			fprintf(stderr, "No such workload or trace file: %s\n", names[i]);
+			return 1;
+		}
+
+		if (dump)
+			dump_trace(&trace);
+		else
+			replay(&trace);
+
+		free(trace.ops);
+	}
+
+	return 0;
+}
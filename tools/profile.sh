@@ -0,0 +1,88 @@
+#!/bin/sh
+# Turn the samples the kernel's profiler sends over the serial port into a
+# flat profile, or with -f, folded stacks for flamegraph.pl.
+#
+# Usage: tools/profile.sh [-f] studix-*.bin < serial.log
+
+folded=0
+sort_flags=-rn
+if [ "$1" = "-f" ]; then
+	folded=1
+	sort_flags=
+	shift
+fi
+
+if [ $# -ne 1 ]; then
+	echo "Usage: $0 [-f] kernel.bin < serial.log" >&2
+	exit 1
+fi
+
+syms=$(mktemp)
+trap 'rm -f "$syms"' EXIT
+nm -n --defined-only "$1" > "$syms" || exit 1
+
+awk -v folded=$folded '
+function hex(s,    i, n) {
+	n = 0
+	s = tolower(s)
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return n
+}
+
+# Symbols come first, sorted by address, so find the last one at or below
+# the address
+function lookup(addr,    lo, hi, mid) {
+	if (nsyms == 0 || addr < sym_addr[1])
+		return sprintf("0x%x", addr)
+
+	lo = 1
+	hi = nsyms
+	while (lo < hi) {
+		mid = int((lo + hi + 1) / 2)
+		if (sym_addr[mid] <= addr)
+			lo = mid
+		else
+			hi = mid - 1
+	}
+	return sym_name[lo]
+}
+
+# Reading the symbols from nm
+FNR == NR && $2 ~ /^[Tt]$/ {
+	nsyms++
+	sym_addr[nsyms] = hex($1)
+	sym_name[nsyms] = $3
+	next
+}
+FNR == NR { next }
+
+# Then the serial log
+{ sub(/\r$/, "") }
+/^profile: end/ { inside = 0; next }
+/^profile:/     { inside = 1; print "#", $0 > "/dev/stderr"; next }
+!inside         { next }
+
+{
+	samples++
+
+	# Return addresses point after the call, which may be past the end of
+	# the function that made it
+	self = lookup(hex($1))
+	stack = self
+	for (i = 2; i <= NF; i++)
+		stack = lookup(hex($i) - 1) ";" stack
+
+	flat[self]++
+	stacks[stack]++
+}
+
+END {
+	if (folded) {
+		for (s in stacks)
+			print s, stacks[s]
+	} else {
+		for (f in flat)
+			printf "%6.2f%% %6d  %s\n", 100 * flat[f] / samples, flat[f], f
+	}
+}' "$syms" - | sort $sort_flags